@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+#
+# Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+#
+# This program is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published
+# by the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+# End-to-end benchmark for xmpp-bridge. Runs the bridge against a minimal
+# stand-in XMPP server on localhost (STARTTLS with a throwaway self-signed
+# certificate, SASL PLAIN, resource binding, message routing) and measures:
+#
+#   outbound: lines written to the bridge's stdin -> messages at the server
+#   inbound:  messages flooded by the server -> lines on the bridge's stdout
+#
+# Usage: bench.py path/to/xmpp-bridge
+# Tunables (environment): BENCH_LINES, BENCH_LINE_BYTES, BENCH_FLOOD, BENCH_ARGS
+
+import os
+import shlex
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import xml.parsers.expat
+from xml.sax.saxutils import escape, quoteattr
+
+DOMAIN    = "localhost"
+BRIDGE    = "bridge@" + DOMAIN
+PEER      = "peer@" + DOMAIN
+PEER_FULL = PEER + "/bench"
+
+NS_TLS     = "urn:ietf:params:xml:ns:xmpp-tls"
+NS_SASL    = "urn:ietf:params:xml:ns:xmpp-sasl"
+NS_BIND    = "urn:ietf:params:xml:ns:xmpp-bind"
+NS_RECEIPT = "urn:xmpp:receipts"
+
+################################################################################
+# stand-in server
+
+class Element:
+    def __init__(self, name, attrs):
+        self.name, self.attrs, self.children, self.text = name, attrs, [], ""
+
+    def child(self, name):
+        return next((c for c in self.children if c.name == name), None)
+
+
+class Server:
+    """Accepts a single client connection and plays both the server and the
+    peer that the bridge talks to."""
+
+    def __init__(self, certfile, keyfile, flood=0):
+        self.tls = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        self.tls.load_cert_chain(certfile, keyfile)
+        self.listener = socket.socket()
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(1)
+        self.port = self.listener.getsockname()[1]
+        self.flood = flood
+        self.flood_sent = 0
+
+        self.ready = threading.Event()    # bridge is online
+        self.closed = threading.Event()   # bridge has disconnected
+        self.lock = threading.Lock()
+        self.messages = 0
+        self.lines = 0
+        self.bytes = 0
+        self.latencies = []               # seconds, from the timestamps in the lines
+        self.first_at = self.last_at = None
+        self.flood_started_at = None
+
+        threading.Thread(target=self.run, daemon=True).start()
+
+    def send(self, data):
+        self.sock.sendall(data.encode())
+
+    def run(self):
+        self.sock, _ = self.listener.accept()
+        self.new_parser()
+        try:
+            while not self.closed.is_set():
+                # the flood is sent from this thread too, since an SSL socket
+                # must not be used from several threads at once
+                flooding = self.ready.is_set() and self.flood_sent < self.flood
+                if flooding:
+                    self.send_flood(100)
+                self.sock.settimeout(0.001 if flooding else None)
+                try:
+                    data = self.sock.recv(65536)
+                except socket.timeout:
+                    continue
+                finally:
+                    self.sock.settimeout(None)
+                if not data:
+                    break
+                self.parser.Parse(data, False)
+                # handle complete stanzas outside of the parser callbacks,
+                # since STARTTLS and SASL replace the parser
+                while self.pending:
+                    self.handle(self.pending.pop(0))
+        except (OSError, xml.parsers.expat.ExpatError) as e:
+            print("bench: server: {}".format(e), file=sys.stderr)
+        self.closed.set()
+
+    def new_parser(self):
+        self.parser = xml.parsers.expat.ParserCreate()
+        self.parser.StartElementHandler = self.on_start
+        self.parser.EndElementHandler = self.on_end
+        self.parser.CharacterDataHandler = self.on_text
+        self.stack = []
+        self.pending = []
+
+    def on_start(self, name, attrs):
+        element = Element(name, attrs)
+        if not self.stack and name == "stream:stream":
+            self.pending.append(element)
+        elif self.stack:
+            self.stack[-1].children.append(element)
+        self.stack.append(element)
+
+    def on_end(self, name):
+        element = self.stack.pop()
+        if len(self.stack) == 1:
+            self.pending.append(element)
+        elif not self.stack:
+            self.pending.append(Element("/stream", {}))
+
+    def on_text(self, text):
+        if len(self.stack) > 1:
+            self.stack[-1].text += text
+
+    def open_stream(self, features):
+        self.send("<?xml version='1.0'?><stream:stream xmlns='jabber:client' "
+                  "xmlns:stream='http://etherx.jabber.org/streams' version='1.0' "
+                  "from='{}' id='{}'><stream:features>{}</stream:features>".format(
+                      DOMAIN, os.urandom(8).hex(), features))
+
+    def handle(self, stanza):
+        name = stanza.name
+        if name == "stream:stream":
+            if isinstance(self.sock, ssl.SSLSocket):
+                if getattr(self, "authenticated", False):
+                    self.open_stream("<bind xmlns='{}'/>".format(NS_BIND))
+                else:
+                    self.open_stream("<mechanisms xmlns='{}'><mechanism>PLAIN</mechanism></mechanisms>".format(NS_SASL))
+            else:
+                self.open_stream("<starttls xmlns='{}'><required/></starttls>".format(NS_TLS))
+        elif name == "/stream":
+            self.send("</stream:stream>")
+            self.closed.set()
+        elif name == "starttls":
+            self.send("<proceed xmlns='{}'/>".format(NS_TLS))
+            self.sock = self.tls.wrap_socket(self.sock, server_side=True)
+            self.new_parser()
+        elif name == "auth":
+            self.send("<success xmlns='{}'/>".format(NS_SASL))
+            self.authenticated = True
+            self.new_parser()
+        elif name == "iq":
+            self.handle_iq(stanza)
+        elif name == "presence":
+            self.ready.set()
+        elif name == "message":
+            self.handle_message(stanza)
+
+    def handle_iq(self, iq):
+        iq_id = quoteattr(iq.attrs.get("id", ""))
+        if iq.child("bind") is not None:
+            resource = iq.child("bind").child("resource")
+            jid = BRIDGE + "/" + (resource.text if resource is not None else "bench")
+            self.send("<iq type='result' id={}><bind xmlns='{}'><jid>{}</jid></bind></iq>".format(iq_id, NS_BIND, escape(jid)))
+        elif iq.attrs.get("type") in ("get", "set"):
+            self.send("<iq type='error' id={}><error type='cancel'><service-unavailable "
+                      "xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></iq>".format(iq_id))
+
+    def handle_message(self, message):
+        now = time.monotonic()
+        body = message.child("body")
+        if body is not None:
+            with self.lock:
+                self.messages += 1
+                self.bytes += len(body.text.encode())
+                for line in body.text.split("\n"):
+                    self.lines += 1
+                    self.latencies.append(now - float(line.split(" ", 1)[0]))
+                self.first_at = self.first_at or now
+                self.last_at = now
+        # acknowledge like a receipt-capable client would (for --trace-latency)
+        if message.child("request") is not None and "id" in message.attrs:
+            self.send("<message from='{}' to={}><received xmlns='{}' id={}/></message>".format(
+                PEER_FULL, quoteattr(message.attrs.get("from", BRIDGE)), NS_RECEIPT, quoteattr(message.attrs["id"])))
+
+    def send_flood(self, count):
+        self.flood_started_at = self.flood_started_at or time.monotonic()
+        for idx in range(self.flood_sent, min(self.flood, self.flood_sent + count)):
+            self.flood_sent += 1
+            self.send("<message type='chat' from='{}' to='{}'><body>{:.6f} inbound message {}</body></message>".format(
+                PEER_FULL, BRIDGE, time.monotonic(), idx))
+
+################################################################################
+# driver
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, len(values) * p // 100)] if values else float("nan")
+
+
+def start_bridge(binary, server, tmpdir):
+    env = dict(os.environ,
+               XMPPBRIDGE_JID=BRIDGE, XMPPBRIDGE_PASSWORD="bench", XMPPBRIDGE_PEER_JID=PEER)
+    args = [binary, "--server=127.0.0.1:{}".format(server.port), "--trust-tls", "--no-drop-privileges"]
+    args += shlex.split(os.environ.get("BENCH_ARGS", ""))
+    stderr = open(os.path.join(tmpdir, "bridge.log"), "w")
+    return subprocess.Popen(args, env=env, stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=stderr)
+
+
+def wait_bridge(proc):
+    _, status, rusage = os.wait4(proc.pid, 0)
+    proc.returncode = os.waitstatus_to_exitcode(status) if hasattr(os, "waitstatus_to_exitcode") else status
+    return rusage.ru_maxrss # KiB on Linux
+
+
+def report(name, count, unit, nbytes, seconds, latencies, rss_kib):
+    print("{:<9} {:>8} {} in {:.3f} s: {:>10.0f} {}/s {:>8.2f} MiB/s   latency p50 {:.2f} ms, p99 {:.2f} ms   peak RSS {} KiB".format(
+        name, count, unit, seconds, count / seconds if seconds else 0, unit, nbytes / seconds / 2**20 if seconds else 0,
+        percentile(latencies, 50) * 1000, percentile(latencies, 99) * 1000, rss_kib))
+
+
+def bench_outbound(binary, cert, key, tmpdir, lines, line_bytes):
+    server = Server(cert, key)
+    proc = start_bridge(binary, server, tmpdir)
+    if not server.ready.wait(30):
+        sys.exit("bench: bridge did not come online (see {}/bridge.log)".format(tmpdir))
+
+    # each line starts with the time at which it was written
+    padding = "x" * max(0, line_bytes - 18)
+    started_at = time.monotonic()
+    for idx in range(lines):
+        proc.stdin.write("{:.6f} {}\n".format(time.monotonic(), padding).encode())
+    proc.stdin.close()
+    server.closed.wait(120)
+    rss = wait_bridge(proc)
+
+    with server.lock:
+        seconds = (server.last_at or started_at) - started_at
+        report("outbound", server.lines, "lines", server.bytes, seconds, server.latencies, rss)
+        if server.lines != lines:
+            print("bench: outbound: expected {} lines, got {}".format(lines, server.lines), file=sys.stderr)
+
+
+def bench_inbound(binary, cert, key, tmpdir, flood):
+    server = Server(cert, key, flood=flood)
+    proc = start_bridge(binary, server, tmpdir)
+
+    count, nbytes, latencies = 0, 0, []
+    for line in proc.stdout:
+        now = time.monotonic()
+        count += 1
+        nbytes += len(line)
+        latencies.append(now - float(line.split(b" ", 1)[0]))
+        if count == flood:
+            break
+    finished_at = time.monotonic()
+    proc.stdin.close()
+    rss = wait_bridge(proc)
+    report("inbound", count, "msgs", nbytes, finished_at - (server.flood_started_at or finished_at), latencies, rss)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: {} path/to/xmpp-bridge".format(sys.argv[0]))
+    binary = os.path.abspath(sys.argv[1])
+    lines      = int(os.environ.get("BENCH_LINES", 20000))
+    line_bytes = int(os.environ.get("BENCH_LINE_BYTES", 100))
+    flood      = int(os.environ.get("BENCH_FLOOD", 20000))
+
+    with tempfile.TemporaryDirectory(prefix="xmpp-bridge-bench.") as tmpdir:
+        cert, key = os.path.join(tmpdir, "cert.pem"), os.path.join(tmpdir, "key.pem")
+        subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1",
+                        "-subj", "/CN=" + DOMAIN, "-keyout", key, "-out", cert],
+                       check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        bench_outbound(binary, cert, key, tmpdir, lines, line_bytes)
+        bench_inbound(binary, cert, key, tmpdir, flood)
+
+
+if __name__ == "__main__":
+    main()
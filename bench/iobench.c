@@ -0,0 +1,352 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+//Microbenchmark for the buffer layer in io.c: reading lines (io_handle_poll()
+//and io_getlines()) and writing them (io_write() and io_handle_poll()), over
+//pipes or memory-backed files, with configurable line lengths and burst sizes.
+//
+//Must be linked with -Wl,--wrap=malloc -Wl,--wrap=realloc, so that the
+//allocations in io.c can be counted.
+
+#define _GNU_SOURCE //F_SETPIPE_SZ, memfd_create()
+
+#include "xmpp-bridge.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define PIPE_SIZE (1<<20)
+
+////////////////////////////////////////////////////////////////////////////////
+// allocation counters
+
+static unsigned long long malloc_count  = 0;
+static unsigned long long realloc_count = 0;
+
+void* __real_malloc(size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    ++malloc_count;
+    return __real_malloc(size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    ++realloc_count;
+    return __real_realloc(ptr, size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// helpers
+
+struct Params {
+    const char* name;
+    size_t line_len;   //bytes per line (without "\n")
+    size_t alt_len;    //if > 0, every other line has this length instead
+    size_t burst;      //bytes written/read per round
+    size_t total;      //total bytes per run
+    bool use_pipe;     //else use a memory-backed file (reads are just a memcpy)
+};
+
+static long long clock_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Generates the input as one continuous stream of lines, so that lines may
+//span several bursts.
+struct LineGen {
+    size_t line_pos; //position in the current line
+    size_t lines;    //number of completed lines
+};
+
+//Fill @a buf with the next @a size bytes of the stream described by @a p, and
+//return the number of lines that were completed.
+static size_t fill_lines(char* buf, size_t size, struct LineGen* gen, const struct Params* p) {
+    const size_t lines_before = gen->lines;
+    for (size_t pos = 0; pos < size; ++pos) {
+        const size_t len = (p->alt_len > 0 && gen->lines % 2 == 1) ? p->alt_len : p->line_len;
+        if (gen->line_pos == len) {
+            buf[pos] = '\n';
+            gen->line_pos = 0;
+            ++gen->lines;
+        } else {
+            buf[pos] = 'a' + (gen->line_pos++ % 26);
+        }
+    }
+    return gen->lines - lines_before;
+}
+
+//Return a pair of file descriptors: either a pipe, or a file in memory that
+//is opened twice.
+static bool open_channel(const struct Params* p, int fds[2]) {
+    if (p->use_pipe) {
+        if (pipe(fds) < 0) {
+            perror("pipe()");
+            return false;
+        }
+        //make room for a whole burst, so that one thread can write and read
+        fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        return true;
+    }
+    fds[1] = memfd_create("iobench", 0);
+    if (fds[1] < 0) {
+        perror("memfd_create()");
+        return false;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[1]);
+    fds[0] = open(path, O_RDONLY);
+    if (fds[0] < 0) {
+        perror("open()");
+        return false;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            perror("write()");
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+//Run io_handle_poll() as if poll() had reported all fds of @a io as ready.
+//The PollSet is reused like in main(), so that its allocation is not counted.
+static bool handle_ready(struct IO* io, struct PollSet* ps) {
+    ps->count = 0;
+    io_prepare_poll(io, ps);
+    for (size_t idx = 0; idx < ps->count; ++idx) {
+        ps->fds[idx].revents = ps->fds[idx].events;
+    }
+    return io_handle_poll(io, ps);
+}
+
+//Read everything that is currently in the (non-blocking) pipe @a fd.
+static bool drain_pipe(int fd, char* buf) {
+    while (true) {
+        const ssize_t count = read(fd, buf, PIPE_SIZE);
+        if (count > 0) {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        perror("read()");
+        return false;
+    }
+}
+
+static void report(const char* what, const struct Params* p, long long nsec, size_t bytes, size_t lines,
+                   unsigned long long mallocs, unsigned long long reallocs) {
+    printf("%-9s %-10s line=%-8zu burst=%-8zu %-4s  %7.3f ns/byte  %9.1f ns/line  %7.4f allocs/line  %8llu reallocs\n",
+        what, p->name, p->line_len, p->burst, p->use_pipe ? "pipe" : "mem",
+        (double) nsec / bytes, (double) nsec / (lines ? lines : 1), (double) mallocs / (lines ? lines : 1), reallocs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// benchmarks
+
+//Write bursts into the channel, and read them back with io_handle_poll() and
+//io_getlines().
+static bool bench_read(const struct Params* p) {
+    int fds[2];
+    if (!open_channel(p, fds)) {
+        return false;
+    }
+    char* burst = malloc(p->burst);
+    struct LineGen gen = { 0, 0 };
+
+    struct IO io;
+    if (!io_init(&io, fds[0], open("/dev/null", O_WRONLY))) {
+        return false;
+    }
+    struct PollSet ps;
+    pollset_init(&ps);
+
+    //metrics.counters[] keeps counting across runs
+    const unsigned long long input_before = metrics.counters[COUNTER_INPUT_BYTES];
+    size_t bytes = 0, lines = 0;
+    long long nsec = 0;
+    const unsigned long long mallocs = malloc_count, reallocs = realloc_count;
+    while (bytes < p->total) {
+        lines += fill_lines(burst, p->burst, &gen, p);
+        if (!write_all(fds[1], burst, p->burst)) {
+            return false;
+        }
+        bytes += p->burst;
+
+        //read until the whole burst has arrived in the ReadBuffer (a single
+        //read() may not get all of it), and consume the complete lines
+        const long long start = clock_nsec();
+        while (metrics.counters[COUNTER_INPUT_BYTES] - input_before < bytes) {
+            if (!handle_ready(&io, &ps)) {
+                return false;
+            }
+            const char* data;
+            size_t size;
+            while (io_getlines(&io, &data, &size)) {
+                continue;
+            }
+        }
+        nsec += clock_nsec() - start;
+    }
+    report("getlines", p, nsec, bytes, lines, malloc_count - mallocs, realloc_count - reallocs);
+
+    io_free(&io);
+    free(ps.fds);
+    free(burst);
+    close(io.out_fd);
+    close(fds[0]);
+    close(fds[1]);
+    return true;
+}
+
+//Queue lines with io_write(), and flush them into the channel with
+//io_handle_poll().
+static bool bench_write(const struct Params* p) {
+    int fds[2];
+    if (!open_channel(p, fds)) {
+        return false;
+    }
+    char* burst = malloc(p->burst);
+    struct LineGen gen = { 0, 0 };
+    char* drain = malloc(PIPE_SIZE);
+
+    struct IO io;
+    if (!io_init(&io, -1, fds[1])) {
+        return false;
+    }
+    io.paused = true; //there is no input
+    struct PollSet ps;
+    pollset_init(&ps);
+    if (p->use_pipe) {
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    size_t bytes = 0, lines = 0;
+    long long nsec = 0;
+    const unsigned long long mallocs = malloc_count, reallocs = realloc_count;
+    while (bytes < p->total) {
+        lines += fill_lines(burst, p->burst, &gen, p);
+
+        const long long start = clock_nsec();
+        //one io_write() per line, like message_handler() does per message
+        const char* line = burst;
+        const char* end  = burst + p->burst;
+        while (line < end) {
+            const char* nl = memchr(line, '\n', end - line);
+            const size_t len = (nl == NULL ? end : nl + 1) - line;
+            io_write(&io, line, len);
+            line += len;
+        }
+        long long unmeasured = 0;
+        while (true) {
+            if (!handle_ready(&io, &ps)) {
+                return false;
+            }
+            if (io.out_queue.size == 0) {
+                break;
+            }
+            //the pipe is full (small writes do not pack its pages densely, so
+            //it may not take a whole burst) - empty it without measuring that
+            const long long drain_start = clock_nsec();
+            if (!drain_pipe(fds[0], drain)) {
+                return false;
+            }
+            unmeasured += clock_nsec() - drain_start;
+        }
+        nsec += clock_nsec() - start - unmeasured;
+        bytes += p->burst;
+
+        //empty the channel again (not measured)
+        if (p->use_pipe) {
+            if (!drain_pipe(fds[0], drain)) {
+                return false;
+            }
+        } else {
+            lseek(fds[1], 0, SEEK_SET);
+        }
+    }
+    report("write", p, nsec, bytes, lines, malloc_count - mallocs, realloc_count - reallocs);
+
+    io_free(&io);
+    free(ps.fds);
+    free(burst);
+    free(drain);
+    close(fds[0]);
+    close(fds[1]);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    //the default matrix; with arguments LINE_LEN BURST [ALT_LEN], run just that
+    static const struct Params defaults[] = {
+        { "tiny",       8,          0,      4096,      64 << 20, true },
+        { "tiny",       8,          0,      1 << 20,   64 << 20, true },
+        { "short",      80,         0,      4096,      64 << 20, true },
+        { "short",      80,         0,      1 << 20,   64 << 20, true },
+        { "short",      80,         0,      1 << 20,   64 << 20, false },
+        { "long",       64 << 10,   0,      1 << 20,   64 << 20, true },
+        { "huge",       4 << 20,    0,      1 << 20,   64 << 20, false },
+        //oscillate around SHRINK_STEP (1 MiB in io.c): huge and tiny lines alternate
+        { "oscillate",  (1 << 20) + 4096, 16, 1 << 20, 64 << 20, false },
+    };
+
+    const char* total = getenv("IOBENCH_TOTAL");
+    struct Params custom = { "custom", 80, 0, 4096, 64 << 20, true };
+    const struct Params* params = defaults;
+    size_t count = sizeof(defaults) / sizeof(defaults[0]);
+    if (argc >= 3) {
+        custom.line_len = strtoull(argv[1], NULL, 10);
+        custom.burst    = strtoull(argv[2], NULL, 10);
+        custom.alt_len  = argc >= 4 ? strtoull(argv[3], NULL, 10) : 0;
+        custom.use_pipe = custom.burst <= PIPE_SIZE;
+        if (custom.line_len == 0 || custom.burst == 0) {
+            fprintf(stderr, "usage: %s [LINE_LEN BURST [ALT_LEN]]\n", argv[0]);
+            return 1;
+        }
+        params = &custom;
+        count  = 1;
+    }
+
+    metrics_init();
+    for (size_t idx = 0; idx < count; ++idx) {
+        struct Params p = params[idx];
+        if (total != NULL) {
+            p.total = strtoull(total, NULL, 10);
+        }
+        if (!bench_read(&p) || !bench_write(&p)) {
+            return 1;
+        }
+    }
+    return 0;
+}
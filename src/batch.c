@@ -0,0 +1,125 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#define _GNU_SOURCE //memrchr
+
+#include "xmpp-bridge.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define GROW_STEP (1<<12)
+
+void batch_init(struct Batch* batch) {
+    batch->buffer   = NULL; //allocated on first use
+    batch->size     = 0;
+    batch->capacity = 0;
+    batch->deadline = 0;
+    batch->read_at  = 0;
+}
+
+//Prepare @a batch for appending @a size bytes of lines.
+static void batch_reserve(struct Batch* batch, size_t size, long long read_at, long long deadline) {
+    //the first lines in the batch determine when it is due
+    if (batch->size == 0) {
+        batch->deadline = deadline;
+        batch->read_at  = read_at;
+    }
+
+    //extend buffer if necessary (+1 for the "\n" that joins the lines)
+    const size_t needed = batch->size + size + 1;
+    if (batch->capacity < needed) {
+        //grow a bit bigger than needed to avoid repeated reallocation
+        batch->capacity = needed + GROW_STEP;
+        batch->buffer   = realloc(batch->buffer, batch->capacity);
+    }
+}
+
+void batch_add(struct Batch* batch, const char* data, size_t size, long long read_at, long long deadline) {
+    batch_reserve(batch, size, read_at, deadline);
+
+    //append lines to buffer
+    if (batch->size > 0) {
+        batch->buffer[batch->size++] = '\n';
+    }
+    memcpy(batch->buffer + batch->size, data, size);
+    batch->size += size;
+}
+
+void batch_add_prefixed(struct Batch* batch, const char* prefix, const char* data, size_t size, long long read_at, long long deadline) {
+    //count the lines first, to allocate only once
+    const size_t prefix_len = strlen(prefix);
+    size_t line_count = 1;
+    for (const char* nl_pos = data; (nl_pos = memchr(nl_pos, '\n', data + size - nl_pos)) != NULL; ++nl_pos) {
+        ++line_count;
+    }
+    batch_reserve(batch, size + line_count * prefix_len, read_at, deadline);
+
+    if (batch->size > 0) {
+        batch->buffer[batch->size++] = '\n';
+    }
+    const char* end = data + size;
+    while (true) {
+        const char* nl_pos = memchr(data, '\n', end - data);
+        const size_t line_len = (nl_pos == NULL ? end : nl_pos + 1) - data; //incl. '\n'
+        memcpy(batch->buffer + batch->size, prefix, prefix_len);
+        memcpy(batch->buffer + batch->size + prefix_len, data, line_len);
+        batch->size += prefix_len + line_len;
+        if (nl_pos == NULL) {
+            return;
+        }
+        data = nl_pos + 1;
+    }
+}
+
+void batch_clear(struct Batch* batch) {
+    batch->size = 0;
+    //release the buffer if a large burst has made it grow very large
+    if (batch->capacity > GROW_STEP * 16) {
+        free(batch->buffer);
+        batch->buffer   = NULL;
+        batch->capacity = 0;
+    }
+}
+
+size_t batch_split(const char* data, size_t size, size_t max_size, size_t* consumed) {
+    if (size <= max_size) {
+        *consumed = size;
+        return size;
+    }
+
+    //prefer to split after the last full line that fits
+    const char* nl_pos = memrchr(data, '\n', max_size + 1);
+    if (nl_pos != NULL) {
+        *consumed = nl_pos - data + 1; //+1 for '\n'
+        return nl_pos - data;
+    }
+
+    //a single line is too long - split it, but not inside a UTF-8 sequence
+    size_t result = max_size;
+    while (result > 0 && (data[result] & 0xC0) == 0x80) {
+        --result;
+    }
+    if (result == 0) {
+        result = max_size;
+    }
+    *consumed = result;
+    return result;
+}
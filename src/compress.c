@@ -0,0 +1,74 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <stdlib.h>
+#include <zlib.h>
+
+//below this size, compression does not save enough to be worth the effort
+#define COMPRESS_MIN_BYTES 128
+
+char* compress_payload(xmpp_ctx_t* ctx, const char* data, size_t size) {
+    if (size < COMPRESS_MIN_BYTES) {
+        return NULL;
+    }
+
+    uLongf compressed_size = compressBound(size);
+    unsigned char* compressed = malloc(compressed_size);
+    if (compress2(compressed, &compressed_size, (const Bytef*) data, size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(compressed);
+        return NULL;
+    }
+
+    //only use the compressed form if it is smaller even after Base64 encoding
+    char* encoded = NULL;
+    if ((compressed_size + 2) / 3 * 4 < size) {
+        encoded = xmpp_base64_encode(ctx, compressed, compressed_size);
+    }
+    free(compressed);
+    return encoded;
+}
+
+char* decompress_payload(xmpp_ctx_t* ctx, const char* encoded, size_t encoded_size, size_t size) {
+    if (size == 0 || size > DECOMPRESS_MAX_BYTES) {
+        return NULL;
+    }
+
+    unsigned char* compressed = NULL;
+    size_t compressed_size = 0;
+    xmpp_base64_decode_bin(ctx, encoded, encoded_size, &compressed, &compressed_size);
+    if (compressed == NULL) {
+        return NULL;
+    }
+
+    //the original size is known, so there is no need to inflate incrementally
+    //(and a payload cannot expand beyond it); one more byte is allocated, so
+    //that the caller can append a newline
+    char* data = malloc(size + 1);
+    uLongf data_size = size;
+    const int result = uncompress((Bytef*) data, &data_size, compressed, compressed_size);
+    xmpp_free(ctx, compressed);
+    if (result != Z_OK || data_size != size) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
@@ -26,16 +26,178 @@
 
 #define IS_STRING_EMPTY(x) ((x) == NULL || *(x) == '\0')
 
-bool config_init(struct Config* cfg) {
+//If @a arg has the form "<name>=<value>", return the value, else NULL.
+static const char* option_value(const char* arg, const char* name) {
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+        return NULL;
+    }
+    return arg + len + 1;
+}
+
+//Parse the value of --peer (IN_FD,OUT_FD,JID) or --peer-exec (JID,COMMAND).
+static bool parse_peer_option(struct Config* cfg, const char* arg, const char* value, bool exec) {
+    struct PeerSpec spec;
+    spec.in_fd   = -1;
+    spec.out_fd  = -1;
+    spec.command = NULL;
+
+    if (exec) {
+        const char* comma = strchr(value, ',');
+        if (comma == NULL || comma[1] == '\0') {
+            fprintf(stderr, "FATAL: invalid value in option: \"%s\"\n", arg);
+            return false;
+        }
+        spec.jid     = strndup(value, comma - value);
+        spec.command = comma + 1;
+    }
+    else {
+        char* end;
+        spec.in_fd = strtol(value, &end, 10);
+        if (end == value || *end != ',') {
+            fprintf(stderr, "FATAL: invalid value in option: \"%s\"\n", arg);
+            return false;
+        }
+        value = end + 1;
+        spec.out_fd = strtol(value, &end, 10);
+        if (end == value || *end != ',') {
+            fprintf(stderr, "FATAL: invalid value in option: \"%s\"\n", arg);
+            return false;
+        }
+        spec.jid = end + 1;
+    }
+
+    if (!validate_jid(spec.jid)) {
+        fprintf(stderr, "FATAL: '%s' is not a valid peer JID\n", spec.jid);
+        return false;
+    }
+    cfg->peer_specs = realloc(cfg->peer_specs, sizeof(struct PeerSpec) * (cfg->peer_spec_count + 1));
+    cfg->peer_specs[cfg->peer_spec_count++] = spec;
+    return true;
+}
+
+//Parse the value of --server (HOST or HOST:PORT).
+static bool parse_server_option(struct Config* cfg, const char* arg, const char* value) {
+    const char* colon = strrchr(value, ':');
+    if (colon == NULL) {
+        cfg->server_host = value;
+        cfg->server_port = 0; //default port
+        return true;
+    }
+    char* end;
+    const long port = strtol(colon + 1, &end, 10);
+    if (colon == value || colon[1] == '\0' || *end != '\0' || port < 1 || port > 65535) {
+        fprintf(stderr, "FATAL: invalid value in option: \"%s\"\n", arg);
+        return false;
+    }
+    cfg->server_host = strndup(value, colon - value);
+    cfg->server_port = port;
+    return true;
+}
+
+//Parse the value of an option that takes an integer of at least @a min.
+static bool parse_integer_option(const char* arg, const char* value, long long min, long long* result) {
+    char* end;
+    *result = strtoll(value, &end, 10);
+    if (IS_STRING_EMPTY(value) || *end != '\0' || *result < min) {
+        fprintf(stderr, "FATAL: invalid value in option: \"%s\"\n", arg);
+        return false;
+    }
+    return true;
+}
+
+void config_init(struct Config* cfg) {
     //initialize fields of `cfg`
     cfg->jid = getenv("XMPPBRIDGE_JID");
     cfg->password = getenv("XMPPBRIDGE_PASSWORD");
     cfg->peer_jid = getenv("XMPPBRIDGE_PEER_JID");
+    cfg->server_host = NULL;
+    cfg->server_port = 0;
+    cfg->trust_tls = false;
+    cfg->srv_cache_path = NULL;
+    cfg->trace_connect = false;
     cfg->show_delayed_messages = false;
     cfg->drop_privileges = geteuid() == 0; //by default, only when started as root
+    cfg->flush_interval = 0;
+    cfg->max_message_bytes = 65536;
+    cfg->rate_messages = 0;
+    cfg->rate_bytes = 0;
+    cfg->max_output_bytes = 0;
+    cfg->overflow_policy = OVERFLOW_PAUSE;
+    cfg->framing = FRAMING_LINES;
+    cfg->frame_metadata = false;
+    cfg->spill_dir = "/tmp";
+    cfg->reconnect = false;
+    cfg->outage_queue_bytes = 1 << 20;
+    cfg->daemon_path = NULL;
+    cfg->via_daemon_path = NULL;
+    cfg->has_command = false;
+    cfg->peer_specs = NULL;
+    cfg->peer_spec_count = 0;
+    cfg->capture_stderr = false;
+    cfg->stderr_prefix = NULL;
+    cfg->allow = NULL;
+    cfg->muc_jid = NULL;
+    cfg->muc_nick = NULL;
+    cfg->muc_from = NULL;
+    cfg->compress = false;
+    cfg->binary = false;
+    cfg->trace_latency = false;
+    cfg->io_uring = false;
+    cfg->transcript_path = NULL;
+    cfg->transcript_max_bytes = 0;
+    cfg->transcript_keep = 5;
+    cfg->journal_path = NULL;
+    cfg->catch_up_path = NULL;
+    cfg->catch_up_page = 50;
+    cfg->max_workers = 0;
+    cfg->worker_queue = 64;
+    cfg->metrics_path = NULL;
+    cfg->metrics_interval = 10000;
+    cfg->ibb_block_size = 4096;
+    cfg->ibb_window = 8;
     cfg->ctx = NULL;
     cfg->connected = false;
     cfg->connecting = false;
+    cfg->daemon = NULL;
+    cfg->router = NULL;
+    cfg->ibb = NULL;
+    cfg->latency = NULL;
+    cfg->transcript = NULL;
+    cfg->journal = NULL;
+    cfg->mam = NULL;
+    cfg->workers = NULL;
+}
+
+bool config_validate(const struct Config* cfg) {
+    //a client of a daemon does not talk to the XMPP server itself
+    if (cfg->via_daemon_path != NULL) {
+        if (cfg->daemon_path != NULL) {
+            fprintf(stderr, "FATAL: --daemon and --via-daemon cannot be combined\n");
+            return false;
+        }
+        if (cfg->capture_stderr) {
+            fprintf(stderr, "FATAL: --capture-stderr cannot be combined with --via-daemon\n");
+            return false;
+        }
+        if (cfg->journal_path != NULL || cfg->catch_up_path != NULL) {
+            fprintf(stderr, "FATAL: --journal and --catch-up cannot be combined with --via-daemon (use them on the daemon)\n");
+            return false;
+        }
+        if (cfg->max_workers > 0) {
+            fprintf(stderr, "FATAL: --workers cannot be combined with --via-daemon\n");
+            return false;
+        }
+        if (cfg->framing != FRAMING_LINES) {
+            fprintf(stderr, "FATAL: --framing cannot be combined with --via-daemon\n");
+            return false;
+        }
+        if (cfg->srv_cache_path != NULL || cfg->trace_connect) {
+            fprintf(stderr, "FATAL: --srv-cache and --trace-connect cannot be combined with --via-daemon (use them on the daemon)\n");
+            return false;
+        }
+        return true;
+    }
 
     //validate input
     bool valid = true;
@@ -50,14 +212,76 @@ bool config_init(struct Config* cfg) {
     }
 
     if (IS_STRING_EMPTY(cfg->peer_jid)) {
-        fprintf(stderr, "FATAL: $XMPPBRIDGE_PEER_JID is not set\n");
-        valid = false;
+        //not needed when other peers are configured (but the command line
+        //talks to this one)
+        if (cfg->peer_spec_count == 0 || cfg->daemon_path != NULL || cfg->allow != NULL || cfg->has_command) {
+            fprintf(stderr, "FATAL: $XMPPBRIDGE_PEER_JID is not set\n");
+            valid = false;
+        }
     }
     else if (!validate_jid(cfg->peer_jid)) {
         fprintf(stderr, "FATAL: '%s' is not a valid peer JID\n", cfg->peer_jid);
         valid = false;
     }
 
+    if (cfg->srv_cache_path != NULL && cfg->server_host != NULL) {
+        fprintf(stderr, "FATAL: --srv-cache cannot be combined with --server\n");
+        valid = false;
+    }
+    else if (cfg->srv_cache_path != NULL && IS_STRING_EMPTY(cfg->srv_cache_path)) {
+        fprintf(stderr, "FATAL: --srv-cache needs a file name\n");
+        valid = false;
+    }
+
+    if (cfg->daemon_path != NULL && cfg->has_command) {
+        fprintf(stderr, "FATAL: --daemon cannot be combined with a command line\n");
+        valid = false;
+    }
+
+    if (cfg->max_workers > 0 && !cfg->has_command) {
+        fprintf(stderr, "FATAL: --workers requires a command line\n");
+        valid = false;
+    }
+
+    if (cfg->binary && (cfg->daemon_path != NULL || cfg->muc_jid != NULL || cfg->peer_spec_count > 0)) {
+        fprintf(stderr, "FATAL: --binary cannot be combined with --daemon, --muc, --peer or --peer-exec\n");
+        valid = false;
+    }
+
+    //(an IBB stream cannot continue on a new session: the blocks in flight and
+    //the handlers for their acknowledgements are lost with the old one)
+    if (cfg->binary && cfg->reconnect) {
+        fprintf(stderr, "FATAL: --binary cannot be combined with --reconnect\n");
+        valid = false;
+    }
+
+    if (cfg->capture_stderr && cfg->binary) {
+        fprintf(stderr, "FATAL: --capture-stderr cannot be combined with --binary\n");
+        valid = false;
+    }
+
+    if ((cfg->journal_path != NULL || cfg->catch_up_path != NULL) && cfg->binary) {
+        fprintf(stderr, "FATAL: --journal and --catch-up cannot be combined with --binary\n");
+        valid = false;
+    }
+
+    //(the workers' stderr is not captured, but goes to our stderr)
+    if (cfg->max_workers > 0 && (cfg->daemon_path != NULL || cfg->muc_jid != NULL || cfg->binary || cfg->capture_stderr)) {
+        fprintf(stderr, "FATAL: --workers cannot be combined with --daemon, --muc, --binary or --capture-stderr\n");
+        valid = false;
+    }
+
+    //a frame is sent as one message, so it must not be joined with others in
+    //a batch (the daemon's clients and the journal only know lines)
+    if (cfg->framing != FRAMING_LINES && (cfg->binary || cfg->daemon_path != NULL || cfg->journal_path != NULL || cfg->flush_interval > 0)) {
+        fprintf(stderr, "FATAL: --framing cannot be combined with --binary, --daemon, --journal or --flush-interval\n");
+        valid = false;
+    }
+    if (cfg->frame_metadata && cfg->framing == FRAMING_LINES) {
+        fprintf(stderr, "FATAL: --frame-metadata requires --framing\n");
+        valid = false;
+    }
+
     if (IS_STRING_EMPTY(cfg->password)) {
         fprintf(stderr, "FATAL: $XMPPBRIDGE_PASSWORD is not set\n");
         valid = false;
@@ -75,24 +299,238 @@ bool config_consume_options(struct Config* cfg, int* argc, char*** argv) {
         //get next option argument
         char* arg = (*argv)[0];
         if (strncmp(arg, "--", 2) != 0) {
-            return true;
+            break;
         }
         //consume it
         (*argc)--;
         (*argv)++;
 
         //recognize option
+        const char* value;
+        long long number;
         if (strcmp(arg, "--show-delayed") == 0) {
             cfg->show_delayed_messages = true;
         }
+        else if ((value = option_value(arg, "--server")) != NULL) {
+            if (!parse_server_option(cfg, arg, value)) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--trust-tls") == 0) {
+            cfg->trust_tls = true;
+        }
+        else if ((value = option_value(arg, "--srv-cache")) != NULL) {
+            cfg->srv_cache_path = value;
+        }
+        else if (strcmp(arg, "--trace-connect") == 0) {
+            cfg->trace_connect = true;
+        }
         else if (strcmp(arg, "--drop-privileges") == 0) {
             cfg->drop_privileges = true;
         }
         else if (strcmp(arg, "--no-drop-privileges") == 0) {
             cfg->drop_privileges = false;
         }
+        else if ((value = option_value(arg, "--flush-interval")) != NULL) {
+            if (!parse_integer_option(arg, value, 0, &number)) {
+                return false;
+            }
+            cfg->flush_interval = number;
+        }
+        else if ((value = option_value(arg, "--max-message-bytes")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->max_message_bytes = number;
+        }
+        else if ((value = option_value(arg, "--rate-limit")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->rate_messages = number;
+        }
+        else if ((value = option_value(arg, "--rate-limit-bytes")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->rate_bytes = number;
+        }
+        else if ((value = option_value(arg, "--max-output-bytes")) != NULL) {
+            if (!parse_integer_option(arg, value, 0, &number)) {
+                return false;
+            }
+            cfg->max_output_bytes = number;
+        }
+        else if ((value = option_value(arg, "--on-output-full")) != NULL) {
+            if (strcmp(value, "pause") == 0) {
+                cfg->overflow_policy = OVERFLOW_PAUSE;
+            } else if (strcmp(value, "drop") == 0) {
+                cfg->overflow_policy = OVERFLOW_DROP;
+            } else if (strcmp(value, "spill") == 0) {
+                cfg->overflow_policy = OVERFLOW_SPILL;
+            } else {
+                fprintf(stderr, "FATAL: invalid value in option: \"%s\"\n", arg);
+                return false;
+            }
+        }
+        else if ((value = option_value(arg, "--framing")) != NULL) {
+            if (strcmp(value, "lines") == 0) {
+                cfg->framing = FRAMING_LINES;
+            } else if (strcmp(value, "netstring") == 0) {
+                cfg->framing = FRAMING_NETSTRING;
+            } else if (strcmp(value, "length") == 0) {
+                cfg->framing = FRAMING_LENGTH;
+            } else {
+                fprintf(stderr, "FATAL: invalid value in option: \"%s\"\n", arg);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--frame-metadata") == 0) {
+            cfg->frame_metadata = true;
+        }
+        else if ((value = option_value(arg, "--spill-dir")) != NULL) {
+            cfg->spill_dir = value;
+        }
+        else if (strcmp(arg, "--reconnect") == 0) {
+            cfg->reconnect = true;
+        }
+        else if ((value = option_value(arg, "--outage-queue-bytes")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->outage_queue_bytes = number;
+        }
+        else if ((value = option_value(arg, "--peer")) != NULL) {
+            if (!parse_peer_option(cfg, arg, value, false)) {
+                return false;
+            }
+        }
+        else if ((value = option_value(arg, "--peer-exec")) != NULL) {
+            if (!parse_peer_option(cfg, arg, value, true)) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--capture-stderr") == 0) {
+            cfg->capture_stderr = true;
+        }
+        else if ((value = option_value(arg, "--capture-stderr")) != NULL) {
+            cfg->capture_stderr = true;
+            cfg->stderr_prefix = value;
+        }
+        else if ((value = option_value(arg, "--allow")) != NULL) {
+            if (cfg->allow == NULL) {
+                cfg->allow = malloc(sizeof(struct JidFilter));
+                jid_filter_init(cfg->allow);
+            }
+            if (!jid_filter_add(cfg->allow, value)) {
+                fprintf(stderr, "FATAL: invalid JID rule in option: \"%s\"\n", arg);
+                return false;
+            }
+        }
+        else if ((value = option_value(arg, "--muc")) != NULL) {
+            //the room takes the place of $XMPPBRIDGE_PEER_JID
+            struct Jid jid;
+            const bool valid = jid_parse(value, &jid) && jid.local != NULL && jid.resource != NULL;
+            jid_free(&jid);
+            if (!valid) {
+                fprintf(stderr, "FATAL: expected ROOM@SERVICE/NICK in option: \"%s\"\n", arg);
+                return false;
+            }
+            const size_t bare_len = jid_bare_len(value);
+            cfg->muc_jid  = value;
+            cfg->muc_nick = value + bare_len + 1;
+            cfg->peer_jid = strndup(value, bare_len);
+        }
+        else if ((value = option_value(arg, "--muc-from")) != NULL) {
+            if (cfg->muc_from == NULL) {
+                cfg->muc_from = calloc(1, sizeof(struct JidSet));
+            }
+            jid_set_add(cfg->muc_from, value);
+        }
+        else if (strcmp(arg, "--compress") == 0) {
+            cfg->compress = true;
+        }
+        else if (strcmp(arg, "--binary") == 0) {
+            cfg->binary = true;
+        }
+        else if ((value = option_value(arg, "--ibb-block-size")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            if (number > 65535) {
+                fprintf(stderr, "FATAL: block size too large (max. 65535) in option: \"%s\"\n", arg);
+                return false;
+            }
+            cfg->ibb_block_size = number;
+        }
+        else if ((value = option_value(arg, "--ibb-window")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->ibb_window = number;
+        }
+        else if (strcmp(arg, "--trace-latency") == 0) {
+            cfg->trace_latency = true;
+        }
+        else if (strcmp(arg, "--io-uring") == 0) {
+            cfg->io_uring = true;
+        }
+        else if ((value = option_value(arg, "--transcript")) != NULL) {
+            cfg->transcript_path = value;
+        }
+        else if ((value = option_value(arg, "--transcript-max-bytes")) != NULL) {
+            if (!parse_integer_option(arg, value, 0, &number)) {
+                return false;
+            }
+            cfg->transcript_max_bytes = number;
+        }
+        else if ((value = option_value(arg, "--transcript-keep")) != NULL) {
+            if (!parse_integer_option(arg, value, 0, &number)) {
+                return false;
+            }
+            cfg->transcript_keep = number;
+        }
+        else if ((value = option_value(arg, "--journal")) != NULL) {
+            cfg->journal_path = value;
+        }
+        else if ((value = option_value(arg, "--catch-up")) != NULL) {
+            cfg->catch_up_path = value;
+        }
+        else if ((value = option_value(arg, "--catch-up-page")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->catch_up_page = number;
+        }
+        else if ((value = option_value(arg, "--workers")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->max_workers = number;
+        }
+        else if ((value = option_value(arg, "--worker-queue")) != NULL) {
+            if (!parse_integer_option(arg, value, 0, &number)) {
+                return false;
+            }
+            cfg->worker_queue = number;
+        }
+        else if ((value = option_value(arg, "--metrics-file")) != NULL) {
+            cfg->metrics_path = value;
+        }
+        else if ((value = option_value(arg, "--metrics-interval")) != NULL) {
+            if (!parse_integer_option(arg, value, 1, &number)) {
+                return false;
+            }
+            cfg->metrics_interval = number * 1000;
+        }
+        else if ((value = option_value(arg, "--daemon")) != NULL) {
+            cfg->daemon_path = value;
+        }
+        else if ((value = option_value(arg, "--via-daemon")) != NULL) {
+            cfg->via_daemon_path = value;
+        }
         else if (strcmp(arg, "--") == 0) {
-            return true;
+            break;
         }
         else {
             fprintf(stderr,
@@ -104,5 +542,6 @@ bool config_consume_options(struct Config* cfg, int* argc, char*** argv) {
         }
     }
 
+    cfg->has_command = *argc > 0;
     return true;
 }
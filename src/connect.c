@@ -0,0 +1,252 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// SRV cache
+
+//Look up the SRV record of the XMPP server for @a domain (RFC 6120, section
+//3.2.1), and pick the target with the lowest priority (and the highest weight
+//among those). If there is no record, the domain itself is the server.
+static bool srv_lookup(struct Endpoint* ep, const char* domain, long long* ttl) {
+    char name[1100];
+    snprintf(name, sizeof(name), "_xmpp-client._tcp.%s", domain);
+    unsigned char answer[NS_PACKETSZ * 4];
+    const int len = res_query(name, ns_c_in, ns_t_srv, answer, sizeof(answer));
+    if (len < 0) {
+        if (h_errno != HOST_NOT_FOUND && h_errno != NO_DATA) {
+            fprintf(stderr, "WARNING: SRV lookup for %s failed: %s\n", name, hstrerror(h_errno));
+            return false;
+        }
+        snprintf(ep->host, sizeof(ep->host), "%s", domain);
+        ep->port = 5222;
+        *ttl = SRV_CACHE_NONE_TTL;
+        return true;
+    }
+
+    ns_msg msg;
+    if (ns_initparse(answer, len, &msg) < 0) {
+        fprintf(stderr, "WARNING: could not parse SRV record for %s\n", name);
+        return false;
+    }
+    int best_priority = -1, best_weight = -1;
+    for (int idx = 0; idx < ns_msg_count(msg, ns_s_an); ++idx) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, idx, &rr) < 0 || ns_rr_type(rr) != ns_t_srv || ns_rr_rdlen(rr) < 7) {
+            continue;
+        }
+        const unsigned char* rdata = ns_rr_rdata(rr);
+        const int priority = ns_get16(rdata);
+        const int weight   = ns_get16(rdata + 2);
+        if (best_priority >= 0 && (priority > best_priority || (priority == best_priority && weight <= best_weight))) {
+            continue;
+        }
+        char target[NS_MAXDNAME];
+        if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 6, target, sizeof(target)) < 0) {
+            continue;
+        }
+        best_priority = priority;
+        best_weight   = weight;
+        snprintf(ep->host, sizeof(ep->host), "%s", target);
+        ep->port = ns_get16(rdata + 4);
+        *ttl = ns_rr_ttl(rr);
+    }
+    //(the target "." means that the service is not offered)
+    if (best_priority < 0 || ep->host[0] == '\0') {
+        fprintf(stderr, "WARNING: no usable SRV record for %s\n", name);
+        return false;
+    }
+    return true;
+}
+
+//Read the cache file, and return the lines for other domains than @a domain
+//(joined in a malloc()ed string) in @a others. The entry for @a domain is
+//put into @a ep if it exists. Expired entries are skipped.
+static bool cache_read(const char* path, const char* domain, struct Endpoint* ep, char** others) {
+    bool found = false;
+    size_t others_size = 0;
+    const long long now = time(NULL);
+    *others = calloc(1, 1);
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return false; //(probably does not exist yet)
+    }
+    char line[2560];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char entry_domain[1025], host[1025];
+        unsigned int port;
+        long long expires;
+        if (sscanf(line, "%1024s %1024s %u %lld", entry_domain, host, &port, &expires) != 4 || port == 0 || port > 65535) {
+            continue;
+        }
+        if (expires <= now) {
+            continue; //(expired entries are dropped when the file is rewritten)
+        }
+        if (strcmp(entry_domain, domain) != 0) {
+            const size_t len = strlen(line);
+            *others = realloc(*others, others_size + len + 1);
+            memcpy(*others + others_size, line, len + 1);
+            others_size += len;
+        } else {
+            snprintf(ep->host, sizeof(ep->host), "%s", host);
+            ep->port = port;
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+//Atomically replace the cache file with the @a others lines, plus the entry
+//for @a domain (unless @a ep is NULL). Each writer uses its own temporary file,
+//so concurrent bridges never rename a partially written file into place (one
+//of two concurrent updates may be lost, which only costs a lookup).
+static void cache_write(const char* path, const char* domain, const struct Endpoint* ep, long long ttl, const char* others) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    const int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        perror("create SRV cache");
+        return;
+    }
+    fchmod(fd, 0644); //(mkstemp() creates it with 0600)
+    FILE* file = fdopen(fd, "w");
+    if (file == NULL) {
+        perror("open SRV cache");
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    fputs(others, file);
+    if (ep != NULL) {
+        fprintf(file, "%s %s %u %lld\n", domain, ep->host, ep->port, (long long) time(NULL) + ttl);
+    }
+    if (fclose(file) != 0) {
+        perror("write SRV cache");
+        unlink(tmp_path);
+        return;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("rename SRV cache");
+        unlink(tmp_path);
+    }
+}
+
+bool endpoint_resolve(struct Endpoint* ep, const char* domain, const char* cache_path) {
+    ep->host[0]    = '\0';
+    ep->port       = 0;
+    ep->from_cache = false;
+
+    char* others;
+    if (cache_read(cache_path, domain, ep, &others)) {
+        ep->from_cache = true;
+        free(others);
+        return true;
+    }
+
+    long long ttl;
+    const bool found = srv_lookup(ep, domain, &ttl);
+    if (found) {
+        if (ttl < SRV_CACHE_MIN_TTL) {
+            ttl = SRV_CACHE_MIN_TTL;
+        } else if (ttl > SRV_CACHE_MAX_TTL) {
+            ttl = SRV_CACHE_MAX_TTL;
+        }
+        cache_write(cache_path, domain, ep, ttl, others);
+    }
+    free(others);
+    return found;
+}
+
+void endpoint_forget(const char* domain, const char* cache_path) {
+    char* others;
+    struct Endpoint ep;
+    if (cache_read(cache_path, domain, &ep, &others)) {
+        cache_write(cache_path, domain, NULL, 0, others);
+    }
+    free(others);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// connect trace
+
+static const char* phase_names[PHASE_COUNT] = { "DNS", "TCP", "TLS", "SASL", "bind" };
+
+//Forwards all log messages to the inner logger. libstrophe has no hook for the
+//end of the SASL exchange, so the logged <success/> is taken as that.
+static void trace_log_handler(void* userdata, xmpp_log_level_t level, const char* area, const char* msg) {
+    struct ConnectTrace* t = (struct ConnectTrace*) userdata;
+    if (t->phase_end[PHASE_SASL] < 0 && t->started_at >= 0 && strncmp(msg, "RECV: <success", 14) == 0) {
+        connect_trace_mark(t, PHASE_SASL, clock_msec());
+    }
+    if (t->inner != NULL && t->inner->handler != NULL) {
+        t->inner->handler(t->inner->userdata, level, area, msg);
+    }
+}
+
+void connect_trace_init(struct ConnectTrace* t, const xmpp_log_t* inner) {
+    t->started_at = -1;
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        t->phase_end[phase] = -1;
+    }
+    t->cached = false;
+    t->inner  = inner;
+    t->log.handler  = trace_log_handler;
+    t->log.userdata = t;
+}
+
+void connect_trace_start(struct ConnectTrace* t, long long now) {
+    connect_trace_init(t, t->inner);
+    t->started_at = now;
+}
+
+void connect_trace_mark(struct ConnectTrace* t, enum ConnectPhase phase, long long now) {
+    if (t->started_at >= 0 && t->phase_end[phase] < 0) {
+        t->phase_end[phase] = now;
+    }
+}
+
+void connect_trace_report(const struct ConnectTrace* t, long long now) {
+    char buf[256];
+    size_t len = 0;
+    long long phase_start = t->started_at;
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        const char* note = phase == PHASE_DNS && t->cached ? " (cached)" : "";
+        if (t->phase_end[phase] < 0) {
+            //(not observed; its time is counted in the next phase)
+            len += snprintf(buf + len, sizeof(buf) - len, ", %s n/a", phase_names[phase]);
+            continue;
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, ", %s %lld ms%s", phase_names[phase], t->phase_end[phase] - phase_start, note);
+        phase_start = t->phase_end[phase];
+    }
+    fprintf(stderr, "INFO: connected in %lld ms (%s)\n", now - t->started_at, buf + 2);
+}
@@ -0,0 +1,252 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#define _GNU_SOURCE //accept4, struct ucred
+
+#include "xmpp-bridge.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define STDIN  0
+#define STDOUT 1
+
+static bool fill_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "FATAL: socket path is too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+bool daemon_init(struct Daemon* d, const char* path, const struct Config* cfg) {
+    d->path            = path;
+    d->cfg             = cfg;
+    d->poll_listen     = -1;
+    d->clients         = NULL; //allocated on first use
+    d->client_count    = 0;
+    d->client_capacity = 0;
+    d->next_client     = 0;
+    d->owner_uid       = geteuid(); //(before privileges are dropped)
+
+    struct sockaddr_un addr;
+    if (!fill_address(&addr, path)) {
+        return false;
+    }
+
+    //remove a stale socket from an earlier run, but nothing else (this may run
+    //as root)
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "FATAL: %s exists and is not a socket\n", path);
+            return false;
+        }
+        if (unlink(path) == -1) {
+            perror("unlink() stale socket");
+            return false;
+        }
+    }
+
+    d->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (d->listen_fd == -1) {
+        perror("socket()");
+        return false;
+    }
+    //only our own user may connect (clients send messages as our account)
+    const mode_t old_umask = umask(0077);
+    const int bind_result = bind(d->listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+    umask(old_umask);
+    if (bind_result == -1) {
+        perror("bind()");
+        close(d->listen_fd);
+        return false;
+    }
+    if (listen(d->listen_fd, SOMAXCONN) == -1) {
+        perror("listen()");
+        close(d->listen_fd);
+        return false;
+    }
+    return true;
+}
+
+static void daemon_accept(struct Daemon* d) {
+    const int fd = accept4(d->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept()");
+        }
+        return;
+    }
+
+    //check the client's user as well, in case the socket's mode was changed
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+        perror("getsockopt(SO_PEERCRED)");
+        close(fd);
+        return;
+    }
+    if (cred.uid != d->owner_uid && cred.uid != 0) {
+        fprintf(stderr, "WARNING: rejected client with UID %u on %s\n", (unsigned) cred.uid, d->path);
+        close(fd);
+        return;
+    }
+
+    if (d->client_count == d->client_capacity) {
+        d->client_capacity += 8;
+        d->clients          = realloc(d->clients, sizeof(struct DaemonClient) * d->client_capacity);
+    }
+    struct DaemonClient* client = &(d->clients[d->client_count++]);
+    client->failed = false;
+    io_init(&(client->io), fd, fd);
+    io_set_queue_limit(&(client->io), d->cfg->max_output_bytes, d->cfg->overflow_policy, d->cfg->spill_dir);
+}
+
+void daemon_prepare_poll(struct Daemon* d, struct PollSet* ps, bool paused) {
+    d->poll_listen = pollset_add(ps, d->listen_fd, POLLIN);
+    for (size_t idx = 0; idx < d->client_count; ++idx) {
+        struct IO* io = &(d->clients[idx].io);
+        io->paused = paused;
+        io_prepare_poll(io, ps);
+    }
+}
+
+void daemon_handle_poll(struct Daemon* d, const struct PollSet* ps) {
+    for (size_t idx = 0; idx < d->client_count; ++idx) {
+        struct DaemonClient* client = &(d->clients[idx]);
+        if (!io_handle_poll(&(client->io), ps)) {
+            client->failed = true;
+        }
+    }
+    //accept new clients last, since their IO was not part of the PollSet yet
+    if (pollset_revents(ps, d->poll_listen) & POLLIN) {
+        daemon_accept(d);
+    }
+}
+
+bool daemon_getlines(struct Daemon* d, const char** data, size_t* size) {
+    //visit the clients in a round-robin fashion, so that no client can starve
+    //the others
+    for (size_t count = 0; count < d->client_count; ++count) {
+        const size_t idx = (d->next_client + count) % d->client_count;
+        if (io_getlines(&(d->clients[idx].io), data, size)) {
+            d->next_client = idx + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void daemon_cleanup(struct Daemon* d) {
+    //remove clients that have disconnected and whose lines have been sent
+    size_t idx = 0;
+    while (idx < d->client_count) {
+        struct DaemonClient* client = &(d->clients[idx]);
+        const struct ReadBuffer* buf = &(client->io.in_buf);
+        if (client->failed || (client->io.eof && buf->start == buf->end)) {
+            close(client->io.in_fd);
+            io_free(&(client->io));
+            d->clients[idx] = d->clients[--d->client_count];
+        } else {
+            ++idx;
+        }
+    }
+}
+
+void daemon_write(struct Daemon* d, const char* data, size_t count) {
+    for (size_t idx = 0; idx < d->client_count; ++idx) {
+        io_write(&(d->clients[idx].io), data, count);
+    }
+}
+
+bool daemon_output_full(const struct Daemon* d) {
+    for (size_t idx = 0; idx < d->client_count; ++idx) {
+        if (io_output_full(&(d->clients[idx].io))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool daemon_client_run(const char* path) {
+    struct sockaddr_un addr;
+    if (!fill_address(&addr, path)) {
+        return false;
+    }
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("socket()");
+        return false;
+    }
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "FATAL: cannot connect to %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    //relay stdin to the daemon, and the daemon's output to stdout
+    struct IO up, down;
+    io_init(&up,   STDIN, sock);
+    io_init(&down, sock,  STDOUT);
+    struct PollSet ps;
+    pollset_init(&ps);
+    bool shut_down = false;
+
+    while (!down.eof || down.out_queue.size > 0) {
+        ps.count = 0;
+        io_prepare_poll(&up,   &ps);
+        io_prepare_poll(&down, &ps);
+        if (poll(ps.fds, ps.count, -1) == -1 && errno != EINTR) {
+            perror("poll()");
+            return false;
+        }
+        if (!io_handle_poll(&up, &ps) || !io_handle_poll(&down, &ps)) {
+            return false;
+        }
+
+        const char* data;
+        size_t size;
+        if (io_getdata(&up, &data, &size, SIZE_MAX)) {
+            io_write(&up, data, size);
+        }
+        if (io_getdata(&down, &data, &size, SIZE_MAX)) {
+            io_write(&down, data, size);
+        }
+
+        //after EOF on stdin, tell the daemon that we're done, so that it
+        //disconnects us
+        if (up.eof && up.out_queue.size == 0 && !shut_down) {
+            shutdown(sock, SHUT_WR);
+            shut_down = true;
+        }
+    }
+
+    close(sock);
+    return true;
+}
@@ -0,0 +1,248 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IBB_NS "http://jabber.org/protocol/ibb"
+
+void ibb_init(struct Ibb* ibb, size_t block_size, size_t window) {
+    ibb->block_size    = block_size;
+    ibb->window        = window;
+    ibb->state         = IBB_IDLE;
+    ibb->sid           = NULL;
+    ibb->send_seq      = 0;
+    ibb->next_id       = 0;
+    ibb->in_flight     = 0;
+    ibb->recv_sid      = NULL;
+    ibb->recv_seq      = 0;
+    ibb->recv_closed   = false;
+    ibb->started_at    = -1;
+    ibb->finished_at   = -1;
+    ibb->bytes_sent     = 0;
+    ibb->bytes_received = 0;
+    ibb->blocks_sent    = 0;
+    ibb->blocks_received = 0;
+}
+
+//Send <iq type="set" to="...">CHILD</iq> (where CHILD is in the IBB namespace
+//and refers to our stream), and call @a handler with the response.
+static void ibb_send_iq(struct Ibb* ibb, xmpp_conn_t* conn, struct Config* cfg, const char* to, xmpp_stanza_t* child, xmpp_handler handler) {
+    char id[64];
+    snprintf(id, sizeof(id), "ibb-%s-%llu", ibb->sid, ibb->next_id++);
+
+    xmpp_stanza_t* iq = xmpp_iq_new(cfg->ctx, "set", id);
+    xmpp_stanza_set_to(iq, to);
+    xmpp_stanza_set_ns(child, IBB_NS);
+    xmpp_stanza_set_attribute(child, "sid", ibb->sid);
+    xmpp_stanza_add_child(iq, child);
+    xmpp_stanza_release(child);
+
+    xmpp_id_handler_add(conn, handler, id, cfg);
+    xmpp_send(conn, iq);
+    xmpp_stanza_release(iq);
+}
+
+static bool is_error(xmpp_stanza_t* stanza, const char* what) {
+    const char* type = xmpp_stanza_get_type(stanza);
+    if (type != NULL && strcmp(type, "error") == 0) {
+        fprintf(stderr, "ERROR: binary stream: peer rejected %s\n", what);
+        return true;
+    }
+    return false;
+}
+
+static int ibb_open_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    (void) conn;
+    struct Ibb* ibb = ((struct Config*) userdata)->ibb;
+    ibb->state = is_error(stanza, "stream") ? IBB_FAILED : IBB_OPEN;
+    return 0; //remove this handler
+}
+
+static int ibb_data_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    (void) conn;
+    struct Ibb* ibb = ((struct Config*) userdata)->ibb;
+    --ibb->in_flight;
+    if (is_error(stanza, "data packet")) {
+        ibb->state = IBB_FAILED;
+    }
+    return 0; //remove this handler
+}
+
+static int ibb_close_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    (void) conn;
+    (void) stanza; //the stream is over either way
+    struct Ibb* ibb = ((struct Config*) userdata)->ibb;
+    ibb->state       = IBB_CLOSED;
+    ibb->finished_at = clock_msec();
+    return 0; //remove this handler
+}
+
+void ibb_open(struct Ibb* ibb, xmpp_conn_t* conn, struct Config* cfg, const char* to) {
+    ibb->sid        = xmpp_uuid_gen(cfg->ctx);
+    ibb->state      = IBB_OPENING;
+    ibb->started_at = clock_msec();
+
+    char block_size[32];
+    snprintf(block_size, sizeof(block_size), "%zu", ibb->block_size);
+    xmpp_stanza_t* open = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(open, "open");
+    xmpp_stanza_set_attribute(open, "block-size", block_size);
+    xmpp_stanza_set_attribute(open, "stanza", "iq");
+    ibb_send_iq(ibb, conn, cfg, to, open, ibb_open_handler);
+}
+
+bool ibb_ready(const struct Ibb* ibb) {
+    return ibb->state == IBB_OPEN && ibb->in_flight < ibb->window;
+}
+
+void ibb_send(struct Ibb* ibb, xmpp_conn_t* conn, struct Config* cfg, const char* to, const char* data, size_t size) {
+    char seq[16];
+    snprintf(seq, sizeof(seq), "%u", (unsigned) ibb->send_seq++); //wraps around at 65536
+
+    char* encoded = xmpp_base64_encode(cfg->ctx, (const unsigned char*) data, size);
+    xmpp_stanza_t* text = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_text(text, encoded);
+    xmpp_free(cfg->ctx, encoded);
+
+    xmpp_stanza_t* packet = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(packet, "data");
+    xmpp_stanza_set_attribute(packet, "seq", seq);
+    xmpp_stanza_add_child(packet, text);
+    xmpp_stanza_release(text);
+    ibb_send_iq(ibb, conn, cfg, to, packet, ibb_data_handler);
+
+    ++ibb->in_flight;
+    ++ibb->blocks_sent;
+    ibb->bytes_sent += size;
+    rate_limit_take(cfg->rate_limit, size);
+}
+
+void ibb_close(struct Ibb* ibb, xmpp_conn_t* conn, struct Config* cfg, const char* to) {
+    ibb->state = IBB_CLOSING;
+    xmpp_stanza_t* close = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(close, "close");
+    ibb_send_iq(ibb, conn, cfg, to, close, ibb_close_handler);
+}
+
+//Answer the iq @a stanza with an empty result, or with an error if @a condition is given.
+static void ibb_reply(xmpp_conn_t* conn, xmpp_stanza_t* stanza, const char* condition) {
+    xmpp_stanza_t* reply = condition == NULL
+        ? xmpp_stanza_reply(stanza)
+        : xmpp_stanza_reply_error(stanza, "cancel", condition, NULL);
+    if (condition == NULL) {
+        xmpp_stanza_set_type(reply, "result");
+    }
+    xmpp_send(conn, reply);
+    xmpp_stanza_release(reply);
+}
+
+//Handle an incoming <data/> packet, and return the error condition for the
+//reply (or NULL on success).
+static const char* ibb_receive(struct Config* cfg, struct Peer* peer, xmpp_stanza_t* packet) {
+    struct Ibb* ibb = cfg->ibb;
+    const char* seq = xmpp_stanza_get_attribute(packet, "seq");
+    if (seq == NULL || strtoul(seq, NULL, 10) != ibb->recv_seq) {
+        //packets must arrive in order; anything else means that data was lost
+        fprintf(stderr, "ERROR: binary stream: expected packet %u, got %s\n", (unsigned) ibb->recv_seq, seq == NULL ? "none" : seq);
+        return "unexpected-request";
+    }
+
+    char* encoded = xmpp_stanza_get_text(packet);
+    unsigned char* data = NULL;
+    size_t size = 0;
+    if (encoded != NULL) {
+        xmpp_base64_decode_bin(cfg->ctx, encoded, strlen(encoded), &data, &size);
+        xmpp_free(cfg->ctx, encoded);
+        if (data == NULL) {
+            return "bad-request";
+        }
+    }
+    if (size > 0) {
+        io_write(&(peer->io), (const char*) data, size);
+    }
+    xmpp_free(cfg->ctx, data);
+
+    ++ibb->recv_seq;
+    ++ibb->blocks_received;
+    ibb->bytes_received += size;
+    return NULL;
+}
+
+int ibb_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    //userdata contains a Config struct
+    struct Config* cfg = (struct Config*) userdata;
+    struct Ibb* ibb = cfg->ibb;
+
+    xmpp_stanza_t* child = xmpp_stanza_get_child_by_ns(stanza, IBB_NS);
+    if (child == NULL) {
+        return 1;
+    }
+    const char* name = xmpp_stanza_get_name(child);
+    const char* sid  = xmpp_stanza_get_attribute(child, "sid");
+
+    //only the default peer may send a stream, and only one
+    struct Peer* peer = router_lookup(cfg->router, xmpp_stanza_get_attribute(stanza, "from"));
+    if (peer != &(cfg->router->peers[0]) || sid == NULL) {
+        ibb_reply(conn, stanza, "not-acceptable");
+        return 1;
+    }
+
+    if (strcmp(name, "open") == 0) {
+        const char* type = xmpp_stanza_get_attribute(child, "stanza");
+        if (ibb->recv_sid != NULL) {
+            ibb_reply(conn, stanza, "not-acceptable");
+        } else if (type != NULL && strcmp(type, "iq") != 0) {
+            ibb_reply(conn, stanza, "feature-not-implemented");
+        } else {
+            ibb->recv_sid = strdup(sid);
+            ibb_reply(conn, stanza, NULL);
+        }
+    }
+    else if (ibb->recv_sid == NULL || strcmp(sid, ibb->recv_sid) != 0 || ibb->recv_closed) {
+        ibb_reply(conn, stanza, "item-not-found");
+    }
+    else if (strcmp(name, "data") == 0) {
+        ibb_reply(conn, stanza, ibb_receive(cfg, peer, child));
+    }
+    else if (strcmp(name, "close") == 0) {
+        ibb->recv_closed = true;
+        ibb_reply(conn, stanza, NULL);
+    }
+    else {
+        ibb_reply(conn, stanza, "bad-request");
+    }
+    return 1;
+}
+
+void ibb_report(const struct Ibb* ibb) {
+    long long msec = 0;
+    if (ibb->started_at >= 0) {
+        msec = (ibb->finished_at >= 0 ? ibb->finished_at : clock_msec()) - ibb->started_at;
+    }
+    const double kib_per_sec = msec > 0 ? (ibb->bytes_sent / 1024.0) / (msec / 1000.0) : 0;
+    fprintf(stderr,
+        "INFO: binary stream: sent %llu bytes in %zu packets in %lld ms (%.1f KiB/s); received %llu bytes in %zu packets\n",
+        ibb->bytes_sent, ibb->blocks_sent, msec, kib_per_sec, ibb->bytes_received, ibb->blocks_received
+    );
+}
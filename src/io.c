@@ -17,43 +17,68 @@
 *
 *******************************************************************************/
 
+#define _GNU_SOURCE //memrchr
+
 #include "xmpp-bridge.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
-#include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define READ_SIZE   (1<<12)
-#define GROW_STEP   (1<<12)
 #define SHRINK_STEP (1<<20)
+#define QUEUE_STEP  16
+#define WRITEV_MAX  64 //max. number of segments per writev()
 
-static void buf_try_shrink(struct Buffer* buf) {
-    //shrink buffer if it has grown very large
-    if (buf->capacity > buf->size + SHRINK_STEP) {
-        //leave some room to grow again without reallocation
-        //(NOTE: GROW_STEP needs to be at least 1 to account for the trailing
-        //NUL byte in in_buf that's not counted by in_buf.size)
-        buf->capacity = buf->size + GROW_STEP;
-        buf->buffer   = realloc(buf->buffer, buf->capacity);
-    }
-}
+//the low bits of the user_data of io_uring operations (the rest is a pointer
+//to the IO, or the generation and index of a PollSet entry)
+#define URING_TAG_READ  1
+#define URING_TAG_WRITE 2
+#define URING_TAG_POLL  3
+#define URING_TAG_MASK  3
 
 bool io_init(struct IO* io, int in_fd, int out_fd) {
     io->in_fd            = in_fd;
     io->out_fd           = out_fd;
     io->in_buf.buffer    = NULL; //allocated on first use
-    io->in_buf.size      = 0;
+    io->in_buf.start     = 0;
+    io->in_buf.end       = 0;
     io->in_buf.capacity  = 0;
-    io->out_buf.buffer   = NULL; //allocated on first use
-    io->out_buf.size     = 0;
-    io->out_buf.capacity = 0;
+    io->in_buf.scanned   = 0;
+    io->in_buf.line_end  = 0;
+    io->out_queue.segments    = NULL; //allocated on first use
+    io->out_queue.head        = 0;
+    io->out_queue.tail        = 0;
+    io->out_queue.capacity    = 0;
+    io->out_queue.head_offset = 0;
+    io->out_queue.size        = 0;
+    io->out_queue.pinned      = 0;
+    io->out_queue.high_water  = 0;
     io->eof              = false;
+    io->paused           = false;
+    io->dropped_bytes    = 0;
+    io->poll_in          = -1;
+    io->poll_out         = -1;
+    io->ring             = NULL;
+    io->read_pending     = false;
+    io->write_pending    = false;
+    io->read_completed   = false;
+    io->write_completed  = false;
+    io->write_iov        = NULL; //allocated on first use
+    io->framing          = FRAMING_LINES;
+    io->frame_want       = 0;
+    io_set_queue_limit(io, 0, OVERFLOW_PAUSE, NULL);
+
+    //an IO without out_fd is only used for reading (e.g. a child's stderr)
+    if (out_fd < 0) {
+        return true;
+    }
 
     //try to make out_fd nonblocking, which will be useful
     const int flags = fcntl(out_fd, F_GETFL, 0);
@@ -73,165 +98,644 @@ bool io_init(struct IO* io, int in_fd, int out_fd) {
     return true;
 }
 
-static bool io_perform_read(struct IO* io) {
-    //make sure that the buffer has at least READ_SIZE additional capacity
-    if (io->in_buf.capacity < io->in_buf.size + READ_SIZE) {
-        io->in_buf.capacity = io->in_buf.size + READ_SIZE;
-        io->in_buf.buffer   = realloc(io->in_buf.buffer, io->in_buf.capacity + 1); //+1 for NUL byte
+static void rbuf_reserve(struct ReadBuffer* buf, size_t count) {
+    if (buf->capacity - buf->end >= count) {
+        return;
     }
 
-    //read into the buffer
-    const ssize_t bytes_read = read(io->in_fd,
-                                    io->in_buf.buffer + io->in_buf.size,
-                                    io->in_buf.capacity - io->in_buf.size);
-    if (bytes_read == -1) {
-        if (errno == EINTR) {
-            //restart call
-            return io_perform_read(io);
+    //move the unconsumed bytes (usually a partial line) to the front; since
+    //this only happens when the room at the end runs out, every byte is moved
+    //at most once until it is consumed
+    if (buf->start > 0) {
+        const size_t shift = buf->start;
+        memmove(buf->buffer, buf->buffer + shift, buf->end - shift);
+        buf->start     = 0;
+        buf->end      -= shift;
+        buf->scanned  -= shift;
+        buf->line_end -= shift;
+    }
+
+    //grow if necessary, or shrink if the buffer has grown very large
+    if (buf->capacity - buf->end < count || buf->capacity > buf->end + count + SHRINK_STEP) {
+        buf->capacity = buf->end + count;
+        buf->buffer   = realloc(buf->buffer, buf->capacity);
+    }
+}
+
+static void rbuf_scan(struct ReadBuffer* buf) {
+    //look for line terminators only in the bytes that were not scanned yet
+    const char* nl_pos = memrchr(buf->buffer + buf->scanned, '\n', buf->end - buf->scanned);
+    if (nl_pos != NULL) {
+        buf->line_end = nl_pos - buf->buffer + 1; //+1 for '\n'
+    }
+    buf->scanned = buf->end;
+}
+
+//Handle the @a result of a read into the free space of the ReadBuffer (a
+//negative result is an -errno, like in io_uring).
+static bool io_read_done(struct IO* io, ssize_t result) {
+    if (result < 0) {
+        if (result == -EAGAIN || result == -EWOULDBLOCK || result == -EINTR || result == -ECANCELED) {
+            //spurious wakeup (in_fd may be non-blocking if it is also out_fd),
+            //or interrupted - will be retried
+            return true;
         }
+        errno = -result;
         perror("read()");
         return false;
     }
-    else if (bytes_read == 0) {
+    const size_t bytes_read = result;
+    if (bytes_read == 0) {
         //EOF reached - return true once more to send the last (potentially
         //unterminated) line
         io->eof = true;
         return true;
     }
     else {
-        io->in_buf.size += bytes_read;
-        io->in_buf.buffer[io->in_buf.size] = '\0'; //ensure that buffer is NUL-terminated
+        io->in_buf.end += bytes_read;
+        if (io->framing == FRAMING_LINES) {
+            rbuf_scan(&(io->in_buf));
+        }
+        metrics_count(COUNTER_INPUT_BYTES, bytes_read);
         return true;
     }
 }
 
-static bool io_perform_write(struct IO* io, size_t write_count) {
-    if (write_count == 0) {
-        //invalid argument
+//Return how much room the next read shall have: at least READ_SIZE, or the
+//rest of a large frame, so that it arrives with few reads and no regrowth.
+static size_t io_read_size(const struct IO* io) {
+    return io->frame_want > READ_SIZE ? io->frame_want : READ_SIZE;
+}
+
+static bool io_perform_read(struct IO* io) {
+    //make sure that the buffer has enough additional capacity
+    rbuf_reserve(&(io->in_buf), io_read_size(io));
+
+    //read into the buffer
+    const ssize_t bytes_read = read(io->in_fd,
+                                    io->in_buf.buffer + io->in_buf.end,
+                                    io->in_buf.capacity - io->in_buf.end);
+    if (bytes_read == -1 && errno == EINTR) {
+        //restart call
+        return io_perform_read(io);
+    }
+    return io_read_done(io, bytes_read == -1 ? -errno : bytes_read);
+}
+
+static void queue_append(struct OutputQueue* queue, const char* data, size_t count) {
+    //make room for another segment, preferably by reusing the slots of the
+    //segments that were already written
+    if (queue->tail == queue->capacity) {
+        if (queue->head > 0) {
+            memmove(queue->segments, queue->segments + queue->head, sizeof(struct OutputSegment) * (queue->tail - queue->head));
+            queue->tail -= queue->head;
+            queue->head  = 0;
+        } else {
+            queue->capacity += QUEUE_STEP + queue->capacity / 2;
+            queue->segments  = realloc(queue->segments, sizeof(struct OutputSegment) * queue->capacity);
+        }
+    }
+
+    //append a copy of the data to the queue
+    struct OutputSegment* segment = &(queue->segments[queue->tail++]);
+    segment->data = (char*) malloc(count);
+    segment->size = count;
+    memcpy(segment->data, data, count);
+    queue->size += count;
+}
+
+static size_t queue_drop_oldest(struct OutputQueue* queue, size_t max_size) {
+    //drop whole segments, but not one that has already been written partially
+    //(or is being written)
+    size_t dropped = 0;
+    while (queue->size > max_size && queue->head < queue->tail && queue->head_offset == 0 && queue->pinned == 0) {
+        struct OutputSegment* segment = &(queue->segments[queue->head++]);
+        queue->size -= segment->size;
+        dropped     += segment->size;
+        free(segment->data);
+    }
+    return dropped;
+}
+
+static bool io_refill_from_spill(struct IO* io) {
+    //move the next chunk of spilled data back into memory (at most as much as
+    //the queue is allowed to hold)
+    const char* data;
+    size_t count = spill_peek(&(io->spill), &data);
+    if (count == 0) {
         return false;
     }
+    if (count > io->max_queue_bytes) {
+        count = io->max_queue_bytes;
+    }
+    queue_append(&(io->out_queue), data, count);
+    spill_consume(&(io->spill), count);
+    return true;
+}
 
-    //bound `write_count` to the amount of available data
-    if (write_count > io->out_buf.size) {
-        write_count = io->out_buf.size;
+//Describe the first (up to WRITEV_MAX) pending segments in @a iov.
+static int queue_fill_iov(const struct OutputQueue* queue, struct iovec* iov) {
+    int iov_count = 0;
+    for (size_t idx = queue->head; idx < queue->tail && iov_count < WRITEV_MAX; ++idx) {
+        const size_t offset = idx == queue->head ? queue->head_offset : 0;
+        iov[iov_count].iov_base = queue->segments[idx].data + offset;
+        iov[iov_count].iov_len  = queue->segments[idx].size - offset;
+        ++iov_count;
     }
+    return iov_count;
+}
 
-    const ssize_t bytes_written = write(io->out_fd, io->out_buf.buffer, write_count);
-    if (bytes_written == -1) {
-        if (errno == EINTR) {
-            //restart call
-            return io_perform_write(io, write_count);
+//Remove the @a bytes_written from the queue.
+static void queue_consume(struct OutputQueue* queue, size_t bytes_written) {
+    metrics_count(COUNTER_OUTPUT_BYTES, bytes_written);
+    queue->size -= bytes_written;
+    while (bytes_written > 0) {
+        struct OutputSegment* segment = &(queue->segments[queue->head]);
+        const size_t remaining = segment->size - queue->head_offset;
+        if (bytes_written < remaining) {
+            queue->head_offset += bytes_written;
+            break;
         }
-        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            //write too large - restart call with smaller write_count
-            return io_perform_write(io, write_count / 2);
-        }
-        else {
-                perror("write()");
+        bytes_written -= remaining;
+        free(segment->data);
+        queue->head_offset = 0;
+        ++queue->head;
+    }
+}
+
+//When the queue is empty, start over at the front of the segment array. The
+//array is only shrunk when it is far larger than the recent bursts needed (the
+//high-water mark halves with every restart), so that steady bursty output
+//does not reallocate it every time.
+static void queue_restart(struct OutputQueue* queue) {
+    queue->high_water = queue->tail > queue->high_water / 2 ? queue->tail : queue->high_water / 2;
+    queue->head = queue->tail = 0;
+    if (queue->capacity > 4 * queue->high_water + QUEUE_STEP) {
+        queue->capacity = 2 * queue->high_water + QUEUE_STEP;
+        queue->segments = realloc(queue->segments, sizeof(struct OutputSegment) * queue->capacity);
+    }
+}
+
+static bool io_perform_write(struct IO* io) {
+    struct OutputQueue* queue = &(io->out_queue);
+
+    //write as many segments as the out_fd will take
+    while (queue->head < queue->tail || io_refill_from_spill(io)) {
+        struct iovec iov[WRITEV_MAX];
+        const int iov_count = queue_fill_iov(queue, iov);
+
+        ssize_t bytes_written = writev(io->out_fd, iov, iov_count);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                //restart call
+                continue;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //out_fd is full - wait for the next wakeup
+                return true;
+            }
+            else {
+                perror("writev()");
                 return false;
+            }
         }
+
+        queue_consume(queue, bytes_written);
     }
 
-    //remove the bytes_written from the buffer
-    io->out_buf.size -= bytes_written;
-    memmove(io->out_buf.buffer, io->out_buf.buffer + bytes_written, io->out_buf.size);
-    buf_try_shrink(&(io->out_buf));
+    queue_restart(queue);
     return true;
 }
 
-bool io_select(struct IO* io, int usec) {
-    if (io->eof) {
+//With io_uring, handle the @a result of the writev() that was in flight.
+static bool io_write_done(struct IO* io, ssize_t result) {
+    struct OutputQueue* queue = &(io->out_queue);
+    queue->pinned = 0;
+    if (result < 0) {
+        if (result == -EAGAIN || result == -EWOULDBLOCK || result == -EINTR || result == -ECANCELED) {
+            return true; //will be retried
+        }
+        errno = -result;
+        perror("writev()");
         return false;
     }
+    queue_consume(queue, result);
+    if (queue->head == queue->tail) {
+        queue_restart(queue);
+    }
+    return true;
+}
+
+void pollset_init(struct PollSet* ps) {
+    ps->fds        = NULL; //allocated on first use
+    ps->count      = 0;
+    ps->capacity   = 0;
+    ps->ring       = NULL;
+    ps->generation = 0;
+}
 
-    //wait for in_fd to become available for reading, and for out_fd to become
-    //available for writing (if there is stuff in the write buffer)
-    fd_set in_fds, out_fds;
-    FD_ZERO(&in_fds);
-    FD_ZERO(&out_fds);
-    FD_SET(io->in_fd, &in_fds);
-    int fd_count = 1;
-    if (io->out_buf.size > 0) {
-        FD_SET(io->out_fd, &out_fds);
-        fd_count = 2;
+int pollset_add(struct PollSet* ps, int fd, short events) {
+    if (ps->count == ps->capacity) {
+        ps->capacity += 8;
+        ps->fds       = realloc(ps->fds, sizeof(struct pollfd) * ps->capacity);
     }
+    struct pollfd* pfd = &(ps->fds[ps->count]);
+    pfd->fd      = fd;
+    pfd->events  = events;
+    pfd->revents = 0;
+    return ps->count++;
+}
 
-    struct timeval tv;
-    tv.tv_sec  = usec / 1000000;
-    tv.tv_usec = usec % 1000000;
+short pollset_revents(const struct PollSet* ps, int idx) {
+    return idx < 0 ? 0 : ps->fds[idx].revents;
+}
 
-    const int retval = select(fd_count, &in_fds, &out_fds, NULL, &tv);
-    if (retval == -1) {
-        perror("select()");
+static uint64_t pollset_user_data(const struct PollSet* ps, size_t idx) {
+    return ((uint64_t) ps->generation << 32) | (idx << 2) | URING_TAG_POLL;
+}
+
+//Store the result of a completed io_uring operation in its IO or PollSet
+//entry. Returns whether the completion is of interest.
+static bool pollset_complete(struct PollSet* ps, uint64_t user_data, int res) {
+    struct IO* io = (struct IO*) (uintptr_t) (user_data & ~(uint64_t) URING_TAG_MASK);
+    switch (user_data & URING_TAG_MASK) {
+    case URING_TAG_READ:
+        io->read_pending   = false;
+        io->read_completed = true;
+        io->read_result    = res;
+        return true;
+    case URING_TAG_WRITE:
+        io->write_pending   = false;
+        io->write_completed = true;
+        io->write_result    = res;
+        return true;
+    case URING_TAG_POLL:
+        //(polls from earlier iterations were cancelled)
+        if ((user_data >> 32) != ps->generation) {
+            return false;
+        }
+        ps->fds[(user_data & 0xFFFFFFFF) >> 2].revents = res < 0 ? POLLERR : res;
+        return true;
+    default:
         return false;
     }
+}
+
+int pollset_wait(struct PollSet* ps, long long timeout) {
+    if (ps->ring == NULL) {
+        return poll(ps->fds, ps->count, timeout);
+    }
+
+    //poll the remaining fds (e.g. the XMPP socket) through the ring, too
+    ++ps->generation;
+    for (size_t idx = 0; idx < ps->count; ++idx) {
+        ps->fds[idx].revents = 0;
+        //(if this fails, the fd is only looked at again after the timeout)
+        uring_poll(ps->ring, ps->fds[idx].fd, ps->fds[idx].events, pollset_user_data(ps, idx));
+    }
+
+    //wait until something of interest completes, or until the timeout
+    const long long deadline = clock_msec() + timeout;
+    int result = 0;
+    bool done = false;
+    while (!done) {
+        const long long now = clock_msec();
+        if (uring_wait(ps->ring, deadline > now ? deadline - now : 0) < 0) {
+            result = -1; //e.g. EINTR
+            break;
+        }
+        uint64_t user_data;
+        int res;
+        while (uring_next(ps->ring, &user_data, &res)) {
+            done = pollset_complete(ps, user_data, res) || done;
+        }
+        done = done || clock_msec() >= deadline;
+    }
+
+    //withdraw the polls that did not fire (they are armed again next time)
+    const int saved_errno = errno;
+    for (size_t idx = 0; idx < ps->count; ++idx) {
+        if (ps->fds[idx].revents == 0) {
+            uring_poll_remove(ps->ring, pollset_user_data(ps, idx));
+        } else if (result >= 0) {
+            ++result;
+        }
+    }
+    errno = saved_errno;
+    return result;
+}
+
+void io_use_uring(struct IO* io, struct Uring* ring) {
+    io->ring = ring;
+}
+
+//With io_uring, keep a read and a writev in flight (as far as possible).
+static void io_prepare_uring(struct IO* io) {
+    struct ReadBuffer* buf = &(io->in_buf);
+    if (!io->eof && !io->paused && !io->read_pending && !io->read_completed) {
+        //(the buffer does not move while the read is pending, since it is
+        //only reallocated before a read)
+        rbuf_reserve(buf, io_read_size(io));
+        //(if the ring is full, this is retried in the next iteration)
+        io->read_pending = uring_read(io->ring, io->in_fd, buf->buffer + buf->end, buf->capacity - buf->end, (uintptr_t) io | URING_TAG_READ);
+    }
+
+    //(the segments that are being written are pinned, so that they are not
+    //dropped by OVERFLOW_DROP)
+    struct OutputQueue* queue = &(io->out_queue);
+    if (!io->write_pending && !io->write_completed && (queue->head < queue->tail || io_refill_from_spill(io))) {
+        if (io->write_iov == NULL) {
+            io->write_iov = malloc(sizeof(struct iovec) * WRITEV_MAX);
+        }
+        const int iov_count = queue_fill_iov(queue, io->write_iov);
+        io->write_pending = uring_writev(io->ring, io->out_fd, io->write_iov, iov_count, (uintptr_t) io | URING_TAG_WRITE);
+        queue->pinned = io->write_pending ? iov_count : 0;
+    }
+}
+
+void io_prepare_poll(struct IO* io, struct PollSet* ps) {
+    //wait for in_fd to become available for reading (until EOF or while
+    //paused), and for out_fd to become available for writing (if there is
+    //stuff in the write queue)
+    io->poll_in  = -1;
+    io->poll_out = -1;
+    if (io->ring != NULL) {
+        io_prepare_uring(io);
+        return;
+    }
+    if (!io->eof && !io->paused) {
+        io->poll_in = pollset_add(ps, io->in_fd, POLLIN);
+    }
+    if (io->out_queue.size > 0 || io->spill.write_pos > io->spill.read_pos) {
+        io->poll_out = pollset_add(ps, io->out_fd, POLLOUT);
+    }
+}
+
+bool io_handle_poll(struct IO* io, const struct PollSet* ps) {
+    //with io_uring, the reads and writes have already happened
+    if (io->ring != NULL) {
+        if (io->read_completed) {
+            io->read_completed = false;
+            if (!io_read_done(io, io->read_result)) {
+                return false;
+            }
+        }
+        if (io->write_completed) {
+            io->write_completed = false;
+            if (!io_write_done(io, io->write_result)) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-    //perform all IO operations that have become possible
-    if (FD_ISSET(io->in_fd, &in_fds)) {
+    //perform all IO operations that have become possible (POLLHUP/POLLERR are
+    //included because the read()/write() will report EOF or the error)
+    if (pollset_revents(ps, io->poll_in) & (POLLIN | POLLHUP | POLLERR)) {
         if (!io_perform_read(io)) {
             return false;
         }
     }
-    if (FD_ISSET(io->out_fd, &out_fds)) {
-        if (!io_perform_write(io, sysconf(_SC_PAGESIZE))) {
+    if (pollset_revents(ps, io->poll_out) & (POLLOUT | POLLHUP | POLLERR)) {
+        if (!io_perform_write(io)) {
             return false;
         }
     }
     return true;
 }
 
-char* io_getlines(struct IO* io) {
-    if (io->in_buf.buffer == NULL) {
-        return NULL;
-    }
+bool io_getlines(struct IO* io, const char** data, size_t* size) {
+    struct ReadBuffer* buf = &(io->in_buf);
+    *data = NULL;
+    *size = 0;
 
-    //find line terminator
-    char* nl_pos = strrchr(io->in_buf.buffer, '\n');
-    if (nl_pos == NULL) {
+    size_t result_end = buf->line_end;
+    size_t trim       = 1; //for '\n'
+    if (result_end <= buf->start) {
         //no full line - wait for the rest
-        if (!io->eof) {
-            return NULL;
+        if (!io->eof || buf->end == buf->start) {
+            return false;
         }
-
         //after EOF, return the rest of the buffer
-        if (io->in_buf.size == 0) {
-            return NULL;
-        }
-        char* result = io->in_buf.buffer;
-        io->in_buf.buffer = NULL;
-        io->in_buf.size = io->in_buf.capacity = 0;
-        return result;
+        result_end = buf->end;
+        trim       = 0;
     }
 
-    //prepare return value
-    const size_t result_size = nl_pos - io->in_buf.buffer;
-    char* result = (char*) malloc(result_size + 1); //+1 for NUL byte
-    memcpy(result, io->in_buf.buffer, result_size);
-    result[result_size] = '\0';
-
-    //remove this line from the buffer
-    const size_t remove_size = result_size + 1; //+1 for '\n'
-    io->in_buf.size -= remove_size;
-    memmove(io->in_buf.buffer, io->in_buf.buffer + remove_size, io->in_buf.size + 1); //+1 for NUL byte
-    buf_try_shrink(&(io->in_buf));
+    //hand out the lines in-place and consume them
+    const size_t result_size = result_end - buf->start - trim;
+    *data = buf->buffer + buf->start;
+    *size = result_size;
+    buf->start = result_end;
 
     //return only non-empty lines
     if (result_size == 0) {
-        free(result);
-        return NULL;
+        return io_getlines(io, data, size);
     }
-    return result;
+    return true;
+}
+
+//Parse the frame header at the start of @a data. Returns FRAME_READY if the
+//header is complete, and then the sizes of the header, the payload and the
+//trailer.
+static enum FrameStatus frame_parse(enum Framing framing, const char* data, size_t size, size_t* header, size_t* payload, size_t* trailer) {
+    if (framing == FRAMING_LENGTH) {
+        if (size < 4) {
+            return FRAME_NONE;
+        }
+        const unsigned char* bytes = (const unsigned char*) data;
+        *payload = ((size_t) bytes[0] << 24) | ((size_t) bytes[1] << 16) | ((size_t) bytes[2] << 8) | bytes[3];
+        *header  = 4;
+        *trailer = 0;
+    } else {
+        //(one digit more than FRAME_MAX_BYTES has is enough to reject it)
+        size_t idx = 0;
+        *payload = 0;
+        while (idx < size && idx < 10 && data[idx] >= '0' && data[idx] <= '9') {
+            *payload = *payload * 10 + (data[idx++] - '0');
+        }
+        if (idx == size && idx < 10) {
+            return FRAME_NONE;
+        }
+        if (idx == 0 || idx == 10 || data[idx] != ':') {
+            fputs("ERROR: invalid netstring length in input\n", stderr);
+            return FRAME_INVALID;
+        }
+        *header  = idx + 1;
+        *trailer = 1; //","
+    }
+    if (*payload > FRAME_MAX_BYTES) {
+        fprintf(stderr, "ERROR: input frame of %zu bytes is too large (max. %d bytes)\n", *payload, FRAME_MAX_BYTES);
+        return FRAME_INVALID;
+    }
+    return FRAME_READY;
+}
+
+enum FrameStatus io_getframe(struct IO* io, const char** data, size_t* size) {
+    struct ReadBuffer* buf = &(io->in_buf);
+    while (true) {
+        const char* start = buf->buffer + buf->start;
+        const size_t available = buf->end - buf->start;
+
+        //only the header is looked at; the payload is handed out in-place
+        size_t header = 0, payload = 0, trailer = 0;
+        enum FrameStatus status = available == 0 ? FRAME_NONE : frame_parse(io->framing, start, available, &header, &payload, &trailer);
+        if (status == FRAME_INVALID) {
+            return status;
+        }
+        const size_t frame_size = header + payload + trailer;
+        if (status == FRAME_NONE || available < frame_size) {
+            io->frame_want = status == FRAME_NONE ? 0 : frame_size - available;
+            if (io->eof && available > 0) {
+                fprintf(stderr, "WARNING: discarding %zu bytes of an incomplete frame at the end of the input\n", available);
+                buf->start = buf->scanned = buf->line_end = buf->end;
+            }
+            return FRAME_NONE;
+        }
+        if (trailer > 0 && start[header + payload] != ',') {
+            fputs("ERROR: netstring in input is not terminated by \",\"\n", stderr);
+            return FRAME_INVALID;
+        }
+
+        buf->start += frame_size;
+        io->frame_want = 0;
+        //(framed input is never scanned, but rbuf_reserve() moves these)
+        buf->scanned  = buf->start;
+        buf->line_end = buf->start;
+        if (payload > 0) {
+            *data = start + header;
+            *size = payload;
+            return FRAME_READY;
+        }
+    }
+}
+
+void io_write_frame(struct IO* io, const char* const* fields, const char* data, size_t size) {
+    //the payload is the metadata fields (each with a NUL) and the data
+    size_t payload = size, fields_size = 0;
+    for (size_t idx = 0; fields != NULL && fields[idx] != NULL; ++idx) {
+        fields_size += strlen(fields[idx]) + 1;
+    }
+    payload += fields_size;
+
+    //the whole frame goes into one segment, so that --on-output-full=drop
+    //drops whole frames only (and the output stays parseable)
+    char* frame = malloc(24 + fields_size + size);
+    size_t frame_size;
+    if (io->framing == FRAMING_LENGTH) {
+        frame[0] = (payload >> 24) & 0xFF;
+        frame[1] = (payload >> 16) & 0xFF;
+        frame[2] = (payload >> 8) & 0xFF;
+        frame[3] = payload & 0xFF;
+        frame_size = 4;
+    } else {
+        frame_size = sprintf(frame, "%zu:", payload);
+    }
+    for (size_t idx = 0; fields != NULL && fields[idx] != NULL; ++idx) {
+        const size_t len = strlen(fields[idx]) + 1;
+        memcpy(frame + frame_size, fields[idx], len);
+        frame_size += len;
+    }
+    memcpy(frame + frame_size, data, size);
+    frame_size += size;
+    if (io->framing == FRAMING_NETSTRING) {
+        frame[frame_size++] = ',';
+    }
+    io_write(io, frame, frame_size);
+    free(frame);
+}
+
+bool io_getdata(struct IO* io, const char** data, size_t* size, size_t max_size) {
+    struct ReadBuffer* buf = &(io->in_buf);
+    *data = buf->buffer + buf->start;
+    *size = buf->end - buf->start;
+    if (*size > max_size) {
+        *size = max_size;
+    }
+    buf->start += *size;
+    //(rbuf_reserve() relies on scanned and line_end not being before start)
+    if (buf->scanned < buf->start) {
+        buf->scanned = buf->start;
+    }
+    if (buf->line_end < buf->start) {
+        buf->line_end = buf->start;
+    }
+    return *size > 0;
+}
+
+void io_free(struct IO* io) {
+    struct OutputQueue* queue = &(io->out_queue);
+    for (size_t idx = queue->head; idx < queue->tail; ++idx) {
+        free(queue->segments[idx].data);
+    }
+    free(queue->segments);
+    free(io->write_iov);
+    free(io->in_buf.buffer);
+    spill_free(&(io->spill));
+}
+
+void io_set_queue_limit(struct IO* io, size_t max_bytes, enum OverflowPolicy policy, const char* spill_dir) {
+    io->max_queue_bytes = max_bytes;
+    io->overflow_policy = policy;
+    spill_init(&(io->spill), spill_dir);
+}
+
+void io_set_framing(struct IO* io, enum Framing framing) {
+    io->framing = framing;
+}
+
+bool io_output_full(const struct IO* io) {
+    return io->max_queue_bytes > 0 && io->out_queue.size >= io->max_queue_bytes;
+}
+
+bool io_output_empty(const struct IO* io) {
+    return io->out_queue.size == 0 && io->spill.read_pos == io->spill.write_pos;
 }
 
 void io_write(struct IO* io, const char* data, size_t count) {
-    //extend write buffer if necessary
-    if (io->out_buf.capacity < io->out_buf.size + count) {
-        //grow a bit bigger than needed to avoid repeated reallocation
-        io->out_buf.capacity = io->out_buf.size + count + GROW_STEP;
-        io->out_buf.buffer   = realloc(io->out_buf.buffer, io->out_buf.capacity);
+    struct OutputQueue* queue = &(io->out_queue);
+    if (count == 0) {
+        return;
     }
 
-    //append data to buffer
-    memcpy(io->out_buf.buffer + io->out_buf.size, data, count);
-    io->out_buf.size += count;
+    //unless the queue would grow beyond its limit, just add the data to it
+    //(once spilling has started, the data must also go into the spill file to
+    //preserve the order)
+    const bool spilling = io->spill.write_pos > io->spill.read_pos;
+    if (io->max_queue_bytes == 0 || (!spilling && queue->size + count <= io->max_queue_bytes)) {
+        queue_append(queue, data, count);
+        return;
+    }
+
+    switch (io->overflow_policy) {
+    case OVERFLOW_PAUSE:
+        //the caller is supposed to stop receiving when io_output_full()
+        queue_append(queue, data, count);
+        break;
+    case OVERFLOW_DROP:
+        {
+            //make room by dropping the oldest segments; if the new data alone
+            //is over the limit, or the oldest segment is being written, drop
+            //the new data instead
+            size_t dropped = 0;
+            if (count <= io->max_queue_bytes) {
+                dropped = queue_drop_oldest(queue, io->max_queue_bytes - count);
+            }
+            if (queue->size + count <= io->max_queue_bytes) {
+                queue_append(queue, data, count);
+            } else {
+                dropped += count;
+            }
+            io->dropped_bytes += dropped;
+            metrics_count(COUNTER_OUTPUT_DROPPED_BYTES, dropped);
+        }
+        break;
+    case OVERFLOW_SPILL:
+        if (!spill_append(&(io->spill), data, count)) {
+            fputs("Non-fatal: Will keep the data in memory instead.\n", stderr);
+            queue_append(queue, data, count);
+        } else {
+            metrics_count(COUNTER_OUTPUT_SPILLED_BYTES, count);
+        }
+        break;
+    }
 }
@@ -19,37 +19,205 @@
 
 #include "xmpp-bridge.h"
 
+#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+#define JID_PART_MAX 1023 //max. length of each part according to RFC 7622
+
+//Return a copy of the given string with ASCII letters in lowercase.
+static char* strndup_lower(const char* str, size_t len) {
+    char* result = strndup(str, len);
+    for (size_t idx = 0; idx < len; ++idx) {
+        result[idx] = tolower((unsigned char) result[idx]);
+    }
+    return result;
+}
+
+bool jid_parse(const char* str, struct Jid* jid) {
+    jid->local    = NULL;
+    jid->domain   = NULL;
+    jid->resource = NULL;
+    if (str == NULL) {
+        return false;
+    }
+
+    //split "local@domain/resource" (the resource may contain any character)
+    const size_t bare_len = jid_bare_len(str);
+    const char* at_pos    = memchr(str, '@', bare_len);
+    const char* domain    = at_pos == NULL ? str : at_pos + 1;
+    const size_t local_len  = at_pos == NULL ? 0 : (size_t) (at_pos - str);
+    const size_t domain_len = bare_len - (domain - str);
+    const char* resource  = str[bare_len] == '/' ? str + bare_len + 1 : NULL;
+
+    if ((at_pos != NULL && local_len == 0) || domain_len == 0 || (resource != NULL && *resource == '\0')) {
+        return false;
+    }
+    if (local_len > JID_PART_MAX || domain_len > JID_PART_MAX || (resource != NULL && strlen(resource) > JID_PART_MAX)) {
+        return false;
+    }
+    if (memchr(domain, '@', domain_len) != NULL) {
+        return false;
+    }
+
+    //localpart and domain are case-insensitive, so normalize them once
+    if (at_pos != NULL) {
+        jid->local = strndup_lower(str, local_len);
+    }
+    jid->domain = strndup_lower(domain, domain_len);
+    if (resource != NULL) {
+        jid->resource = strdup(resource);
+    }
+    return true;
+}
+
+void jid_free(struct Jid* jid) {
+    free(jid->local);
+    free(jid->domain);
+    free(jid->resource);
+}
 
 bool validate_jid(const char* jid) {
-    if (jid == NULL) {
+    //expect a valid JID with a localpart
+    struct Jid parsed;
+    const bool valid = jid_parse(jid, &parsed) && parsed.local != NULL;
+    jid_free(&parsed);
+    return valid;
+}
+
+size_t jid_bare_len(const char* jid) {
+    const char* slash_pos = strchr(jid, '/');
+    return slash_pos == NULL ? strlen(jid) : (size_t) (slash_pos - jid);
+}
+
+uint32_t jid_hash(const char* str, size_t len) {
+    //FNV-1a over the ASCII-lowercased string, since the localpart and domain
+    //of a JID are case-insensitive
+    uint32_t hash = 2166136261u;
+    for (size_t idx = 0; idx < len; ++idx) {
+        hash ^= (unsigned char) tolower((unsigned char) str[idx]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void jid_set_insert(struct JidSet* set, char* str, uint32_t hash);
+
+static void jid_set_grow(struct JidSet* set) {
+    //rehash into a table of twice the size
+    struct JidSet old = *set;
+    const size_t size = old.entries == NULL ? 16 : 2 * (old.mask + 1);
+    set->entries = calloc(size, sizeof(struct JidSetEntry));
+    set->mask    = size - 1;
+    set->count   = 0;
+    if (old.entries != NULL) {
+        for (size_t idx = 0; idx <= old.mask; ++idx) {
+            if (old.entries[idx].str != NULL) {
+                jid_set_insert(set, old.entries[idx].str, old.entries[idx].hash);
+            }
+        }
+        free(old.entries);
+    }
+}
+
+static void jid_set_insert(struct JidSet* set, char* str, uint32_t hash) {
+    //keep the table at most half full
+    if (2 * (set->count + 1) > set->mask + 1) {
+        jid_set_grow(set);
+    }
+    size_t slot = hash & set->mask;
+    while (set->entries[slot].str != NULL) {
+        if (strcmp(set->entries[slot].str, str) == 0) {
+            free(str); //duplicate rule
+            return;
+        }
+        slot = (slot + 1) & set->mask;
+    }
+    set->entries[slot].str  = str;
+    set->entries[slot].len  = strlen(str);
+    set->entries[slot].hash = hash;
+    ++set->count;
+}
+
+void jid_set_add(struct JidSet* set, const char* str) {
+    jid_set_insert(set, strdup(str), jid_hash(str, strlen(str)));
+}
+
+bool jid_set_contains(const struct JidSet* set, const char* str, size_t len, size_t icase_len, uint32_t hash) {
+    if (set->count == 0) {
         return false;
     }
+    for (size_t slot = hash & set->mask; set->entries[slot].str != NULL; slot = (slot + 1) & set->mask) {
+        const struct JidSetEntry* entry = &(set->entries[slot]);
+        if (entry->hash == hash && entry->len == len
+                && strncasecmp(entry->str, str, icase_len) == 0
+                && memcmp(entry->str + icase_len, str + icase_len, len - icase_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    //expect an "@" character somewhere
-    return strchr(jid, '@') != NULL;
-    //TODO: could validate way more
+void jid_filter_init(struct JidFilter* filter) {
+    memset(filter, 0, sizeof(struct JidFilter));
 }
 
-bool match_jid(const char* actual_jid, const char* expected_jid) {
-    if (actual_jid == NULL || expected_jid == NULL) {
-        //this should not happen
+bool jid_filter_add(struct JidFilter* filter, const char* rule) {
+    //"*@domain" (or "@domain") allows the whole domain
+    if (rule[0] == '@' || (rule[0] == '*' && rule[1] == '@')) {
+        rule = strchr(rule, '@') + 1;
+        struct Jid jid;
+        if (!jid_parse(rule, &jid) || jid.local != NULL || jid.resource != NULL) {
+            jid_free(&jid);
+            return false;
+        }
+        jid_set_insert(&(filter->domains), jid.domain, jid_hash(jid.domain, strlen(jid.domain)));
+        return true;
+    }
+
+    struct Jid jid;
+    if (!jid_parse(rule, &jid) || jid.local == NULL) {
+        jid_free(&jid);
         return false;
     }
 
-    //two cases for exact match:
-    //1. if expected_jid has a resource, actual_jid must have the same
-    //2. if both have no resource, they must be equal, too
-    if (strchr(expected_jid, '/') != NULL || strchr(actual_jid, '/') == NULL) {
-        return strcmp(actual_jid, expected_jid) == 0;
+    //"user@domain" and "user@domain/*" allow any resource
+    const size_t len = strlen(jid.local) + strlen(jid.domain) + 1;
+    if (jid.resource == NULL || strcmp(jid.resource, "*") == 0) {
+        char* bare = malloc(len + 1);
+        sprintf(bare, "%s@%s", jid.local, jid.domain);
+        jid_set_insert(&(filter->bare), bare, jid_hash(bare, len));
+    } else {
+        char* full = malloc(len + strlen(jid.resource) + 2);
+        sprintf(full, "%s@%s/%s", jid.local, jid.domain, jid.resource);
+        jid_set_insert(&(filter->full), full, jid_hash(full, strlen(full)));
     }
+    jid_free(&jid);
+    return true;
+}
 
-    //actual_jid has a resource, but expected_jid hasn't - ignore the resource
-    char* truncated_jid = strdup(actual_jid);
-    char* slash_pos = strchr(truncated_jid, '/');
-    *slash_pos = '\0';
-    const bool result = strcmp(expected_jid, truncated_jid) == 0;
-    free(truncated_jid);
-    return result;
+bool jid_filter_match(const struct JidFilter* filter, const char* jid) {
+    if (jid == NULL) {
+        return false;
+    }
+    const size_t bare_len = jid_bare_len(jid);
+    const char* at_pos    = memchr(jid, '@', bare_len);
+    if (at_pos == NULL) {
+        return false;
+    }
+
+    //one hash lookup per rule type (the hashes are computed over the JID as
+    //given, without copying or normalizing it)
+    const size_t full_len = jid[bare_len] == '\0' ? bare_len : bare_len + strlen(jid + bare_len);
+    if (full_len > bare_len && jid_set_contains(&(filter->full), jid, full_len, bare_len, jid_hash(jid, full_len))) {
+        return true;
+    }
+    if (jid_set_contains(&(filter->bare), jid, bare_len, bare_len, jid_hash(jid, bare_len))) {
+        return true;
+    }
+    const char* domain = at_pos + 1;
+    const size_t domain_len = bare_len - (domain - jid);
+    return jid_set_contains(&(filter->domains), domain, domain_len, domain_len, jid_hash(domain, domain_len));
 }
@@ -0,0 +1,622 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+//The journal file starts with JOURNAL_MAGIC (padded to HEADER_SIZE), followed
+//by records that are aligned to 8 bytes. The part of the file after the last
+//record is zeroed, so a record type of 0 marks the end.
+#define JOURNAL_MAGIC "xmpp-bridge journal v1\n"
+#define HEADER_SIZE   32
+#define ALIGN(size)   (((size) + 7) & ~((size_t) 7))
+
+enum RecordType {
+    RECORD_DATA      = 1, //lines for the peer (jid and data follow the header)
+    RECORD_DELIVERED = 2, //the entry with this seq was delivered
+};
+
+struct Record {
+    uint32_t checksum; //crc32 of the rest of the record (incl. jid and data)
+    uint32_t type;
+    uint64_t seq;
+    uint32_t jid_size, data_size;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// queues
+
+static void queue_init(struct JournalQueue* q, size_t item_size) {
+    q->items     = NULL;
+    q->item_size = item_size;
+    q->head      = 0;
+    q->count     = 0;
+    q->capacity  = 0;
+}
+
+static struct JournalItem* queue_at(const struct JournalQueue* q, size_t idx) {
+    return (struct JournalItem*) (q->items + idx * q->item_size);
+}
+
+//Append a new item (with all fields zeroed) and return it.
+static void* queue_push(struct JournalQueue* q, unsigned long long id) {
+    if (q->count == q->capacity) {
+        //reuse the space of the removed items first
+        if (q->head > 0) {
+            memmove(q->items, q->items + q->head * q->item_size, (q->count - q->head) * q->item_size);
+            q->count -= q->head;
+            q->head   = 0;
+        }
+        if (q->count == q->capacity) {
+            q->capacity = q->capacity == 0 ? 64 : 2 * q->capacity;
+            q->items    = realloc(q->items, q->capacity * q->item_size);
+        }
+    }
+    struct JournalItem* item = queue_at(q, q->count++);
+    memset(item, 0, q->item_size);
+    item->id = id;
+    return item;
+}
+
+//Return the index of the first item with at least the given id.
+static size_t queue_lower_bound(const struct JournalQueue* q, unsigned long long id) {
+    size_t lo = q->head, hi = q->count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (queue_at(q, mid)->id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//Return the item with the given id, or NULL if it was removed (or never existed).
+static void* queue_find(const struct JournalQueue* q, unsigned long long id) {
+    const size_t idx = queue_lower_bound(q, id);
+    if (idx == q->count || queue_at(q, idx)->id != id) {
+        return NULL;
+    }
+    return queue_at(q, idx);
+}
+
+//Remove the done items from the front.
+static void queue_trim(struct JournalQueue* q) {
+    while (q->head < q->count && queue_at(q, q->head)->done) {
+        ++q->head;
+    }
+    if (q->head == q->count) {
+        q->head  = 0;
+        q->count = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// file
+
+static size_t record_size(const struct Record* rec) {
+    return ALIGN(sizeof(struct Record) + rec->jid_size + rec->data_size);
+}
+
+static uint32_t record_checksum(const struct Record* rec) {
+    const size_t offset = offsetof(struct Record, type);
+    return crc32(0L, (const unsigned char*) rec + offset, sizeof(struct Record) - offset + rec->jid_size + rec->data_size);
+}
+
+//Create a new journal file of the given size (with blocks allocated up front,
+//since writing to a hole in a mapping only fails with SIGBUS when the disk is
+//full) and map it into @a map.
+static int create_file(const char* path, size_t size, char** map) {
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: cannot create journal %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    const int err = posix_fallocate(fd, 0, size);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: cannot allocate %zu bytes for journal %s: %s\n", size, path, strerror(err));
+        close(fd);
+        return -1;
+    }
+    *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) {
+        fprintf(stderr, "ERROR: cannot map journal %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    memcpy(*map, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+    return fd;
+}
+
+//Replace the journal file by one that contains only the undelivered entries,
+//with room for at least @a needed more bytes. (The new file is written next to
+//the old one and renamed over it, so a crash leaves either one intact.)
+static bool journal_compact(struct Journal* j, size_t needed) {
+    struct JournalQueue* entries = &(j->entries);
+    queue_trim(entries);
+
+    size_t live = HEADER_SIZE;
+    for (size_t idx = entries->head; idx < entries->count; ++idx) {
+        const struct JournalEntry* entry = (const struct JournalEntry*) queue_at(entries, idx);
+        if (!entry->item.done) {
+            live += record_size((const struct Record*) (j->map + entry->offset));
+        }
+    }
+    size_t size = JOURNAL_MIN_BYTES;
+    while (size < 2 * (live + needed)) {
+        size *= 2;
+    }
+
+    const size_t path_len = strlen(j->path) + 8;
+    char new_path[path_len];
+    snprintf(new_path, path_len, "%s.new", j->path);
+    char* map;
+    const int fd = create_file(new_path, size, &map);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t end = HEADER_SIZE;
+    for (size_t idx = entries->head; idx < entries->count; ++idx) {
+        const struct JournalEntry* entry = (const struct JournalEntry*) queue_at(entries, idx);
+        if (!entry->item.done) {
+            const size_t rec_size = record_size((const struct Record*) (j->map + entry->offset));
+            memcpy(map + end, j->map + entry->offset, rec_size);
+            end += rec_size;
+        }
+    }
+    if (msync(map, end, MS_SYNC) < 0 || rename(new_path, j->path) < 0) {
+        fprintf(stderr, "ERROR: cannot replace journal %s: %s\n", j->path, strerror(errno));
+        munmap(map, size);
+        close(fd);
+        unlink(new_path);
+        return false;
+    }
+
+    //the entries are in the same order in the new file
+    end = HEADER_SIZE;
+    for (size_t idx = entries->head; idx < entries->count; ++idx) {
+        struct JournalEntry* entry = (struct JournalEntry*) queue_at(entries, idx);
+        if (!entry->item.done) {
+            const size_t rec_size = record_size((const struct Record*) (map + end));
+            entry->offset = end;
+            end += rec_size;
+        }
+    }
+
+    munmap(j->map, j->map_size);
+    close(j->fd);
+    j->fd       = fd;
+    j->map      = map;
+    j->map_size = size;
+    j->end      = end;
+    j->synced   = end;
+    j->sync_due = -1;
+    return true;
+}
+
+//Append a record, and return its offset (or 0 on error).
+static size_t journal_write(struct Journal* j, enum RecordType type, unsigned long long seq, const char* jid, size_t jid_size, const char* data, size_t data_size) {
+    const size_t size = ALIGN(sizeof(struct Record) + jid_size + data_size);
+    if (j->end + size > j->map_size && !journal_compact(j, size)) {
+        return 0;
+    }
+
+    //the checksum makes a partially written record at the end recognizable
+    //(when the system crashes before it was synced)
+    const size_t offset = j->end;
+    struct Record* rec = (struct Record*) (j->map + offset);
+    rec->type      = type;
+    rec->seq       = seq;
+    rec->jid_size  = jid_size;
+    rec->data_size = data_size;
+    memcpy(j->map + offset + sizeof(struct Record), jid, jid_size);
+    memcpy(j->map + offset + sizeof(struct Record) + jid_size, data, data_size);
+    rec->checksum  = record_checksum(rec);
+    j->end += size;
+
+    if (j->sync_due < 0) {
+        j->sync_due = clock_msec() + JOURNAL_SYNC_MSEC;
+    }
+    return offset;
+}
+
+static void journal_deliver(struct Journal* j, struct JournalEntry* entry) {
+    entry->item.done = true;
+    --j->pending;
+    journal_write(j, RECORD_DELIVERED, entry->item.id, NULL, 0, NULL, 0);
+}
+
+//Read the records of the journal file.
+static void journal_load(struct Journal* j) {
+    size_t offset = HEADER_SIZE;
+    while (offset + sizeof(struct Record) <= j->map_size) {
+        const struct Record* rec = (const struct Record*) (j->map + offset);
+        if (rec->type == 0) {
+            break;
+        }
+        const bool valid = rec->jid_size <= j->map_size && rec->data_size <= j->map_size
+            && offset + record_size(rec) <= j->map_size && rec->checksum == record_checksum(rec);
+        if (!valid) {
+            //the system crashed while this record was written; overwrite it
+            fprintf(stderr, "WARNING: ignoring incomplete record at the end of journal %s\n", j->path);
+            memset(j->map + offset, 0, j->map_size - offset);
+            break;
+        }
+
+        if (rec->type == RECORD_DATA) {
+            struct JournalEntry* entry = queue_push(&(j->entries), rec->seq);
+            entry->offset = offset;
+            entry->jid    = NULL; //(set by journal_replay())
+            ++j->pending;
+        } else if (rec->type == RECORD_DELIVERED) {
+            struct JournalEntry* entry = queue_find(&(j->entries), rec->seq);
+            if (entry != NULL && !entry->item.done) {
+                entry->item.done = true;
+                --j->pending;
+            }
+        }
+        if (rec->seq >= j->next_seq) {
+            j->next_seq = rec->seq + 1;
+        }
+        offset += record_size(rec);
+    }
+    queue_trim(&(j->entries));
+    j->end    = offset;
+    j->synced = offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// receipt support
+
+#define DISCO_INFO_NS "http://jabber.org/protocol/disco#info"
+
+static int disco_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata);
+
+//Ask the contact @a to which features it supports (XEP-0030).
+static void disco_query(struct Journal* j, xmpp_conn_t* conn, struct Config* cfg, const char* to) {
+    //<iq type="get" to="..."><query xmlns="http://jabber.org/protocol/disco#info"/></iq>
+    char id[32];
+    snprintf(id, sizeof(id), "xj-disco-%llu", j->next_disco++);
+    xmpp_stanza_t* iq = xmpp_iq_new(cfg->ctx, "get", id);
+    xmpp_stanza_set_to(iq, to);
+    xmpp_stanza_t* query = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(query, "query");
+    xmpp_stanza_set_ns(query, DISCO_INFO_NS);
+    xmpp_stanza_add_child(iq, query);
+    xmpp_stanza_release(query);
+
+    xmpp_id_handler_add(conn, disco_handler, id, cfg);
+    xmpp_send(conn, iq);
+    xmpp_stanza_release(iq);
+}
+
+static int disco_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    (void) conn;
+    struct Config* cfg = (struct Config*) userdata;
+    const char* from = xmpp_stanza_get_from(stanza);
+    struct Peer* peer = from == NULL ? NULL : router_lookup(cfg->router, from);
+    if (peer == NULL) {
+        return 0; //remove this handler
+    }
+    peer->journal_disco_until = -1;
+
+    //an error (e.g. when the contact is offline) tells nothing, and another
+    //resource of a bare JID may have confirmed the support already
+    const char* type = xmpp_stanza_get_type(stanza);
+    xmpp_stanza_t* query = xmpp_stanza_get_child_by_name_and_ns(stanza, "query", DISCO_INFO_NS);
+    if (type == NULL || strcmp(type, "result") != 0 || query == NULL || peer->journal_receipts == RECEIPTS_SUPPORTED) {
+        return 0;
+    }
+    for (xmpp_stanza_t* child = xmpp_stanza_get_children(query); child != NULL; child = xmpp_stanza_get_next(child)) {
+        const char* name = xmpp_stanza_get_name(child);
+        const char* var  = xmpp_stanza_get_attribute(child, "var");
+        if (name != NULL && strcmp(name, "feature") == 0 && var != NULL && strcmp(var, RECEIPTS_NS) == 0) {
+            peer->journal_receipts = RECEIPTS_SUPPORTED;
+            return 0;
+        }
+    }
+    if (peer->journal_receipts != RECEIPTS_UNSUPPORTED) {
+        fprintf(stderr, "WARNING: %s does not support delivery receipts, so lines for it are not journaled\n", from);
+        peer->journal_receipts = RECEIPTS_UNSUPPORTED;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// public API
+
+bool journal_init(struct Journal* j, const char* path) {
+    j->path         = path;
+    j->sync_due     = -1;
+    j->nonce        = (unsigned long long) clock_msec() ^ ((unsigned long long) getpid() << 40);
+    j->next_seq     = 1;
+    j->next_group   = 1;
+    j->next_message = 1;
+    j->next_disco   = 1;
+    j->pending      = 0;
+    queue_init(&(j->entries),  sizeof(struct JournalEntry));
+    queue_init(&(j->groups),   sizeof(struct JournalGroup));
+    queue_init(&(j->messages), sizeof(struct JournalMessage));
+
+    //start a new journal if there is none (or an empty file)
+    struct stat st;
+    if (stat(path, &st) < 0 || st.st_size == 0) {
+        j->fd = create_file(path, JOURNAL_MIN_BYTES, &(j->map));
+        if (j->fd < 0) {
+            return false;
+        }
+        j->map_size = JOURNAL_MIN_BYTES;
+        j->end      = HEADER_SIZE;
+        j->synced   = 0;
+        j->sync_due = 0;
+        journal_sync(j, true);
+        return true;
+    }
+
+    j->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (j->fd < 0 || fstat(j->fd, &st) < 0) {
+        fprintf(stderr, "FATAL: cannot open journal %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    j->map_size = st.st_size;
+    j->map = j->map_size < HEADER_SIZE ? MAP_FAILED : mmap(NULL, j->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+    if (j->map == MAP_FAILED || memcmp(j->map, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0) {
+        fprintf(stderr, "FATAL: %s is not a journal file of xmpp-bridge\n", path);
+        return false;
+    }
+    journal_load(j);
+    return true;
+}
+
+void journal_replay(struct Journal* j, struct Router* r, long long now) {
+    struct JournalQueue* entries = &(j->entries);
+    size_t count = 0;
+    for (size_t idx = entries->head; idx < entries->count; ++idx) {
+        struct JournalEntry* entry = (struct JournalEntry*) queue_at(entries, idx);
+        if (entry->item.done) {
+            continue;
+        }
+        const struct Record* rec = (const struct Record*) (j->map + entry->offset);
+        const char* jid  = (const char*) (rec + 1);
+        const char* data = jid + rec->jid_size;
+
+        struct Peer* peer = NULL;
+        for (size_t peer_idx = 0; peer_idx < r->count && peer == NULL; ++peer_idx) {
+            const char* peer_jid = r->peers[peer_idx].jid;
+            if (strlen(peer_jid) == rec->jid_size && memcmp(peer_jid, jid, rec->jid_size) == 0) {
+                peer = &(r->peers[peer_idx]);
+            }
+        }
+        if (peer == NULL) {
+            fprintf(stderr, "WARNING: discarding %u bytes from journal for %.*s, which is not a peer anymore\n",
+                rec->data_size, (int) rec->jid_size, jid);
+            journal_deliver(j, entry);
+            continue;
+        }
+
+        //the batch is due right away
+        batch_add(&(peer->batch), data, rec->data_size, now, now);
+        entry->jid        = peer->jid;
+        peer->journal_seq = entry->item.id;
+        ++count;
+    }
+    queue_trim(entries);
+    if (count > 0) {
+        fprintf(stderr, "INFO: sending %zu undelivered entries from journal %s again\n", count, j->path);
+    }
+}
+
+void journal_append(struct Journal* j, struct Peer* peer, const char* data, size_t size) {
+    if (peer->journal_receipts == RECEIPTS_UNSUPPORTED) {
+        return;
+    }
+    const size_t offset = journal_write(j, RECORD_DATA, j->next_seq, peer->jid, strlen(peer->jid), data, size);
+    if (offset == 0) {
+        return; //(the lines are still sent, just without a guarantee)
+    }
+    struct JournalEntry* entry = queue_push(&(j->entries), j->next_seq++);
+    entry->offset = offset;
+    entry->jid    = peer->jid;
+    peer->journal_seq = entry->item.id;
+    ++j->pending;
+}
+
+//Mark the entries in (first, last] that belong to the peer @a jid as delivered.
+static void deliver_range(struct Journal* j, const char* jid, unsigned long long first, unsigned long long last) {
+    struct JournalQueue* entries = &(j->entries);
+    for (size_t idx = queue_lower_bound(entries, first + 1); idx < entries->count; ++idx) {
+        struct JournalEntry* entry = (struct JournalEntry*) queue_at(entries, idx);
+        if (entry->item.id > last) {
+            break;
+        }
+        //(the range also contains entries for other peers)
+        if (!entry->item.done && entry->jid == jid) {
+            journal_deliver(j, entry);
+        }
+    }
+    queue_trim(entries);
+}
+
+unsigned long long journal_group_begin(struct Journal* j, struct Peer* peer) {
+    if (peer->journal_receipts == RECEIPTS_UNSUPPORTED) {
+        //(only entries from before that was known, e.g. from journal_replay())
+        deliver_range(j, peer->jid, peer->journal_sent, peer->journal_seq);
+        peer->journal_sent = peer->journal_seq;
+        return 0;
+    }
+    struct JournalGroup* group = queue_push(&(j->groups), j->next_group++);
+    group->jid     = peer->jid;
+    group->peer    = peer;
+    group->first   = peer->journal_sent;
+    group->last    = peer->journal_seq;
+    group->sent_at = clock_msec();
+    peer->journal_sent = peer->journal_seq;
+    return group->item.id;
+}
+
+void journal_message_id(struct Journal* j, unsigned long long group_id, char* buf, size_t size) {
+    struct JournalGroup* group = queue_find(&(j->groups), group_id);
+    if (group != NULL) {
+        ++group->unacked;
+    }
+    struct JournalMessage* msg = queue_push(&(j->messages), j->next_message++);
+    msg->group = group_id;
+    //like latency_format_id(), but these may be combined in one stanza id
+    snprintf(buf, size, "xj-%llx-%llu", j->nonce, msg->item.id);
+}
+
+//Mark the entries of @a group as delivered once all its messages are acknowledged.
+static void group_complete(struct Journal* j, struct JournalGroup* group) {
+    if (group->unacked > 0) {
+        return;
+    }
+    group->item.done = true;
+    deliver_range(j, group->jid, group->first, group->last);
+    queue_trim(&(j->groups));
+}
+
+void journal_group_end(struct Journal* j, unsigned long long group_id) {
+    struct JournalGroup* group = queue_find(&(j->groups), group_id);
+    if (group != NULL) {
+        group_complete(j, group);
+    }
+}
+
+void journal_acked(struct Journal* j, const char* id) {
+    //with --trace-latency, our part follows the part of latency_format_id()
+    const char* part = id == NULL ? NULL : strstr(id, "xj-");
+    unsigned long long nonce, msg_id;
+    char rest;
+    if (part == NULL || sscanf(part, "xj-%llx-%llu%c", &nonce, &msg_id, &rest) != 2 || nonce != j->nonce) {
+        return;
+    }
+
+    struct JournalMessage* msg = queue_find(&(j->messages), msg_id);
+    if (msg == NULL || msg->item.done) {
+        return; //duplicate receipt
+    }
+    msg->item.done = true;
+    struct JournalGroup* group = queue_find(&(j->groups), msg->group);
+    queue_trim(&(j->messages));
+    if (group != NULL && !group->item.done) {
+        group->peer->journal_receipts = RECEIPTS_SUPPORTED;
+        --group->unacked;
+        group_complete(j, group);
+    }
+}
+
+bool journal_waiting(const struct Journal* j) {
+    //(groups for peers without receipts stay pending, but there is no point
+    //in waiting for them)
+    const struct JournalQueue* groups = &(j->groups);
+    for (size_t idx = groups->head; idx < groups->count; ++idx) {
+        const struct JournalGroup* group = (const struct JournalGroup*) queue_at(groups, idx);
+        if (!group->item.done && group->peer->journal_receipts != RECEIPTS_UNSUPPORTED) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void journal_check_receipts(struct Journal* j, long long now) {
+    //(the groups are ordered by sent_at)
+    struct JournalQueue* groups = &(j->groups);
+    for (size_t idx = groups->head; idx < groups->count; ++idx) {
+        struct JournalGroup* group = (struct JournalGroup*) queue_at(groups, idx);
+        if (now - group->sent_at < JOURNAL_RECEIPT_MSEC) {
+            break;
+        }
+        struct Peer* peer = group->peer;
+        if (group->item.done || peer->journal_receipts == RECEIPTS_SUPPORTED || peer->journal_warned) {
+            continue;
+        }
+        fprintf(stderr, "WARNING: no delivery receipt from %s within %d seconds; the lines for it stay in journal %s, "
+            "and will be sent again on the next start\n", peer->jid, JOURNAL_RECEIPT_MSEC / 1000, j->path);
+        peer->journal_warned = true;
+    }
+}
+
+void journal_discover(struct Journal* j, struct Router* r, xmpp_conn_t* conn, struct Config* cfg, long long now) {
+    for (size_t idx = 0; idx < r->count; ++idx) {
+        struct Peer* peer = &(r->peers[idx]);
+        //(the client behind the JID may have changed while we were offline)
+        peer->journal_receipts    = RECEIPTS_UNKNOWN;
+        peer->journal_disco_until = -1;
+        peer->journal_warned      = false;
+        //(a MUC room acknowledges by reflecting our messages; peers with a
+        //bare JID are asked when their resources send presence)
+        if (peer->resource != NULL && !peer->groupchat) {
+            disco_query(j, conn, cfg, peer->jid);
+            peer->journal_disco_until = now + JOURNAL_DISCO_MSEC;
+        }
+    }
+}
+
+int journal_presence_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    //userdata contains a Config struct
+    struct Config* cfg = (struct Config*) userdata;
+    const char* from = xmpp_stanza_get_from(stanza);
+    struct Peer* peer = from == NULL ? NULL : router_lookup(cfg->router, from);
+    //only available presences (without a type) of a resource
+    if (peer == NULL || peer->resource != NULL || peer->groupchat || xmpp_stanza_get_type(stanza) != NULL
+            || from[peer->bare_len] != '/' || peer->journal_receipts == RECEIPTS_SUPPORTED) {
+        return 1;
+    }
+    disco_query(cfg->journal, conn, cfg, from);
+    return 1;
+}
+
+bool journal_may_send(const struct Peer* peer, long long now) {
+    return peer->journal_disco_until < 0 || now >= peer->journal_disco_until;
+}
+
+void journal_sync(struct Journal* j, bool force) {
+    if (j->sync_due < 0 || (!force && clock_msec() < j->sync_due)) {
+        return;
+    }
+    //(msync() needs a page-aligned start)
+    const size_t start = j->synced - j->synced % sysconf(_SC_PAGESIZE);
+    if (msync(j->map + start, j->end - start, MS_SYNC) < 0) {
+        fprintf(stderr, "ERROR: cannot sync journal %s: %s\n", j->path, strerror(errno));
+    }
+    j->synced   = j->end;
+    j->sync_due = -1;
+}
+
+void journal_close(struct Journal* j) {
+    journal_sync(j, true);
+    if (j->pending > 0) {
+        fprintf(stderr, "WARNING: %zu entries in journal %s were not acknowledged, and will be sent again on the next start\n", j->pending, j->path);
+    }
+    munmap(j->map, j->map_size);
+    close(j->fd);
+    free(j->entries.items);
+    free(j->groups.items);
+    free(j->messages.items);
+}
@@ -0,0 +1,122 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void samples_add(struct LatencySamples* samples, long long value) {
+    //keep the most recent LATENCY_SAMPLES values
+    samples->values[samples->total++ % LATENCY_SAMPLES] = value;
+}
+
+static int compare_long_long(const void* a, const void* b) {
+    const long long x = *((const long long*) a), y = *((const long long*) b);
+    return x < y ? -1 : x > y;
+}
+
+static void samples_report(const char* name, const struct LatencySamples* samples) {
+    const size_t count = samples->total < LATENCY_SAMPLES ? samples->total : LATENCY_SAMPLES;
+    if (count == 0) {
+        fprintf(stderr, "INFO: latency %s: no samples\n", name);
+        return;
+    }
+    long long* sorted = malloc(sizeof(long long) * count);
+    memcpy(sorted, samples->values, sizeof(long long) * count);
+    qsort(sorted, count, sizeof(long long), compare_long_long);
+    fprintf(stderr, "INFO: latency %s: p50 %lld ms, p90 %lld ms, p99 %lld ms, max. %lld ms (last %zu messages)\n",
+        name, sorted[count * 50 / 100], sorted[count * 90 / 100], sorted[count * 99 / 100], sorted[count - 1], count);
+    free(sorted);
+}
+
+void latency_init(struct Latency* lat) {
+    lat->pending  = calloc(LATENCY_PENDING, sizeof(struct LatencyEntry));
+    lat->nonce    = (unsigned long long) clock_msec() ^ ((unsigned long long) getpid() << 40);
+    lat->next_seq = 1; //0 marks unused entries
+    lat->acked    = 0;
+    lat->expired  = 0;
+    lat->read_to_send.values = malloc(sizeof(long long) * LATENCY_SAMPLES);
+    lat->read_to_send.total  = 0;
+    lat->send_to_ack.values  = malloc(sizeof(long long) * LATENCY_SAMPLES);
+    lat->send_to_ack.total   = 0;
+    lat->read_to_ack.values  = malloc(sizeof(long long) * LATENCY_SAMPLES);
+    lat->read_to_ack.total   = 0;
+}
+
+unsigned long long latency_sent(struct Latency* lat, long long read_at, long long sent_at) {
+    //the sequence number doubles as index into the ring of pending messages,
+    //so looking up an acknowledged message does not need a hash table
+    const unsigned long long seq = lat->next_seq++;
+    struct LatencyEntry* entry = &(lat->pending[seq % LATENCY_PENDING]);
+    if (entry->seq != 0) {
+        ++lat->expired; //never acknowledged
+    }
+    entry->seq     = seq;
+    entry->read_at = read_at;
+    entry->sent_at = sent_at;
+
+    samples_add(&(lat->read_to_send), sent_at - read_at);
+    metrics_observe(HISTOGRAM_READ_TO_SEND_MSEC, sent_at - read_at);
+    return seq;
+}
+
+void latency_format_id(const struct Latency* lat, unsigned long long seq, char* buf, size_t size) {
+    //the nonce keeps receipts for an earlier process from being mistaken for ours
+    snprintf(buf, size, "xb-%llx-%llu", lat->nonce, seq);
+}
+
+unsigned long long latency_parse_id(const struct Latency* lat, const char* id) {
+    unsigned long long nonce, seq;
+    char rest;
+    //(with --journal, its part of the id follows after a "+")
+    const int fields = id == NULL ? 0 : sscanf(id, "xb-%llx-%llu%c", &nonce, &seq, &rest);
+    if ((fields != 2 && (fields != 3 || rest != '+')) || nonce != lat->nonce) {
+        return 0;
+    }
+    return seq;
+}
+
+void latency_acked(struct Latency* lat, unsigned long long seq, long long acked_at) {
+    struct LatencyEntry* entry = &(lat->pending[seq % LATENCY_PENDING]);
+    if (seq == 0 || entry->seq != seq) {
+        return; //unknown, duplicate or expired
+    }
+    entry->seq = 0;
+    ++lat->acked;
+
+    samples_add(&(lat->send_to_ack), acked_at - entry->sent_at);
+    samples_add(&(lat->read_to_ack), acked_at - entry->read_at);
+    metrics_observe(HISTOGRAM_SEND_TO_ACK_MSEC, acked_at - entry->sent_at);
+    metrics_observe(HISTOGRAM_READ_TO_ACK_MSEC, acked_at - entry->read_at);
+}
+
+void latency_report(const struct Latency* lat) {
+    size_t pending = 0;
+    for (size_t idx = 0; idx < LATENCY_PENDING; ++idx) {
+        pending += lat->pending[idx].seq != 0;
+    }
+    fprintf(stderr, "INFO: latency: %llu messages acknowledged, %zu still pending, %llu never acknowledged\n",
+        lat->acked, pending, lat->expired);
+    samples_report("read->send", &(lat->read_to_send));
+    samples_report("send->ack", &(lat->send_to_ack));
+    samples_report("read->ack", &(lat->read_to_ack));
+}
@@ -19,10 +19,14 @@
 
 #include "xmpp-bridge.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <strophe.h>
 
 #ifdef RELEASE
@@ -31,6 +35,43 @@
 #   define MY_LOG_LEVEL XMPP_LEVEL_DEBUG
 #endif
 
+//libstrophe runs its own timers (e.g. connect and disconnect timeouts) inside
+//xmpp_run_once(), but does not tell us when the next one is due, so poll() is
+//woken up at least this often to let them fire
+#define XMPP_TIMER_MSEC 1000
+//TLS may decrypt more data than libstrophe consumes in one xmpp_run_once();
+//since that data is no longer visible to poll(), check back after this short
+//timeout whenever the socket was readable
+#define XMPP_DRAIN_MSEC 1
+//stop reading input while this many stanzas are waiting in libstrophe's send
+//queue, so that a slow connection applies backpressure to the input
+#define XMPP_SEND_QUEUE_MAX 64
+//with --reconnect, the delay before the next connection attempt doubles from
+//RECONNECT_MIN_MSEC up to RECONNECT_MAX_MSEC (plus jitter)
+#define RECONNECT_MIN_MSEC 1000
+#define RECONNECT_MAX_MSEC 60000
+//with --io-uring, the size of the submission queue (each peer needs up to four
+//entries per iteration, each fd in the PollSet up to two)
+#define URING_ENTRIES 256
+
+//file descriptor of the socket of the XMPP connection (or -1 before the socket
+//is created), as reported to sockopt_callback()
+static int xmpp_fd = -1;
+//timing of the current connection attempt (for the metrics and --trace-connect)
+static struct ConnectTrace connect_trace;
+//with --srv-cache, the server of the current connection attempt (libstrophe
+//may keep a pointer to the host name)
+static struct Endpoint endpoint;
+
+int sockopt_callback(xmpp_conn_t* conn, void* sock) {
+    (void) conn;
+    xmpp_fd = *((int*) sock);
+    //child processes that are started later (with --workers) shall not
+    //inherit the connection
+    fcntl(xmpp_fd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
 void send_presence(xmpp_conn_t* conn, const struct Config* cfg) {
     //send <presence/> to appear online to contacts
     xmpp_stanza_t* pres = xmpp_stanza_new(cfg->ctx);
@@ -39,58 +80,559 @@ void send_presence(xmpp_conn_t* conn, const struct Config* cfg) {
     xmpp_stanza_release(pres);
 }
 
-int message_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
-    (void) conn;
-    //userdata contains a Config struct
-    struct Config* cfg = (struct Config*) userdata;
+void send_muc_join(xmpp_conn_t* conn, const struct Config* cfg) {
+    //send <presence to="room@service/nick"><x xmlns="http://jabber.org/protocol/muc"/></presence>
+    xmpp_stanza_t* pres = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(pres, "presence");
+    xmpp_stanza_set_attribute(pres, "to", cfg->muc_jid);
+
+    xmpp_stanza_t* x = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(x, "x");
+    xmpp_stanza_set_ns(x, "http://jabber.org/protocol/muc");
+    xmpp_stanza_add_child(pres, x);
 
     if (!cfg->show_delayed_messages) {
-        //check for delayed messages formatted according to XEP-0091
-        xmpp_stanza_t* delay_marker = xmpp_stanza_get_child_by_name(stanza, "x");
-        if (delay_marker != NULL) {
-            const char* ns = xmpp_stanza_get_ns(delay_marker);
-            if (ns != NULL && strcmp(ns, "jabber:x:delay") == 0) {
-                return 1;
-            }
+        //ask the room not to replay its history, instead of filtering it out
+        xmpp_stanza_t* history = xmpp_stanza_new(cfg->ctx);
+        xmpp_stanza_set_name(history, "history");
+        xmpp_stanza_set_attribute(history, "maxstanzas", "0");
+        xmpp_stanza_add_child(x, history);
+        xmpp_stanza_release(history);
+    }
+    xmpp_stanza_release(x);
+
+    xmpp_send(conn, pres);
+    xmpp_stanza_release(pres);
+}
+
+void send_receipt(xmpp_conn_t* conn, const struct Config* cfg, const char* to, const char* id) {
+    //send <message to="..."><received xmlns="urn:xmpp:receipts" id="..."/></message>
+    xmpp_stanza_t* msg = xmpp_message_new(cfg->ctx, NULL, to, NULL);
+    xmpp_stanza_t* received = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(received, "received");
+    xmpp_stanza_set_ns(received, RECEIPTS_NS);
+    xmpp_stanza_set_attribute(received, "id", id);
+    xmpp_stanza_add_child(msg, received);
+    xmpp_stanza_release(received);
+    xmpp_send(conn, msg);
+    xmpp_stanza_release(msg);
+}
+
+//Send a message with the given text to @a peer. The text was read from the
+//peer's input at @a read_at. With --journal, the message belongs to the given
+//journal @a group.
+void send_message(xmpp_conn_t* conn, const struct Config* cfg, const struct Peer* peer, const char* str, size_t len, long long read_at, unsigned long long group) {
+    xmpp_stanza_t* reply = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(reply, "message");
+    xmpp_stanza_set_type(reply, peer->groupchat ? "groupchat" : "chat");
+    xmpp_stanza_set_attribute(reply, "from", cfg->jid);
+    xmpp_stanza_set_attribute(reply, "to", peer->jid);
+
+    //with --trace-latency and --journal, ask for a delivery receipt (not
+    //supported in rooms, but they reflect our message with the same id)
+    char id[128] = "";
+    if (cfg->latency != NULL && !peer->groupchat) {
+        latency_format_id(cfg->latency, latency_sent(cfg->latency, read_at, clock_msec()), id, sizeof(id));
+    }
+    if (group != 0) {
+        //(with both, the id is "LATENCY_ID+JOURNAL_ID")
+        const size_t id_len = strlen(id);
+        if (id_len > 0) {
+            id[id_len] = '+';
         }
-        //check for delayed messages formatted according to XEP-0203
-        delay_marker = xmpp_stanza_get_child_by_name(stanza, "delay");
-        if (delay_marker != NULL) {
-            const char* ns = xmpp_stanza_get_ns(delay_marker);
-            if (ns != NULL && strcmp(ns, "urn:xmpp:delay") == 0) {
-                return 1;
-            }
+        journal_message_id(cfg->journal, group, id + id_len + (id_len > 0), sizeof(id) - id_len - 1);
+    }
+    if (id[0] != '\0') {
+        xmpp_stanza_set_id(reply, id);
+    }
+    if (id[0] != '\0' && !peer->groupchat) {
+        xmpp_stanza_t* request = xmpp_stanza_new(cfg->ctx);
+        xmpp_stanza_set_name(request, "request");
+        xmpp_stanza_set_ns(request, RECEIPTS_NS);
+        xmpp_stanza_add_child(reply, request);
+        xmpp_stanza_release(request);
+    }
+
+    xmpp_stanza_t* body = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(body, "body");
+
+    //with --compress, the text goes into a payload element for the receiving
+    //xmpp-bridge, and other clients only see a notice in the body
+    char* payload = (cfg->compress && !peer->groupchat) ? compress_payload(cfg->ctx, str, len) : NULL;
+
+    xmpp_stanza_t* text = xmpp_stanza_new(cfg->ctx);
+    if (payload == NULL) {
+        xmpp_stanza_set_text_with_size(text, str, len);
+    } else {
+        char notice[128];
+        snprintf(notice, sizeof(notice), "[%zu bytes of compressed output from xmpp-bridge]", len);
+        xmpp_stanza_set_text(text, notice);
+    }
+
+    xmpp_stanza_add_child(body, text);
+    xmpp_stanza_add_child(reply, body);
+
+    if (payload != NULL) {
+        char size[32];
+        snprintf(size, sizeof(size), "%zu", len);
+        xmpp_stanza_t* compressed = xmpp_stanza_new(cfg->ctx);
+        xmpp_stanza_set_name(compressed, "compressed");
+        xmpp_stanza_set_ns(compressed, COMPRESS_NS);
+        xmpp_stanza_set_attribute(compressed, "algorithm", "zlib");
+        xmpp_stanza_set_attribute(compressed, "size", size);
+
+        xmpp_stanza_t* compressed_text = xmpp_stanza_new(cfg->ctx);
+        xmpp_stanza_set_text(compressed_text, payload);
+        xmpp_free(cfg->ctx, payload);
+
+        xmpp_stanza_add_child(compressed, compressed_text);
+        xmpp_stanza_release(compressed_text);
+        xmpp_stanza_add_child(reply, compressed);
+        xmpp_stanza_release(compressed);
+    }
+
+    xmpp_send(conn, reply);
+    xmpp_stanza_release(reply);
+    if (cfg->transcript != NULL) {
+        transcript_record(cfg->transcript, TRANSCRIPT_SENT, peer->jid, str, len);
+    }
+    rate_limit_take(cfg->rate_limit, len);
+    metrics_count(COUNTER_MESSAGES_SENT, 1);
+    metrics_count(COUNTER_MESSAGE_BYTES_SENT, len);
+    metrics_observe(HISTOGRAM_MESSAGE_BYTES, len);
+}
+
+void send_lines(xmpp_conn_t* conn, const struct Config* cfg, struct Peer* peer, const char* str, size_t len, long long read_at) {
+    //with --journal, the lines are everything that was journaled for this peer
+    //since the last call, and are delivered once all these messages are
+    const unsigned long long group = cfg->journal == NULL ? 0 : journal_group_begin(cfg->journal, peer);
+
+    //send one message per chunk of at most max_message_bytes
+    while (len > 0) {
+        size_t consumed;
+        const size_t chunk_len = batch_split(str, len, cfg->max_message_bytes, &consumed);
+        if (chunk_len > 0) {
+            send_message(conn, cfg, peer, str, chunk_len, read_at, group);
         }
+        str += consumed;
+        len -= consumed;
+    }
+    if (group != 0) {
+        journal_group_end(cfg->journal, group);
     }
+}
 
-    //check JID of sender
-    const char* other_jid = xmpp_stanza_get_attribute(stanza, "from");
-    if (!match_jid(other_jid, cfg->peer_jid)) {
-        return 1;
+#define REPLY_NS "urn:xmpp:reply:0"
+
+//With --workers, send @a str as the reply to the message of the given @a job:
+//to the full JID of its sender, in the same thread, and referencing the
+//message (XEP-0461), since replies to concurrent requests may arrive in any
+//order.
+void send_reply(xmpp_conn_t* conn, const struct Config* cfg, const struct WorkerJob* job, const char* str, size_t len) {
+    xmpp_stanza_t* reply = xmpp_message_new(cfg->ctx, "chat", job->from, NULL);
+
+    xmpp_stanza_t* body = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(body, "body");
+    xmpp_stanza_t* text = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_text_with_size(text, str, len);
+    xmpp_stanza_add_child(body, text);
+    xmpp_stanza_release(text);
+    xmpp_stanza_add_child(reply, body);
+    xmpp_stanza_release(body);
+
+    if (job->thread != NULL) {
+        xmpp_stanza_t* thread = xmpp_stanza_new(cfg->ctx);
+        xmpp_stanza_set_name(thread, "thread");
+        xmpp_stanza_t* thread_text = xmpp_stanza_new(cfg->ctx);
+        xmpp_stanza_set_text(thread_text, job->thread);
+        xmpp_stanza_add_child(thread, thread_text);
+        xmpp_stanza_release(thread_text);
+        xmpp_stanza_add_child(reply, thread);
+        xmpp_stanza_release(thread);
+    }
+    if (job->id != NULL) {
+        xmpp_stanza_t* reference = xmpp_stanza_new(cfg->ctx);
+        xmpp_stanza_set_name(reference, "reply");
+        xmpp_stanza_set_ns(reference, REPLY_NS);
+        xmpp_stanza_set_attribute(reference, "to", job->from);
+        xmpp_stanza_set_attribute(reference, "id", job->id);
+        xmpp_stanza_add_child(reply, reference);
+        xmpp_stanza_release(reference);
+    }
+
+    xmpp_send(conn, reply);
+    xmpp_stanza_release(reply);
+    if (cfg->transcript != NULL) {
+        transcript_record(cfg->transcript, TRANSCRIPT_SENT, job->from, str, len);
+    }
+    rate_limit_take(cfg->rate_limit, len);
+    metrics_count(COUNTER_MESSAGES_SENT, 1);
+    metrics_count(COUNTER_MESSAGE_BYTES_SENT, len);
+    metrics_observe(HISTOGRAM_MESSAGE_BYTES, len);
+}
+
+//Send the output of a finished @a worker as replies of at most
+//max_message_bytes each, followed by a note if the worker failed.
+static void send_worker_output(xmpp_conn_t* conn, const struct Config* cfg, struct Worker* worker) {
+    const char* str;
+    size_t len;
+    io_getdata(&(worker->io), &str, &len, (size_t) -1);
+
+    char note[64] = "";
+    if (worker->status == -1) {
+        snprintf(note, sizeof(note), "[worker could not be started]");
+    } else if (WIFSIGNALED(worker->status)) {
+        snprintf(note, sizeof(note), "[worker killed by signal %d]", WTERMSIG(worker->status));
+    } else if (WIFEXITED(worker->status) && WEXITSTATUS(worker->status) != 0) {
+        snprintf(note, sizeof(note), "[worker exited with status %d]", WEXITSTATUS(worker->status));
+    } else if (worker->truncated) {
+        snprintf(note, sizeof(note), "[output truncated after %d bytes]", WORKER_MAX_OUTPUT);
+    }
+
+    while (len > 0) {
+        size_t consumed;
+        const size_t chunk_len = batch_split(str, len, cfg->max_message_bytes, &consumed);
+        if (chunk_len > 0) {
+            send_reply(conn, cfg, &(worker->job), str, chunk_len);
+        }
+        str += consumed;
+        len -= consumed;
+    }
+    if (note[0] != '\0') {
+        send_reply(conn, cfg, &(worker->job), note, strlen(note));
+    }
+}
+
+//In daemon mode, the daemon's clients take the place of stdin/stdout for the
+//peer from $XMPPBRIDGE_PEER_JID.
+bool is_daemon_peer(const struct Config* cfg, const struct Peer* peer) {
+    return cfg->daemon != NULL && peer->jid == cfg->peer_jid;
+}
+
+//With --workers, messages for the peer from $XMPPBRIDGE_PEER_JID go to the
+//workers instead of stdout.
+static bool is_worker_peer(const struct Config* cfg, const struct Peer* peer) {
+    return cfg->workers != NULL && peer->jid == cfg->peer_jid;
+}
+
+void deliver_message(const struct Config* cfg, struct Peer* peer, const char* data, size_t count) {
+    if (is_daemon_peer(cfg, peer)) {
+        daemon_write(cfg->daemon, data, count);
+    } else {
+        io_write(&(peer->io), data, count);
+    }
+}
+
+//Return whether the message @a stanza was delayed (e.g. offline storage or
+//room history).
+static bool is_delayed(xmpp_stanza_t* stanza) {
+    //check for delayed messages formatted according to XEP-0091
+    xmpp_stanza_t* delay_marker = xmpp_stanza_get_child_by_name(stanza, "x");
+    if (delay_marker != NULL) {
+        const char* ns = xmpp_stanza_get_ns(delay_marker);
+        if (ns != NULL && strcmp(ns, "jabber:x:delay") == 0) {
+            return true;
+        }
+    }
+    //check for delayed messages formatted according to XEP-0203
+    delay_marker = xmpp_stanza_get_child_by_name(stanza, "delay");
+    if (delay_marker != NULL) {
+        const char* ns = xmpp_stanza_get_ns(delay_marker);
+        if (ns != NULL && strcmp(ns, "urn:xmpp:delay") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Write the time at which the message @a stanza was sent into @a buf (in the
+//format of XEP-0082): its delay stamp if it was delayed, else the current time.
+static const char* message_timestamp(xmpp_stanza_t* stanza, char* buf, size_t size) {
+    xmpp_stanza_t* delay = xmpp_stanza_get_child_by_name_and_ns(stanza, "delay", "urn:xmpp:delay");
+    const char* stamp = delay == NULL ? NULL : xmpp_stanza_get_attribute(delay, "stamp");
+    if (stamp != NULL) {
+        return stamp;
+    }
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    const size_t len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%03ldZ", ts.tv_nsec / 1000000);
+    return buf;
+}
+
+//With --framing, put the @a text of the message @a stanza into the write
+//queue for @a peer as one frame (with --frame-metadata, after the sender,
+//stanza id and timestamp).
+static void deliver_frame(const struct Config* cfg, struct Peer* peer, xmpp_stanza_t* stanza, const char* text, size_t len) {
+    if (!cfg->frame_metadata) {
+        io_write_frame(&(peer->io), NULL, text, len);
+        return;
+    }
+    char stamp[64];
+    const char* from = xmpp_stanza_get_from(stanza);
+    const char* id   = xmpp_stanza_get_id(stanza);
+    const char* fields[] = {
+        from == NULL ? "" : from,
+        id == NULL ? "" : id,
+        message_timestamp(stanza, stamp, sizeof(stamp)),
+        NULL,
+    };
+    io_write_frame(&(peer->io), fields, text, len);
+}
+
+//Decompress the payload element of a message from another xmpp-bridge with
+//--compress, and put the text into the write queue for @a peer.
+static void deliver_compressed(const struct Config* cfg, struct Peer* peer, xmpp_stanza_t* stanza, xmpp_stanza_t* payload) {
+    const char* algorithm = xmpp_stanza_get_attribute(payload, "algorithm");
+    const char* size_str  = xmpp_stanza_get_attribute(payload, "size");
+    char* encoded = xmpp_stanza_get_text(payload);
+
+    char* data  = NULL;
+    size_t size = size_str == NULL ? 0 : strtoull(size_str, NULL, 10);
+    if (algorithm != NULL && strcmp(algorithm, "zlib") == 0 && encoded != NULL) {
+        data = decompress_payload(cfg->ctx, encoded, strlen(encoded), size);
+    }
+    xmpp_free(cfg->ctx, encoded);
+    if (data == NULL) {
+        fprintf(stderr, "ERROR: could not decompress message from %s\n", peer->jid);
+        return;
+    }
+
+    //ensure trailing newline (unless framed), in the same write, so that
+    //--on-output-full=drop cannot drop one without the other
+    if (cfg->framing != FRAMING_LINES) {
+        deliver_frame(cfg, peer, stanza, data, size);
+    } else if (data[size - 1] == '\n') {
+        deliver_message(cfg, peer, data, size);
+    } else {
+        data[size] = '\n';
+        deliver_message(cfg, peer, data, size + 1);
+    }
+    const char* from = xmpp_stanza_get_from(stanza);
+    if (cfg->transcript != NULL) {
+        transcript_record(cfg->transcript, TRANSCRIPT_RECEIVED, from, data, size);
+    }
+    free(data);
+    metrics_count(COUNTER_MESSAGES_RECEIVED, 1);
+}
+
+//Put the body of the message @a stanza into the write queue for @a peer.
+static void deliver_body(const struct Config* cfg, struct Peer* peer, xmpp_stanza_t* stanza) {
+    //a compressed payload replaces the body (which only contains a notice)
+    const char* from = xmpp_stanza_get_from(stanza);
+    xmpp_stanza_t* payload = xmpp_stanza_get_child_by_name_and_ns(stanza, "compressed", COMPRESS_NS);
+    if (payload != NULL) {
+        deliver_compressed(cfg, peer, stanza, payload);
+        return;
     }
 
     //check if there is a body
     xmpp_stanza_t* body = xmpp_stanza_get_child_by_name(stanza, "body");
     if (body == NULL) {
-        return 1;
+        return;
     }
     char* message = xmpp_stanza_get_text(body);
     if (message == NULL) {
-        return 1;
+        return;
     }
 
-    //put message text into write queue (ensure trailing newline)
+    //put message text into write queue (ensure trailing newline, unless framed)
     const size_t len  = strlen(message);
-    if (message[len - 1] == '\n') {
-        io_write(cfg->io, message, len);
+    if (cfg->framing != FRAMING_LINES) {
+        deliver_frame(cfg, peer, stanza, message, len);
+    }
+    else if (message[len - 1] == '\n') {
+        deliver_message(cfg, peer, message, len);
     }
     else {
         message[len] = '\n';
-        io_write(cfg->io, message, len + 1);
+        deliver_message(cfg, peer, message, len + 1);
         message[len] = '\0';
     }
+    if (cfg->transcript != NULL) {
+        transcript_record(cfg->transcript, TRANSCRIPT_RECEIVED, from, message, len);
+    }
     xmpp_free(cfg->ctx, message);
+    metrics_count(COUNTER_MESSAGES_RECEIVED, 1);
+}
+
+//With --workers, hand the body of the message @a stanza from @a from to a
+//worker (or reject it right away if too many messages are waiting).
+static void dispatch_to_worker(xmpp_conn_t* conn, const struct Config* cfg, const char* from, xmpp_stanza_t* stanza) {
+    xmpp_stanza_t* body = xmpp_stanza_get_child_by_name(stanza, "body");
+    char* message = body == NULL ? NULL : xmpp_stanza_get_text(body);
+    if (message == NULL) {
+        return;
+    }
+    xmpp_stanza_t* thread = xmpp_stanza_get_child_by_name(stanza, "thread");
+    char* thread_id = thread == NULL ? NULL : xmpp_stanza_get_text(thread);
+
+    const char* id = xmpp_stanza_get_id(stanza);
+    const size_t len = strlen(message);
+    if (!workers_submit(cfg->workers, from, id, thread_id, message, len, clock_msec())) {
+        static const char busy[] = "[too many requests, please try again later]";
+        struct WorkerJob job = { (char*) from, (char*) id, thread_id, NULL, 0, 0 };
+        fprintf(stderr, "WARNING: rejected message from %s because %zu messages are waiting for a worker\n", from, cfg->workers->queue_count);
+        send_reply(conn, cfg, &job, busy, strlen(busy));
+    }
+    if (cfg->transcript != NULL) {
+        transcript_record(cfg->transcript, TRANSCRIPT_RECEIVED, from, message, len);
+    }
+    xmpp_free(cfg->ctx, thread_id);
+    xmpp_free(cfg->ctx, message);
+    metrics_count(COUNTER_MESSAGES_RECEIVED, 1);
+}
+
+//Find out where a chat message from @a other_jid goes (or return NULL if the
+//sender is not accepted).
+static struct Peer* chat_peer(const struct Config* cfg, const char* other_jid) {
+    struct Peer* peer = router_lookup(cfg->router, other_jid);
+    if (peer == NULL && cfg->allow != NULL && jid_filter_match(cfg->allow, other_jid)) {
+        //senders allowed by --allow talk to the default peer
+        peer = &(cfg->router->peers[0]);
+    }
+    if (peer == NULL || peer->groupchat) {
+        //(private messages from room occupants are not accepted)
+        return NULL;
+    }
+    return peer;
+}
+
+int message_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    //userdata contains a Config struct
+    struct Config* cfg = (struct Config*) userdata;
+
+    if (!cfg->show_delayed_messages && is_delayed(stanza)) {
+        metrics_count(COUNTER_DROPPED_DELAYED, 1);
+        return 1;
+    }
+
+    //check JID of sender, and find out where the message goes
+    const char* other_jid = xmpp_stanza_get_attribute(stanza, "from");
+    struct Peer* peer = chat_peer(cfg, other_jid);
+    if (peer == NULL) {
+        metrics_count(COUNTER_DROPPED_UNKNOWN, 1);
+        return 1;
+    }
+
+    //with --catch-up, skip messages that were delivered before (from the
+    //archive, or before a reconnect)
+    const char* stanza_id = cfg->mam == NULL ? NULL : mam_stanza_id(stanza, cfg->jid);
+    if (stanza_id != NULL && mam_seen(cfg->mam, stanza_id)) {
+        metrics_count(COUNTER_DROPPED_DUPLICATE, 1);
+    } else {
+        if (is_worker_peer(cfg, peer)) {
+            dispatch_to_worker(conn, cfg, other_jid, stanza);
+        } else {
+            deliver_body(cfg, peer, stanza);
+        }
+        //(while catching up, older messages from the archive are still missing)
+        if (stanza_id != NULL && !mam_catching_up(cfg->mam)) {
+            mam_advance(cfg->mam, stanza_id);
+        }
+    }
+
+    //acknowledge delivery when the sender asks for it (XEP-0184)
+    const char* id = xmpp_stanza_get_id(stanza);
+    if (id != NULL && xmpp_stanza_get_child_by_name_and_ns(stanza, "request", RECEIPTS_NS) != NULL) {
+        send_receipt(conn, cfg, other_jid, id);
+    }
+    return 1;
+}
+
+//Handle a message from the archive while catching up (with --catch-up).
+int mam_result_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    //userdata contains a Config struct
+    struct Config* cfg = (struct Config*) userdata;
+
+    const char* id;
+    xmpp_stanza_t* message = mam_result(cfg->mam, stanza, cfg->jid, &id);
+    if (message == NULL) {
+        return 1;
+    }
+    //the archive also contains the messages that we sent, and the ones that
+    //message_handler() would not accept
+    const char* type = xmpp_stanza_get_type(message);
+    const char* from = xmpp_stanza_get_from(message);
+    struct Peer* peer = chat_peer(cfg, from);
+    if (mam_seen(cfg->mam, id)) {
+        metrics_count(COUNTER_DROPPED_DUPLICATE, 1);
+    } else if (peer != NULL && type != NULL && strcmp(type, "chat") == 0) {
+        if (is_worker_peer(cfg, peer)) {
+            dispatch_to_worker(conn, cfg, from, message);
+        } else {
+            deliver_body(cfg, peer, message);
+        }
+        ++cfg->mam->caught_up;
+    }
+    mam_advance(cfg->mam, id);
+    return 1;
+}
+
+int receipt_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    (void) conn;
+    //userdata contains a Config struct
+    struct Config* cfg = (struct Config*) userdata;
 
+    xmpp_stanza_t* received = xmpp_stanza_get_child_by_name_and_ns(stanza, "received", RECEIPTS_NS);
+    if (received != NULL) {
+        const char* id = xmpp_stanza_get_attribute(received, "id");
+        if (cfg->latency != NULL) {
+            latency_acked(cfg->latency, latency_parse_id(cfg->latency, id), clock_msec());
+        }
+        if (cfg->journal != NULL) {
+            journal_acked(cfg->journal, id);
+        }
+    }
+    return 1;
+}
+
+int groupchat_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    (void) conn;
+    //userdata contains a Config struct
+    struct Config* cfg = (struct Config*) userdata;
+
+    //in a busy room, most messages are dropped here, so do the cheap checks
+    //on the "from" attribute first, and only look at the body at the end
+    const char* other_jid = xmpp_stanza_get_attribute(stanza, "from");
+    struct Peer* peer = router_lookup(cfg->router, other_jid);
+    if (peer == NULL || !peer->groupchat) {
+        metrics_count(COUNTER_DROPPED_UNKNOWN, 1);
+        return 1;
+    }
+
+    //the resource is the nick of the occupant who sent the message (messages
+    //from the room itself, e.g. the subject, do not have one)
+    const size_t bare_len = jid_bare_len(other_jid);
+    if (other_jid[bare_len] != '/') {
+        return 1;
+    }
+    const char* nick = other_jid + bare_len + 1;
+
+    //skip the room's reflection of our own messages (which tells that the
+    //room has accepted them)
+    if (strcmp(nick, cfg->muc_nick) == 0) {
+        if (cfg->journal != NULL) {
+            journal_acked(cfg->journal, xmpp_stanza_get_id(stanza));
+        }
+        return 1;
+    }
+    //with --muc-from, only accept messages from these occupants
+    if (cfg->muc_from != NULL) {
+        const size_t nick_len = strlen(nick);
+        if (!jid_set_contains(cfg->muc_from, nick, nick_len, 0, jid_hash(nick, nick_len))) {
+            return 1;
+        }
+    }
+    //skip history replays (in case the room ignores our request to not send any)
+    if (!cfg->show_delayed_messages && is_delayed(stanza)) {
+        metrics_count(COUNTER_DROPPED_DELAYED, 1);
+        return 1;
+    }
+
+    deliver_body(cfg, peer, stanza);
     return 1;
 }
 
@@ -111,139 +653,729 @@ void conn_handler(xmpp_conn_t* const conn, const xmpp_conn_event_t event, const
 
     //userdata contains a Config struct
     struct Config* cfg = (struct Config*) userdata;
-    cfg->connecting = false; //initial connection is over
+    const bool failed_attempt = cfg->connecting && event != XMPP_CONN_CONNECT;
+    cfg->connecting = false; //connection attempt is over
 
     if (event == XMPP_CONN_CONNECT) {
-        xmpp_handler_add(conn, message_handler, NULL, "message", "chat", cfg);
+        if (cfg->ibb != NULL) {
+            //in --binary mode, data is exchanged with iqs instead of messages
+            xmpp_handler_add(conn, ibb_handler, "http://jabber.org/protocol/ibb", "iq", "set", cfg);
+        } else {
+            xmpp_handler_add(conn, message_handler, NULL, "message", "chat", cfg);
+        }
+        if (cfg->latency != NULL || cfg->journal != NULL) {
+            //(receipts may come in messages of any type)
+            xmpp_handler_add(conn, receipt_handler, RECEIPTS_NS, "message", NULL, cfg);
+        }
+        if (cfg->journal != NULL) {
+            //find out which peers will acknowledge our messages
+            xmpp_handler_add(conn, journal_presence_handler, NULL, "presence", NULL, cfg);
+            journal_discover(cfg->journal, cfg->router, conn, cfg, clock_msec());
+        }
         send_presence(conn, cfg);
+        if (cfg->mam != NULL) {
+            //fetch the messages that were missed while we were offline
+            xmpp_handler_add(conn, mam_result_handler, MAM_NS, "message", NULL, cfg);
+            mam_start(cfg->mam, conn, cfg);
+        }
+        metrics_count(COUNTER_CONNECTS, 1);
+        const long long now = clock_msec();
+        connect_trace_mark(&connect_trace, PHASE_BIND, now);
+        metrics_observe(HISTOGRAM_CONNECT_MSEC, now - connect_trace.started_at);
+        if (cfg->trace_connect) {
+            connect_trace_report(&connect_trace, now);
+        }
+        if (cfg->muc_jid != NULL) {
+            //(re)join the room
+            xmpp_handler_add(conn, groupchat_handler, NULL, "message", "groupchat", cfg);
+            send_muc_join(conn, cfg);
+        }
         cfg->connected = true;
     } else {
+        if (failed_attempt && connect_trace.cached) {
+            //the cached server may have moved: look it up again next time
+            struct Jid jid;
+            if (jid_parse(cfg->jid, &jid)) {
+                endpoint_forget(jid.domain, cfg->srv_cache_path);
+            }
+            jid_free(&jid);
+            connect_trace.cached = false;
+        }
         cfg->connected = false;
+        metrics_count(COUNTER_DISCONNECTS, 1);
     }
+    metrics_set(GAUGE_CONNECTED, cfg->connected);
 }
 
 #define STDIN  0
 #define STDOUT 1
 
+//Return whether lines can be sent to @a peer right now (with --journal, not
+//while it is asked whether it supports receipts).
+static bool can_send(const struct Config* cfg, const struct Peer* peer, long long now) {
+    return cfg->connected && (cfg->journal == NULL || journal_may_send(peer, now));
+}
+
+//Send lines that were read from the input of @a peer, either right away or by
+//collecting them in its batch.
+static void process_lines(xmpp_conn_t* conn, const struct Config* cfg, struct Peer* peer, const char* str, size_t len, long long now) {
+    struct Batch* batch = &(peer->batch);
+    if (cfg->journal != NULL) {
+        journal_append(cfg->journal, peer, str, len);
+    }
+    if (can_send(cfg, peer, now) && cfg->flush_interval == 0 && batch->size == 0) {
+        //fast path: no need to copy the lines into the batch
+        send_lines(conn, cfg, peer, str, len, now);
+    } else {
+        //(while the connection is down, the batch doubles as outage queue)
+        batch_add(batch, str, len, now, now + cfg->flush_interval);
+    }
+}
+
+//Like process_lines(), but for lines from the stderr of the child process of
+//@a peer (with --capture-stderr).
+static void process_stderr_lines(xmpp_conn_t* conn, const struct Config* cfg, struct Peer* peer, const char* str, size_t len, long long now) {
+    if (cfg->stderr_prefix == NULL || cfg->stderr_prefix[0] == '\0') {
+        process_lines(conn, cfg, peer, str, len, now);
+    } else {
+        //(this copy is sent by flush_batch() right away if there is no flush interval)
+        struct Batch* batch = &(peer->batch);
+        const size_t start = batch->size + (batch->size > 0);
+        batch_add_prefixed(batch, cfg->stderr_prefix, str, len, now, now + cfg->flush_interval);
+        if (cfg->journal != NULL) {
+            journal_append(cfg->journal, peer, batch->buffer + start, batch->size - start);
+        }
+    }
+}
+
+//Send the batch of @a peer when the flush interval has passed, when it has
+//enough data for a full message, or when @a force is set.
+static void flush_batch(xmpp_conn_t* conn, const struct Config* cfg, struct Peer* peer, long long now, bool force) {
+    struct Batch* batch = &(peer->batch);
+    if (!can_send(cfg, peer, now)) {
+        return;
+    }
+    if (batch->size > 0 && (force || batch->size >= cfg->max_message_bytes || now >= batch->deadline)) {
+        send_lines(conn, cfg, peer, batch->buffer, batch->size, batch->read_at);
+        batch_clear(batch);
+    }
+}
+
+//With --framing, send a frame that was read from the input of @a peer as a
+//message of its own (split only if it exceeds max_message_bytes). Frames are
+//only read while we are connected, so they never go into the batch.
+static void process_frame(xmpp_conn_t* conn, const struct Config* cfg, struct Peer* peer, const char* str, size_t len, long long now) {
+    //(stderr lines that were read before must go first)
+    flush_batch(conn, cfg, peer, now, true);
+    send_lines(conn, cfg, peer, str, len, now);
+}
+
+//In --binary mode, stream the input of @a peer to it as IBB data packets, as
+//far as the window allows. Returns whether both streams are finished.
+static bool process_binary(xmpp_conn_t* conn, struct Config* cfg, struct Peer* peer) {
+    struct Ibb* ibb = cfg->ibb;
+    if (!cfg->connected) {
+        return false;
+    }
+    if (ibb->state == IBB_IDLE) {
+        ibb_open(ibb, conn, cfg, peer->jid);
+    }
+
+    const char* data;
+    size_t size;
+    while (ibb_ready(ibb) && io_getdata(&(peer->io), &data, &size, ibb->block_size)) {
+        ibb_send(ibb, conn, cfg, peer->jid, data, size);
+    }
+    const bool sent_all = peer->io.eof && peer->io.in_buf.start == peer->io.in_buf.end;
+    if (ibb->state == IBB_OPEN && sent_all && ibb->in_flight == 0) {
+        ibb_close(ibb, conn, cfg, peer->jid);
+    }
+
+    //(the incoming stream is finished once it was closed and written out)
+    if (ibb->state == IBB_FAILED) {
+        return true;
+    }
+    return ibb->state == IBB_CLOSED && ibb->recv_closed && io_output_empty(&(peer->io));
+}
+
+//Commence normal shutdown by disconnecting (if necessary), and do not attempt
+//to reconnect anymore.
+static void begin_shutdown(xmpp_conn_t* conn, const struct Config* cfg, long long* reconnect_at) {
+    if (cfg->connected || cfg->connecting) {
+        xmpp_disconnect(conn);
+    }
+    *reconnect_at = -1;
+}
+
+//If a child process was launched, wait on it and return its exit code.
+static int wait_for_child(pid_t child_pid) {
+    if (child_pid == 0) {
+        return 0;
+    }
+    int wstatus;
+    if (waitpid(child_pid, &wstatus, 0) < 0) {
+        perror("wait() on child process");
+        return 1;
+    }
+    if (WIFEXITED(wstatus)) {
+        return WEXITSTATUS(wstatus);
+    } else {
+        return 1;
+    }
+}
+
+//Create a connection object for the given config.
+static xmpp_conn_t* new_connection(const struct Config* cfg) {
+    xmpp_conn_t* conn = xmpp_conn_new(cfg->ctx);
+#ifdef XMPP_CONN_FLAG_MANDATORY_TLS
+    long flags = XMPP_CONN_FLAG_MANDATORY_TLS; //there's just no excuse not to do TLS
+    if (cfg->trust_tls) {
+        flags |= XMPP_CONN_FLAG_TRUST_TLS; //...but certificates may not be checkable (e.g. in tests)
+    }
+    xmpp_conn_set_flags(conn, flags);
+#endif
+    xmpp_conn_set_jid(conn, cfg->jid);
+    xmpp_conn_set_pass(conn, cfg->password);
+    xmpp_conn_set_sockopt_callback(conn, sockopt_callback);
+    return conn;
+}
+
+//Start connecting @a conn to the server given with --server, or else to the
+//one from the SRV cache (with --srv-cache), or else to the one that libstrophe
+//looks up in DNS.
+static bool start_connect(xmpp_conn_t* conn, struct Config* cfg) {
+    connect_trace_start(&connect_trace, clock_msec());
+    const char* host = cfg->server_host;
+    unsigned short port = cfg->server_port;
+    struct Jid jid;
+    const bool use_cache = cfg->srv_cache_path != NULL && jid_parse(cfg->jid, &jid);
+    if (use_cache && endpoint_resolve(&endpoint, jid.domain, cfg->srv_cache_path)) {
+        host = endpoint.host;
+        port = endpoint.port;
+        connect_trace.cached = endpoint.from_cache;
+    }
+    //(this resolves the host name synchronously)
+    const int rc = xmpp_connect_client(conn, host, port, conn_handler, cfg);
+    connect_trace_mark(&connect_trace, PHASE_DNS, clock_msec());
+    if (rc != 0 && connect_trace.cached) {
+        endpoint_forget(jid.domain, cfg->srv_cache_path);
+        connect_trace.cached = false;
+    }
+    if (cfg->srv_cache_path != NULL) {
+        jid_free(&jid);
+    }
+    return rc == 0;
+}
+
+//Replace the lost connection @a old_conn by a new one, and start connecting.
+static xmpp_conn_t* reconnect(xmpp_conn_t* old_conn, struct Config* cfg) {
+    xmpp_conn_t* conn = new_connection(cfg);
+#ifdef XMPP_CONN_FLAG_DISABLE_SM
+    //try to resume the XEP-0198 session; libstrophe then also resends the
+    //stanzas that the server has not acknowledged
+    xmpp_sm_state_t* sm_state = xmpp_conn_get_sm_state(old_conn);
+    if (sm_state != NULL) {
+        xmpp_conn_set_sm_state(conn, sm_state);
+    }
+#endif
+    xmpp_conn_release(old_conn);
+
+    xmpp_fd = -1;
+    cfg->connecting = true;
+    if (!start_connect(conn, cfg)) {
+        fprintf(stderr, "ERROR: failed to connect to %s\n", cfg->jid);
+        cfg->connecting = false; //will be retried
+    }
+    return conn;
+}
+
+//Return the delay before the given reconnection attempt (counting from 0).
+static long long reconnect_delay(int attempt) {
+    long long delay = RECONNECT_MIN_MSEC;
+    while (attempt-- > 0 && delay < RECONNECT_MAX_MSEC) {
+        delay *= 2;
+    }
+    if (delay > RECONNECT_MAX_MSEC) {
+        delay = RECONNECT_MAX_MSEC;
+    }
+    //add jitter, so that many bridges do not reconnect in lockstep after a
+    //server restart
+    return delay / 2 + random() % (delay / 2 + 1);
+}
+
+//Reduce @a timeout (in msec) such that poll() returns at the given @a deadline.
+static void shorten_timeout(long long* timeout, long long deadline, long long now) {
+    const long long remaining = deadline < now ? 0 : deadline - now;
+    if (*timeout > remaining) {
+        *timeout = remaining;
+    }
+}
+
 int main(int argc, char** argv) {
     //read arguments
     struct Config cfg;
-    if (!config_init(&cfg)) {
+    config_init(&cfg);
+    if (!config_consume_options(&cfg, &argc, &argv)) {
         return 1;
     }
-    if (!config_consume_options(&cfg, &argc, &argv)) {
+    if (!config_validate(&cfg)) {
         return 1;
     }
 
-    //fork child process, if requested
+    //fork child process, if requested (with --workers, the command line is
+    //run for each message instead)
     pid_t child_pid;
-    if (!subprocess_init(argc, argv, &child_pid)) {
+    int child_err_fd;
+    if (!subprocess_init(cfg.max_workers > 0 ? 0 : argc, argv, cfg.capture_stderr, &child_pid, &child_err_fd)) {
         return 1;
     }
     //TODO: kill child_pid on exit
 
-    //initialize file handles
-    struct IO io;
-    io_init(&io, STDIN, STDOUT);
-    cfg.io = &io;
+    //as a client of a daemon, just relay stdin/stdout (or the child's pipes)
+    if (cfg.via_daemon_path != NULL) {
+        if (!daemon_client_run(cfg.via_daemon_path)) {
+            return 1;
+        }
+        return wait_for_child(child_pid);
+    }
+
+    //bind stdin/stdout and the other configured peers to their JIDs
+    struct Router router;
+    router_init(&router);
+    if (cfg.peer_jid != NULL && cfg.max_workers > 0) {
+        //(with --workers, the peer does not use stdin/stdout)
+        router_add(&router, cfg.peer_jid, -1, -1, -1)->io.eof = true;
+    } else if (cfg.peer_jid != NULL) {
+        router_add(&router, cfg.peer_jid, STDIN, STDOUT, child_err_fd)->groupchat = cfg.muc_jid != NULL;
+    }
+    for (size_t idx = 0; idx < cfg.peer_spec_count; ++idx) {
+        const struct PeerSpec* spec = &(cfg.peer_specs[idx]);
+        int in_fd = spec->in_fd, out_fd = spec->out_fd, err_fd = -1;
+        pid_t pid = 0;
+        if (spec->command != NULL && !subprocess_spawn(spec->command, cfg.capture_stderr, &in_fd, &out_fd, &err_fd, &pid)) {
+            return 1;
+        }
+        router_add(&router, spec->jid, in_fd, out_fd, err_fd)->pid = pid;
+    }
+    for (size_t idx = 0; idx < router.count; ++idx) {
+        struct IO* io = &(router.peers[idx].io);
+        io_set_queue_limit(io, cfg.max_output_bytes, cfg.overflow_policy, cfg.spill_dir);
+        io_set_framing(io, cfg.framing);
+    }
+    router_build(&router);
+    cfg.router = &router;
+
+    struct Latency latency;
+    if (cfg.trace_latency) {
+        latency_init(&latency);
+        cfg.latency = &latency;
+    }
+
+    struct Ibb ibb;
+    if (cfg.binary) {
+        ibb_init(&ibb, cfg.ibb_block_size, cfg.ibb_window);
+        cfg.ibb = &ibb;
+    }
+
+    struct RateLimit rate_limit;
+    rate_limit_init(&rate_limit, cfg.rate_messages, cfg.rate_bytes);
+    cfg.rate_limit = &rate_limit;
+
+    //in daemon mode, open the socket for the clients (before dropping
+    //privileges, so that it can be placed anywhere)
+    struct Daemon daemon_state;
+    if (cfg.daemon_path != NULL) {
+        if (!daemon_init(&daemon_state, cfg.daemon_path, &cfg)) {
+            return 1;
+        }
+        cfg.daemon = &daemon_state;
+    }
+
+    //open the transcript (before dropping privileges, like the socket)
+    struct Transcript transcript;
+    if (cfg.transcript_path != NULL) {
+        if (!transcript_init(&transcript, cfg.transcript_path, cfg.transcript_max_bytes, cfg.transcript_keep)) {
+            return 1;
+        }
+        cfg.transcript = &transcript;
+    }
+
+    //open the journal, and queue what was not delivered before the last exit
+    struct Journal journal;
+    if (cfg.journal_path != NULL) {
+        if (!journal_init(&journal, cfg.journal_path)) {
+            return 1;
+        }
+        journal_replay(&journal, &router, clock_msec());
+        cfg.journal = &journal;
+    }
+
+    //load where the last catch-up from the archive ended
+    struct Mam mam;
+    if (cfg.catch_up_path != NULL) {
+        if (!mam_init(&mam, cfg.catch_up_path, cfg.catch_up_page)) {
+            return 1;
+        }
+        cfg.mam = &mam;
+    }
+
+    //with --workers, prepare the pool (the workers are started on demand,
+    //i.e. after dropping privileges)
+    struct Workers workers;
+    if (cfg.max_workers > 0) {
+        workers_init(&workers, argc, argv, cfg.max_workers, cfg.worker_queue, clock_msec());
+        cfg.workers = &workers;
+    }
 
     //drop privileges
     if (!sec_init(&cfg)) {
         return 1;
     }
 
+    if (!metrics_init()) {
+        return 1;
+    }
+
+    //seed the jitter of the reconnect delays
+    srandom(time(NULL) ^ getpid());
+
     //initialize libstrophe context
     xmpp_initialize();
     xmpp_log_t* log = xmpp_get_default_logger(MY_LOG_LEVEL);
-    cfg.ctx = xmpp_ctx_new(NULL, log);
+    connect_trace_init(&connect_trace, log);
+    //(with --trace-connect, the log messages go through the trace to see when
+    //the authentication is done)
+    cfg.ctx = xmpp_ctx_new(NULL, cfg.trace_connect ? &(connect_trace.log) : log);
 
     //initialize connection object
-    xmpp_conn_t* conn = xmpp_conn_new(cfg.ctx);
-#ifdef XMPP_CONN_FLAG_MANDATORY_TLS
-    xmpp_conn_set_flags(conn, XMPP_CONN_FLAG_MANDATORY_TLS); //there's just no excuse not to do TLS
-#endif
-    xmpp_conn_set_jid(conn, cfg.jid);
-    xmpp_conn_set_pass(conn, cfg.password);
+    xmpp_conn_t* conn = new_connection(&cfg);
 
-    //enter the first event loop which creates the connection and waits until
-    //conn_handler is called
+    //enter the event loop which waits on stdin, stdout and the XMPP socket
+    //together: it first waits until conn_handler is called, then sends and
+    //receives messages, and finally waits for the disconnect to finish
     cfg.connecting = true;
-    if (xmpp_connect_client(conn, NULL, 0, conn_handler, &cfg) != 0) {
+    if (!start_connect(conn, &cfg)) {
         fprintf(stderr, "FATAL: failed to connect to %s\n", cfg.jid);
-        return 1;
+        if (!cfg.reconnect) {
+            return 1;
+        }
+        cfg.connecting = false; //will be retried
     }
-    while (cfg.connecting) {
-        xmpp_run_once(cfg.ctx, 100);
+
+    struct PollSet ps;
+    pollset_init(&ps);
+
+    //with --io-uring, the peers' pipes are read and written through the ring
+    //(if the kernel supports it), and the other fds are polled through it
+    if (cfg.io_uring && (ps.ring = uring_new(URING_ENTRIES)) != NULL) {
+        for (size_t idx = 0; idx < router.count; ++idx) {
+            struct Peer* peer = &(router.peers[idx]);
+            if (!is_daemon_peer(&cfg, peer)) {
+                io_use_uring(&(peer->io), ps.ring);
+                io_use_uring(&(peer->err), ps.ring);
+            }
+        }
     }
 
-    //enter the second event loop which sends and receives messages
     bool stay_in_loop = true;
+    bool drain_tls    = false;
 
-    while (stay_in_loop && cfg.connected) {
-        const bool success = io_select(&io, 100000); //timeout = 100 ms
-        if (!success) {
+    //with --reconnect, an outage lasts from losing the connection (or failing
+    //to establish it) until the next successful connection
+    bool outage = cfg.reconnect && !cfg.connecting;
+    int reconnect_attempt = 0;
+    long long reconnect_at = outage ? clock_msec() : -1;
+    long long metrics_due  = 0; //with --metrics-file
+    long long drain_until  = -1; //with --journal, when to stop waiting for receipts at EOF
+
+    while (cfg.connecting || cfg.connected || reconnect_at >= 0) {
+        //sum up the input that has not been sent yet
+        size_t queued_bytes = 0, output_bytes = 0;
+        bool output_full = cfg.daemon != NULL && daemon_output_full(cfg.daemon);
+        for (size_t idx = 0; idx < router.count; ++idx) {
+            const struct Peer* peer = &(router.peers[idx]);
+            queued_bytes += peer->io.in_buf.end - peer->io.in_buf.start + peer->batch.size;
+            queued_bytes += peer->err.in_buf.end - peer->err.in_buf.start;
+            output_bytes += peer->io.out_queue.size;
+            output_full = output_full || io_output_full(&(peer->io));
+        }
+
+        //stop reading input while we may not send (the child process will then
+        //block on its pipe instead of us buffering without limit)
+        long long now = clock_msec();
+        const int send_queue_len = xmpp_conn_send_queue_len(conn);
+        rate_limit_observe(&rate_limit, queued_bytes, send_queue_len);
+        metrics_set(GAUGE_INPUT_QUEUED_BYTES, queued_bytes);
+        metrics_set(GAUGE_OUTPUT_QUEUED_BYTES, output_bytes);
+        metrics_set(GAUGE_SEND_QUEUE_STANZAS, send_queue_len);
+        if (metrics_dump_requested) {
+            metrics_dump_requested = 0;
+            metrics_write(stderr);
+        }
+        if (cfg.journal != NULL) {
+            journal_check_receipts(cfg.journal, now);
+        }
+        if (cfg.metrics_path != NULL && now >= metrics_due) {
+            metrics_write_file(cfg.metrics_path);
+            metrics_due = now + cfg.metrics_interval;
+        }
+        const long long throttle_msec = rate_limit_wait(&rate_limit, now);
+        const bool throttled = throttle_msec > 0 || send_queue_len >= XMPP_SEND_QUEUE_MAX
+            || (outage && queued_bytes >= cfg.outage_queue_bytes);
+
+        //with --on-output-full=pause, stop handling XMPP traffic (and thus
+        //receiving messages) until stdout has drained
+        const bool xmpp_paused = stay_in_loop && cfg.connected && cfg.overflow_policy == OVERFLOW_PAUSE && output_full;
+
+        //collect file descriptors to wait on (the peers' IO or the daemon's
+        //clients only while we are online or waiting to reconnect, and not
+        //shutting down)
+        const bool handle_input = stay_in_loop && (cfg.connected || outage);
+        ps.count = 0;
+        if (handle_input) {
+            if (cfg.daemon != NULL) {
+                daemon_prepare_poll(cfg.daemon, &ps, throttled);
+            }
+            for (size_t idx = 0; idx < router.count; ++idx) {
+                struct Peer* peer = &(router.peers[idx]);
+                if (!is_daemon_peer(&cfg, peer)) {
+                    //(in --binary mode, only read while there is room in the
+                    //window; with --framing, only while frames can be sent)
+                    peer->io.paused = throttled || (cfg.ibb != NULL && !ibb_ready(cfg.ibb))
+                        || (cfg.framing != FRAMING_LINES && !cfg.connected);
+                    io_prepare_poll(&(peer->io), &ps);
+                    peer->err.paused = throttled;
+                    io_prepare_poll(&(peer->err), &ps);
+                }
+            }
+        }
+        if (stay_in_loop && cfg.workers != NULL) {
+            workers_prepare_poll(cfg.workers, &ps);
+        }
+        int poll_xmpp = -1;
+        if (xmpp_fd >= 0 && !xmpp_paused) {
+            const bool want_write = xmpp_conn_is_connecting(conn) || send_queue_len > 0;
+            poll_xmpp = pollset_add(&ps, xmpp_fd, want_write ? POLLIN | POLLOUT : POLLIN);
+        }
+
+        //wake up when a batch is due, when the rate limit allows sending, or
+        //when it's time to reconnect
+        long long timeout = drain_tls ? XMPP_DRAIN_MSEC : XMPP_TIMER_MSEC;
+        if (throttle_msec > 0) {
+            shorten_timeout(&timeout, now + throttle_msec, now);
+        }
+        else if (cfg.connected) {
+            for (size_t idx = 0; idx < router.count; ++idx) {
+                const struct Peer* peer = &(router.peers[idx]);
+                if (peer->batch.size > 0) {
+                    //(a batch that is held back waits for the answer about receipts)
+                    const bool held = !can_send(&cfg, peer, now);
+                    shorten_timeout(&timeout, held ? peer->journal_disco_until : peer->batch.deadline, now);
+                }
+            }
+        }
+        if (reconnect_at >= 0) {
+            shorten_timeout(&timeout, reconnect_at, now);
+        }
+        if (cfg.metrics_path != NULL) {
+            shorten_timeout(&timeout, metrics_due, now);
+        }
+        if (cfg.journal != NULL && cfg.journal->sync_due >= 0) {
+            shorten_timeout(&timeout, cfg.journal->sync_due, now);
+        }
+        if (stay_in_loop && drain_until >= 0) {
+            shorten_timeout(&timeout, drain_until, now);
+        }
+        if (cfg.workers != NULL && workers_reaping(cfg.workers)) {
+            shorten_timeout(&timeout, now + WORKER_REAP_MSEC, now);
+        }
+        if (pollset_wait(&ps, timeout) == -1 && errno != EINTR) {
             //error -> shutdown
-            xmpp_disconnect(conn);
-            stay_in_loop = false;
-        } else {
-            //check if one or multiple full lines were received
-            char* str = io_getlines(&io);
-            if (str == NULL) {
-                if (io.eof) {
-                    //EOF has been reached - commence normal shutdown
-                    xmpp_disconnect(conn);
+            perror("poll()");
+            if (stay_in_loop) {
+                begin_shutdown(conn, &cfg, &reconnect_at);
+                stay_in_loop = false;
+            }
+        }
+        drain_tls = pollset_revents(&ps, poll_xmpp) & POLLIN;
+
+        now = clock_msec();
+        if (handle_input && cfg.daemon != NULL) {
+            //the daemon keeps running when its clients disconnect (their lines
+            //go to the peer from $XMPPBRIDGE_PEER_JID, which is the first one)
+            daemon_handle_poll(cfg.daemon, &ps);
+            if (!throttled) {
+                const char* str;
+                size_t len;
+                while (daemon_getlines(cfg.daemon, &str, &len)) {
+                    process_lines(conn, &cfg, &(router.peers[0]), str, len, now);
+                }
+                flush_batch(conn, &cfg, &(router.peers[0]), now, false);
+            }
+            daemon_cleanup(cfg.daemon);
+        }
+        if (stay_in_loop && cfg.workers != NULL) {
+            //send the output of finished workers (like the peers' input, only
+            //while we may send)
+            workers_handle_poll(cfg.workers, &ps);
+            struct Worker* worker;
+            while (cfg.connected && !throttled && (worker = workers_finished(cfg.workers)) != NULL) {
+                send_worker_output(conn, &cfg, worker);
+                workers_release(cfg.workers, worker, now);
+            }
+        }
+        if (handle_input) {
+            bool all_done = true;
+            for (size_t idx = 0; idx < router.count && stay_in_loop; ++idx) {
+                struct Peer* peer = &(router.peers[idx]);
+                if (is_daemon_peer(&cfg, peer)) {
+                    continue;
+                }
+                if (!io_handle_poll(&(peer->io), &ps) || !io_handle_poll(&(peer->err), &ps)) {
+                    //error -> shutdown
+                    begin_shutdown(conn, &cfg, &reconnect_at);
+                    stay_in_loop = false;
+                } else if (!throttled && cfg.ibb != NULL) {
+                    peer->done = process_binary(conn, &cfg, peer);
+                } else if (!throttled) {
+                    //check if one or multiple full lines (or frames) were received
+                    const char* str;
+                    size_t len;
+                    bool has_lines = false;
+                    if (cfg.framing == FRAMING_LINES) {
+                        has_lines = io_getlines(&(peer->io), &str, &len);
+                        if (has_lines) {
+                            process_lines(conn, &cfg, peer, str, len, now);
+                        }
+                    } else {
+                        //(a single read may contain many frames, so the rate
+                        //limit and the send queue are checked for each one)
+                        enum FrameStatus status = FRAME_NONE;
+                        while (cfg.connected && rate_limit_wait(&rate_limit, now) == 0
+                            && xmpp_conn_send_queue_len(conn) < XMPP_SEND_QUEUE_MAX
+                            && (status = io_getframe(&(peer->io), &str, &len)) == FRAME_READY) {
+                            process_frame(conn, &cfg, peer, str, len, now);
+                            has_lines = true;
+                        }
+                        if (status == FRAME_INVALID) {
+                            //the stream cannot be resynced -> shutdown
+                            fprintf(stderr, "ERROR: invalid frame in the input for %s\n", peer->jid);
+                            begin_shutdown(conn, &cfg, &reconnect_at);
+                            stay_in_loop = false;
+                        }
+                    }
+                    //stdout and stderr of the child get one read() each per
+                    //iteration, so that a flood on one cannot starve the other
+                    const bool has_err_lines = io_getlines(&(peer->err), &str, &len);
+                    if (has_err_lines) {
+                        process_stderr_lines(conn, &cfg, peer, str, len, now);
+                    }
+                    const bool eof = peer->io.eof && peer->err.eof;
+                    flush_batch(conn, &cfg, peer, now, eof);
+
+                    //(during an outage, EOF only counts when the queued lines
+                    //or the remaining frames have been sent)
+                    peer->done = !has_lines && !has_err_lines && eof && peer->batch.size == 0
+                        && peer->io.in_buf.start == peer->io.in_buf.end;
+                }
+                all_done = all_done && peer->done;
+            }
+
+            //(like the daemon, the workers keep running until we are killed)
+            if (stay_in_loop && all_done && cfg.daemon == NULL && cfg.workers == NULL) {
+                //EOF has been reached on all inputs - commence normal shutdown
+                //(with --journal, after the last messages were acknowledged,
+                //so that they are not sent again on the next start)
+                if (drain_until < 0) {
+                    drain_until = now + JOURNAL_DRAIN_MSEC;
+                }
+                if (cfg.journal == NULL || !journal_waiting(cfg.journal) || !cfg.connected || now >= drain_until) {
+                    begin_shutdown(conn, &cfg, &reconnect_at);
                     stay_in_loop = false;
                 }
-            } else {
-                //send message
-                xmpp_stanza_t* reply = xmpp_stanza_new(cfg.ctx);
-                xmpp_stanza_set_name(reply, "message");
-                xmpp_stanza_set_type(reply, "chat");
-                xmpp_stanza_set_attribute(reply, "from", cfg.jid);
-                xmpp_stanza_set_attribute(reply, "to", cfg.peer_jid);
-
-                xmpp_stanza_t* body = xmpp_stanza_new(cfg.ctx);
-                xmpp_stanza_set_name(body, "body");
-
-                xmpp_stanza_t* text = xmpp_stanza_new(cfg.ctx);
-                xmpp_stanza_set_text(text, str);
-
-                xmpp_stanza_add_child(body, text);
-                xmpp_stanza_add_child(reply, body);
-
-                xmpp_send(conn, reply);
-                xmpp_stanza_release(reply);
-                free(str);
             }
         }
 
-        //send queued messages and watch for incoming messages, but don't block
-        xmpp_run_once(cfg.ctx, 0);
+        //send queued messages and handle incoming messages, but don't block
+        if (!xmpp_paused) {
+            xmpp_run_once(cfg.ctx, 0);
+        }
+        //(libstrophe has no callbacks for the phases before conn_handler)
+        if (cfg.connecting) {
+            now = clock_msec();
+            if (xmpp_conn_is_connected(conn)) {
+                connect_trace_mark(&connect_trace, PHASE_TCP, now);
+            }
+            if (xmpp_conn_is_secured(conn)) {
+                connect_trace_mark(&connect_trace, PHASE_TLS, now);
+            }
+        }
+        //with --journal, sync what was appended and delivered in the meantime
+        if (cfg.journal != NULL) {
+            journal_sync(cfg.journal, false);
+        }
+        if (cfg.mam != NULL) {
+            mam_save(cfg.mam, false);
+        }
+
+        //with --reconnect, schedule a new connection attempt when the
+        //connection was lost, and start it when it's due
+        if (cfg.connected && outage) {
+            outage = false;
+            reconnect_attempt = 0;
+        }
+        if (stay_in_loop && cfg.reconnect && !cfg.connected && !cfg.connecting && reconnect_at < 0) {
+            outage = true;
+            xmpp_fd = -1;
+            const long long delay = reconnect_delay(reconnect_attempt++);
+            reconnect_at = clock_msec() + delay;
+            fprintf(stderr, "WARNING: not connected, will reconnect in %lld ms\n", delay);
+        }
+        if (reconnect_at >= 0 && clock_msec() >= reconnect_at) {
+            reconnect_at = -1;
+            conn = reconnect(conn, &cfg);
+        }
     }
 
-    //wait for disconnect to finish
-    while (cfg.connected) {
-        xmpp_run_once(cfg.ctx, 100);
+    if (cfg.rate_messages > 0 || cfg.rate_bytes > 0) {
+        rate_limit_report(&rate_limit);
+    }
+    if (cfg.ibb != NULL) {
+        ibb_report(cfg.ibb);
+    }
+    if (cfg.latency != NULL) {
+        latency_report(cfg.latency);
+    }
+    if (cfg.workers != NULL) {
+        workers_stop(cfg.workers);
+        workers_report(cfg.workers, clock_msec());
+    }
+    if (cfg.metrics_path != NULL) {
+        metrics_write_file(cfg.metrics_path);
+    }
+    if (cfg.transcript != NULL) {
+        transcript_close(cfg.transcript);
+    }
+    if (cfg.journal != NULL) {
+        journal_close(cfg.journal);
+    }
+    if (cfg.mam != NULL) {
+        mam_save(cfg.mam, true);
+    }
+    for (size_t idx = 0; idx < router.count; ++idx) {
+        const struct Peer* peer = &(router.peers[idx]);
+        if (peer->io.dropped_bytes > 0) {
+            fprintf(stderr, "WARNING: dropped %zu bytes of output for %s because it was not read fast enough\n", peer->io.dropped_bytes, peer->jid);
+        }
     }
 
     //free resources
+    uring_free(ps.ring);
     xmpp_conn_release(conn);
     xmpp_ctx_free(cfg.ctx);
     xmpp_shutdown();
     //TODO: which of these can throw errors?
 
     //if child process was launched, wait on it and propagate its exit code
-    if (child_pid == 0) {
-        return 0;
-    }
-    int wstatus;
-    if (waitpid(child_pid, &wstatus, 0) < 0) {
-        perror("wait() on child process");
-        return 1;
-    }
-    if (WIFEXITED(wstatus)) {
-        return WEXITSTATUS(wstatus);
-    } else {
-        return 1;
-    }
+    return wait_for_child(child_pid);
 }
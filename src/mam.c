@@ -0,0 +1,305 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define RSM_NS       "http://jabber.org/protocol/rsm"
+#define FORWARD_NS   "urn:xmpp:forward:0"
+#define SID_NS       "urn:xmpp:sid:0"
+#define STANZAS_NS   "urn:ietf:params:xml:ns:xmpp-stanzas"
+#define SEEN_SLOTS   (2 * MAM_SEEN_IDS)
+
+////////////////////////////////////////////////////////////////////////////////
+// duplicate filter
+
+static uint64_t id_hash(const char* id) {
+    //FNV-1a (0 marks empty slots)
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *id != '\0'; ++id) {
+        hash = (hash ^ (unsigned char) *id) * 1099511628211ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+static bool slots_contain(const uint64_t* slots, uint64_t hash) {
+    for (size_t idx = hash & (SEEN_SLOTS - 1); slots[idx] != 0; idx = (idx + 1) & (SEEN_SLOTS - 1)) {
+        if (slots[idx] == hash) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void slots_insert(uint64_t* slots, uint64_t hash) {
+    size_t idx = hash & (SEEN_SLOTS - 1);
+    while (slots[idx] != 0) {
+        idx = (idx + 1) & (SEEN_SLOTS - 1);
+    }
+    slots[idx] = hash;
+}
+
+bool mam_seen(struct Mam* mam, const char* id) {
+    if (id == NULL) {
+        return false;
+    }
+    struct SeenSet* seen = &(mam->seen);
+    const uint64_t hash = id_hash(id);
+    if (slots_contain(seen->current, hash) || slots_contain(seen->previous, hash)) {
+        ++mam->duplicates;
+        return true;
+    }
+
+    //(the tables never get more than half full, so probing stays short)
+    if (seen->count == MAM_SEEN_IDS) {
+        uint64_t* oldest = seen->previous;
+        seen->previous = seen->current;
+        seen->current  = oldest;
+        seen->count    = 0;
+        memset(seen->current, 0, SEEN_SLOTS * sizeof(uint64_t));
+    }
+    slots_insert(seen->current, hash);
+    ++seen->count;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// last-seen id
+
+bool mam_init(struct Mam* mam, const char* state_path, size_t page_size) {
+    mam->state_path   = state_path;
+    mam->page_size    = page_size;
+    mam->last_id      = NULL;
+    mam->save_due     = -1;
+    mam->query_id[0]  = '\0';
+    mam->initial      = false;
+    mam->next_query   = 0;
+    mam->caught_up    = 0;
+    mam->duplicates   = 0;
+    mam->seen.current  = calloc(SEEN_SLOTS, sizeof(uint64_t));
+    mam->seen.previous = calloc(SEEN_SLOTS, sizeof(uint64_t));
+    mam->seen.count    = 0;
+
+    FILE* file = fopen(state_path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return true; //first run
+        }
+        fprintf(stderr, "FATAL: cannot read %s: %s\n", state_path, strerror(errno));
+        return false;
+    }
+    char line[1024];
+    if (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0') {
+            mam->last_id = strdup(line);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+void mam_advance(struct Mam* mam, const char* id) {
+    if (id == NULL) {
+        return;
+    }
+    free(mam->last_id);
+    mam->last_id = strdup(id);
+    if (mam->save_due < 0) {
+        mam->save_due = clock_msec() + MAM_SAVE_MSEC;
+    }
+}
+
+void mam_save(struct Mam* mam, bool force) {
+    if (mam->save_due < 0 || (!force && clock_msec() < mam->save_due)) {
+        return;
+    }
+    mam->save_due = -1;
+
+    //write to a temporary file first, so that the state is never truncated
+    const size_t path_len = strlen(mam->state_path) + 8;
+    char tmp_path[path_len];
+    snprintf(tmp_path, path_len, "%s.tmp", mam->state_path);
+    FILE* file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: cannot write %s: %s\n", tmp_path, strerror(errno));
+        return;
+    }
+    fprintf(file, "%s\n", mam->last_id);
+    if (fclose(file) != 0 || rename(tmp_path, mam->state_path) < 0) {
+        fprintf(stderr, "ERROR: cannot save %s: %s\n", mam->state_path, strerror(errno));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// queries
+
+static void add_child(xmpp_ctx_t* ctx, xmpp_stanza_t* parent, const char* name, const char* text) {
+    xmpp_stanza_t* child = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(child, name);
+    if (text != NULL) {
+        xmpp_stanza_t* text_node = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_text(text_node, text);
+        xmpp_stanza_add_child(child, text_node);
+        xmpp_stanza_release(text_node);
+    }
+    xmpp_stanza_add_child(parent, child);
+    xmpp_stanza_release(child);
+}
+
+static int mam_fin_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata);
+
+//Query the next page of our archive (XEP-0313 with XEP-0059 paging): the
+//messages after @a after, or without it, just the newest one.
+static void mam_query(struct Mam* mam, xmpp_conn_t* conn, struct Config* cfg, const char* after) {
+    snprintf(mam->query_id, sizeof(mam->query_id), "catch-up-%llu", mam->next_query++);
+    mam->initial = after == NULL;
+
+    //<iq type="set"><query xmlns="urn:xmpp:mam:2" queryid="...">
+    //  <set xmlns="http://jabber.org/protocol/rsm"><max>N</max><after>ID</after></set>
+    //</query></iq>
+    xmpp_stanza_t* iq = xmpp_iq_new(cfg->ctx, "set", mam->query_id);
+    xmpp_stanza_t* query = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(query, "query");
+    xmpp_stanza_set_ns(query, MAM_NS);
+    xmpp_stanza_set_attribute(query, "queryid", mam->query_id);
+
+    xmpp_stanza_t* set = xmpp_stanza_new(cfg->ctx);
+    xmpp_stanza_set_name(set, "set");
+    xmpp_stanza_set_ns(set, RSM_NS);
+    char max[32];
+    snprintf(max, sizeof(max), "%zu", after == NULL ? (size_t) 1 : mam->page_size);
+    add_child(cfg->ctx, set, "max", max);
+    if (after != NULL) {
+        add_child(cfg->ctx, set, "after", after);
+    } else {
+        add_child(cfg->ctx, set, "before", NULL); //the last page
+    }
+    xmpp_stanza_add_child(query, set);
+    xmpp_stanza_release(set);
+    xmpp_stanza_add_child(iq, query);
+    xmpp_stanza_release(query);
+
+    xmpp_id_handler_add(conn, mam_fin_handler, mam->query_id, cfg);
+    xmpp_send(conn, iq);
+    xmpp_stanza_release(iq);
+}
+
+//Return the text of the element @a name in the RSM set of @a fin (or NULL).
+static char* rsm_value(xmpp_stanza_t* fin, const char* name) {
+    xmpp_stanza_t* set = fin == NULL ? NULL : xmpp_stanza_get_child_by_name_and_ns(fin, "set", RSM_NS);
+    xmpp_stanza_t* child = set == NULL ? NULL : xmpp_stanza_get_child_by_name(set, name);
+    return child == NULL ? NULL : xmpp_stanza_get_text(child);
+}
+
+static void mam_finish(struct Mam* mam) {
+    if (!mam->initial) {
+        fprintf(stderr, "INFO: caught up on %zu messages from the archive (%zu duplicates skipped)\n", mam->caught_up, mam->duplicates);
+    }
+    mam->query_id[0] = '\0';
+    mam_save(mam, true);
+}
+
+static int mam_fin_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata) {
+    struct Config* cfg = (struct Config*) userdata;
+    struct Mam* mam = cfg->mam;
+
+    const char* type = xmpp_stanza_get_type(stanza);
+    if (type != NULL && strcmp(type, "error") == 0) {
+        xmpp_stanza_t* error = xmpp_stanza_get_child_by_name(stanza, "error");
+        if (!mam->initial && error != NULL && xmpp_stanza_get_child_by_name_and_ns(error, "item-not-found", STANZAS_NS) != NULL) {
+            //the archive has expired the message that we saw last
+            fprintf(stderr, "WARNING: message %s is no longer in the archive, some missed messages may be lost\n", mam->last_id);
+            mam_query(mam, conn, cfg, NULL);
+        } else {
+            fprintf(stderr, "WARNING: cannot catch up on missed messages: the server rejected the archive query\n");
+            mam->query_id[0] = '\0';
+        }
+        return 0; //remove this handler
+    }
+
+    xmpp_stanza_t* fin = xmpp_stanza_get_child_by_name_and_ns(stanza, "fin", MAM_NS);
+    const char* complete = fin == NULL ? NULL : xmpp_stanza_get_attribute(fin, "complete");
+    char* last = rsm_value(fin, "last");
+    if (mam->initial) {
+        //(if the archive is empty, the next message will provide the id)
+        mam_advance(mam, last);
+        mam_finish(mam);
+    } else if (last == NULL || (complete != NULL && strcmp(complete, "true") == 0)) {
+        mam_finish(mam);
+    } else {
+        mam_query(mam, conn, cfg, last);
+    }
+    xmpp_free(cfg->ctx, last);
+    return 0; //remove this handler
+}
+
+void mam_start(struct Mam* mam, xmpp_conn_t* conn, struct Config* cfg) {
+    mam->caught_up  = 0;
+    mam->duplicates = 0;
+    mam_query(mam, conn, cfg, mam->last_id);
+}
+
+bool mam_catching_up(const struct Mam* mam) {
+    return mam->query_id[0] != '\0';
+}
+
+//Return whether @a jid is the bare JID of @a own_jid.
+static bool is_own_bare_jid(const char* jid, const char* own_jid) {
+    const size_t bare_len = jid_bare_len(own_jid);
+    return strlen(jid) == bare_len && strncasecmp(jid, own_jid, bare_len) == 0;
+}
+
+xmpp_stanza_t* mam_result(struct Mam* mam, xmpp_stanza_t* stanza, const char* own_jid, const char** id) {
+    xmpp_stanza_t* result = xmpp_stanza_get_child_by_name_and_ns(stanza, "result", MAM_NS);
+    if (result == NULL || !mam_catching_up(mam) || mam->initial) {
+        return NULL;
+    }
+    //only our own server may send results (without "from", or from our bare JID)
+    const char* from = xmpp_stanza_get_from(stanza);
+    const char* query_id = xmpp_stanza_get_attribute(result, "queryid");
+    if ((from != NULL && !is_own_bare_jid(from, own_jid)) || query_id == NULL || strcmp(query_id, mam->query_id) != 0) {
+        return NULL;
+    }
+    *id = xmpp_stanza_get_attribute(result, "id");
+    xmpp_stanza_t* forwarded = xmpp_stanza_get_child_by_name_and_ns(result, "forwarded", FORWARD_NS);
+    if (*id == NULL || forwarded == NULL) {
+        return NULL;
+    }
+    return xmpp_stanza_get_child_by_name(forwarded, "message");
+}
+
+const char* mam_stanza_id(xmpp_stanza_t* stanza, const char* own_jid) {
+    //there may be several, from different entities (e.g. a MUC service)
+    for (xmpp_stanza_t* child = xmpp_stanza_get_children(stanza); child != NULL; child = xmpp_stanza_get_next(child)) {
+        const char* name = xmpp_stanza_get_name(child);
+        const char* ns   = xmpp_stanza_get_ns(child);
+        const char* by   = xmpp_stanza_get_attribute(child, "by");
+        if (name != NULL && strcmp(name, "stanza-id") == 0 && ns != NULL && strcmp(ns, SID_NS) == 0
+            && by != NULL && is_own_bare_jid(by, own_jid)) {
+            return xmpp_stanza_get_attribute(child, "id");
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,172 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+struct Metrics metrics;
+volatile sig_atomic_t metrics_dump_requested = 0;
+
+//upper bounds of the histogram buckets (terminated by 0; the last bucket is +Inf)
+static const long long msec_bounds[]  = { 10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 0 };
+static const long long latency_bounds[] = { 1, 2, 5, 10, 25, 50, 100, 250, 1000, 5000, 0 };
+static const long long bytes_bounds[] = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 0 };
+
+static const struct {
+    const char* name;
+    const char* help;
+} counter_info[COUNTER_COUNT] = {
+    [COUNTER_MESSAGES_SENT]       = { "xmppbridge_messages_sent_total",         "Messages sent to XMPP peers." },
+    [COUNTER_MESSAGE_BYTES_SENT]  = { "xmppbridge_message_bytes_sent_total",    "Bytes of text sent to XMPP peers (before compression)." },
+    [COUNTER_MESSAGES_RECEIVED]   = { "xmppbridge_messages_received_total",     "Messages received from XMPP peers and written to their output." },
+    [COUNTER_DROPPED_DELAYED]     = { "xmppbridge_messages_dropped_delayed_total", "Received messages dropped because they were delayed." },
+    [COUNTER_DROPPED_UNKNOWN]     = { "xmppbridge_messages_dropped_unknown_sender_total", "Received messages dropped because of their sender." },
+    [COUNTER_DROPPED_DUPLICATE]   = { "xmppbridge_messages_dropped_duplicate_total", "Received messages dropped because they were delivered before (with --catch-up)." },
+    [COUNTER_WORKER_JOBS]         = { "xmppbridge_worker_jobs_total",           "Messages that were handled by a worker (with --workers)." },
+    [COUNTER_WORKER_JOBS_FAILED]  = { "xmppbridge_worker_jobs_failed_total",    "Workers that exited with an error, or could not be started." },
+    [COUNTER_WORKER_JOBS_REJECTED] = { "xmppbridge_worker_jobs_rejected_total", "Messages rejected because the worker queue was full." },
+    [COUNTER_INPUT_BYTES]         = { "xmppbridge_input_bytes_total",           "Bytes read from input file descriptors." },
+    [COUNTER_OUTPUT_BYTES]        = { "xmppbridge_output_bytes_total",          "Bytes written to output file descriptors." },
+    [COUNTER_OUTPUT_DROPPED_BYTES] = { "xmppbridge_output_dropped_bytes_total", "Bytes of output dropped because the output queue was full." },
+    [COUNTER_OUTPUT_SPILLED_BYTES] = { "xmppbridge_output_spilled_bytes_total", "Bytes of output written to a spill file." },
+    [COUNTER_CONNECTS]            = { "xmppbridge_connects_total",              "Successful connections to the XMPP server." },
+    [COUNTER_DISCONNECTS]         = { "xmppbridge_disconnects_total",           "Closed, lost or failed connections to the XMPP server." },
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} gauge_info[GAUGE_COUNT] = {
+    [GAUGE_CONNECTED]          = { "xmppbridge_connected",             "Whether the XMPP connection is established." },
+    [GAUGE_INPUT_QUEUED_BYTES] = { "xmppbridge_input_queued_bytes",    "Bytes of input that have not been sent yet." },
+    [GAUGE_OUTPUT_QUEUED_BYTES] = { "xmppbridge_output_queued_bytes",  "Bytes of output in memory that have not been written yet." },
+    [GAUGE_SEND_QUEUE_STANZAS] = { "xmppbridge_send_queue_stanzas",    "Stanzas in the send queue of the XMPP connection." },
+    [GAUGE_WORKERS_BUSY]       = { "xmppbridge_workers_busy",          "Workers that are handling a message (with --workers)." },
+    [GAUGE_WORKER_QUEUE_LENGTH] = { "xmppbridge_worker_queue_length",  "Messages waiting for a free worker." },
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+    const long long* bounds;
+} histogram_info[HISTOGRAM_COUNT] = {
+    [HISTOGRAM_CONNECT_MSEC]  = { "xmppbridge_connect_duration_ms", "Time from starting to connect until the session is established.", msec_bounds },
+    [HISTOGRAM_MESSAGE_BYTES] = { "xmppbridge_message_size_bytes",  "Size of sent messages.", bytes_bounds },
+    [HISTOGRAM_READ_TO_SEND_MSEC] = { "xmppbridge_read_to_send_ms", "Time from reading a message's text until sending it.", latency_bounds },
+    [HISTOGRAM_SEND_TO_ACK_MSEC]  = { "xmppbridge_send_to_ack_ms",  "Time from sending a message until receiving its delivery receipt.", latency_bounds },
+    [HISTOGRAM_READ_TO_ACK_MSEC]  = { "xmppbridge_read_to_ack_ms",  "Time from reading a message's text until receiving its delivery receipt.", latency_bounds },
+    [HISTOGRAM_WORKER_WAIT_MSEC]  = { "xmppbridge_worker_wait_ms",  "Time that a message waited in the queue for a free worker.", latency_bounds },
+    [HISTOGRAM_WORKER_RUN_MSEC]   = { "xmppbridge_worker_run_ms",   "Time from starting a worker until it exited.", msec_bounds },
+};
+
+static void handle_sigusr1(int signum) {
+    (void) signum;
+    metrics_dump_requested = 1;
+}
+
+bool metrics_init(void) {
+    memset(&metrics, 0, sizeof(metrics));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigusr1;
+    sigemptyset(&action.sa_mask);
+    //no SA_RESTART: poll() shall return, so that the dump happens right away
+    if (sigaction(SIGUSR1, &action, NULL) < 0) {
+        perror("sigaction(SIGUSR1)");
+        return false;
+    }
+    return true;
+}
+
+void metrics_count(enum Counter counter, unsigned long long value) {
+    metrics.counters[counter] += value;
+}
+
+void metrics_set(enum Gauge gauge, long long value) {
+    metrics.gauges[gauge] = value;
+}
+
+void metrics_observe(enum HistogramId histogram, long long value) {
+    struct Histogram* h = &(metrics.histograms[histogram]);
+    const long long* bounds = histogram_info[histogram].bounds;
+    size_t idx = 0;
+    while (bounds[idx] != 0 && value > bounds[idx]) {
+        ++idx;
+    }
+    ++h->buckets[idx];
+    ++h->count;
+    h->sum += value;
+}
+
+static void write_header(FILE* file, const char* name, const char* help, const char* type) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write(FILE* file) {
+    for (int idx = 0; idx < COUNTER_COUNT; ++idx) {
+        write_header(file, counter_info[idx].name, counter_info[idx].help, "counter");
+        fprintf(file, "%s %llu\n", counter_info[idx].name, metrics.counters[idx]);
+    }
+    for (int idx = 0; idx < GAUGE_COUNT; ++idx) {
+        write_header(file, gauge_info[idx].name, gauge_info[idx].help, "gauge");
+        fprintf(file, "%s %lld\n", gauge_info[idx].name, metrics.gauges[idx]);
+    }
+    for (int idx = 0; idx < HISTOGRAM_COUNT; ++idx) {
+        const char* name = histogram_info[idx].name;
+        const long long* bounds = histogram_info[idx].bounds;
+        const struct Histogram* h = &(metrics.histograms[idx]);
+        write_header(file, name, histogram_info[idx].help, "histogram");
+
+        //buckets are cumulative in the exposition format
+        unsigned long long cumulative = 0;
+        size_t bucket = 0;
+        for (; bounds[bucket] != 0; ++bucket) {
+            cumulative += h->buckets[bucket];
+            fprintf(file, "%s_bucket{le=\"%lld\"} %llu\n", name, bounds[bucket], cumulative);
+        }
+        fprintf(file, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %lld\n%s_count %llu\n", name, h->count, name, h->sum, name, h->count);
+    }
+}
+
+bool metrics_write_file(const char* path) {
+    //write to a temporary file and rename it over the target, so that readers
+    //never see a partial file
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror("open metrics file");
+        return false;
+    }
+    metrics_write(file);
+    if (fclose(file) != 0) {
+        perror("write metrics file");
+        return false;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("rename metrics file");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,96 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <stdio.h>
+
+static void bucket_init(struct TokenBucket* bucket, double rate, long long now) {
+    bucket->rate        = rate;
+    bucket->tokens      = rate; //allow a burst of up to one second's worth
+    bucket->last_refill = now;
+}
+
+static long long bucket_wait(struct TokenBucket* bucket, long long now) {
+    if (bucket->rate <= 0) {
+        //unlimited
+        return 0;
+    }
+
+    //refill tokens for the time that has passed, up to the burst size
+    bucket->tokens += bucket->rate * (now - bucket->last_refill) / 1000;
+    if (bucket->tokens > bucket->rate) {
+        bucket->tokens = bucket->rate;
+    }
+    bucket->last_refill = now;
+
+    //the bucket may be in debt after a large message; wait until it is not
+    if (bucket->tokens > 0) {
+        return 0;
+    }
+    return (long long) (-bucket->tokens * 1000 / bucket->rate) + 1;
+}
+
+void rate_limit_init(struct RateLimit* rl, double messages_per_sec, double bytes_per_sec) {
+    const long long now = clock_msec();
+    bucket_init(&(rl->messages), messages_per_sec, now);
+    bucket_init(&(rl->bytes),    bytes_per_sec,    now);
+    rl->throttled_since   = -1;
+    rl->throttled_msec    = 0;
+    rl->max_queue_bytes   = 0;
+    rl->max_queue_stanzas = 0;
+}
+
+long long rate_limit_wait(struct RateLimit* rl, long long now) {
+    const long long wait_messages = bucket_wait(&(rl->messages), now);
+    const long long wait_bytes    = bucket_wait(&(rl->bytes),    now);
+    const long long wait = wait_messages > wait_bytes ? wait_messages : wait_bytes;
+
+    //account for the time spent throttled
+    if (wait > 0 && rl->throttled_since < 0) {
+        rl->throttled_since = now;
+    }
+    else if (wait == 0 && rl->throttled_since >= 0) {
+        rl->throttled_msec += now - rl->throttled_since;
+        rl->throttled_since = -1;
+    }
+    return wait;
+}
+
+void rate_limit_take(struct RateLimit* rl, size_t bytes) {
+    rl->messages.tokens -= 1;
+    rl->bytes.tokens    -= bytes;
+}
+
+void rate_limit_observe(struct RateLimit* rl, size_t queue_bytes, size_t queue_stanzas) {
+    if (rl->max_queue_bytes < queue_bytes) {
+        rl->max_queue_bytes = queue_bytes;
+    }
+    if (rl->max_queue_stanzas < queue_stanzas) {
+        rl->max_queue_stanzas = queue_stanzas;
+    }
+}
+
+void rate_limit_report(const struct RateLimit* rl) {
+    fprintf(stderr,
+        "INFO: rate limit: throttled for %lld ms in total; max. queue depth: %zu bytes unsent, %zu stanzas in send queue\n",
+        rl->throttled_msec, rl->max_queue_bytes, rl->max_queue_stanzas
+    );
+}
@@ -0,0 +1,123 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#include "xmpp-bridge.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+void router_init(struct Router* r) {
+    r->peers      = NULL; //allocated on first use
+    r->count      = 0;
+    r->capacity   = 0;
+    r->table      = NULL; //allocated by router_build()
+    r->table_mask = 0;
+}
+
+struct Peer* router_add(struct Router* r, const char* jid, int in_fd, int out_fd, int err_fd) {
+    if (r->count == r->capacity) {
+        r->capacity += 4;
+        r->peers     = realloc(r->peers, sizeof(struct Peer) * r->capacity);
+    }
+    struct Peer* peer = &(r->peers[r->count++]);
+
+    //parse the JID once, so that lookups do not need to
+    peer->jid      = jid;
+    peer->bare_len = jid_bare_len(jid);
+    peer->resource = jid[peer->bare_len] == '/' ? jid + peer->bare_len + 1 : NULL;
+    peer->hash     = jid_hash(jid, peer->bare_len);
+    peer->next     = NULL;
+    peer->pid      = 0;
+    peer->done     = false;
+    peer->groupchat = false;
+    peer->journal_seq  = 0;
+    peer->journal_sent = 0;
+    peer->journal_receipts    = RECEIPTS_UNKNOWN;
+    peer->journal_disco_until = -1;
+    peer->journal_warned      = false;
+    io_init(&(peer->io), in_fd, out_fd);
+    io_init(&(peer->err), err_fd, -1);
+    peer->err.eof = err_fd < 0; //never read if there is no fd
+    batch_init(&(peer->batch));
+    return peer;
+}
+
+static bool same_bare_jid(const struct Peer* peer, const char* jid, size_t bare_len, uint32_t hash) {
+    return peer->hash == hash && peer->bare_len == bare_len && strncasecmp(peer->jid, jid, bare_len) == 0;
+}
+
+void router_build(struct Router* r) {
+    //open addressing with linear probing; the table is at most half full
+    size_t size = 8;
+    while (size < 2 * r->count) {
+        size *= 2;
+    }
+    r->table      = calloc(size, sizeof(struct Peer*));
+    r->table_mask = size - 1;
+
+    for (size_t idx = 0; idx < r->count; ++idx) {
+        struct Peer* peer = &(r->peers[idx]);
+        size_t slot = peer->hash & r->table_mask;
+        while (r->table[slot] != NULL) {
+            struct Peer* other = r->table[slot];
+            if (same_bare_jid(other, peer->jid, peer->bare_len, peer->hash)) {
+                //another resource of the same account - chain it
+                while (other->next != NULL) {
+                    other = other->next;
+                }
+                other->next = peer;
+                break;
+            }
+            slot = (slot + 1) & r->table_mask;
+        }
+        if (r->table[slot] == NULL) {
+            r->table[slot] = peer;
+        }
+    }
+}
+
+struct Peer* router_lookup(const struct Router* r, const char* jid) {
+    if (jid == NULL || r->table == NULL) {
+        return NULL;
+    }
+    const size_t bare_len = jid_bare_len(jid);
+    const char* resource  = jid[bare_len] == '/' ? jid + bare_len + 1 : NULL;
+    const uint32_t hash   = jid_hash(jid, bare_len);
+
+    //find the peers with this bare JID
+    size_t slot = hash & r->table_mask;
+    while (r->table[slot] != NULL && !same_bare_jid(r->table[slot], jid, bare_len, hash)) {
+        slot = (slot + 1) & r->table_mask;
+    }
+
+    //a peer with a resource only matches that resource; a peer without a
+    //resource matches any resource
+    struct Peer* fallback = NULL;
+    for (struct Peer* peer = r->table[slot]; peer != NULL; peer = peer->next) {
+        if (peer->resource == NULL) {
+            fallback = peer;
+        }
+        else if (resource != NULL && strcmp(peer->resource, resource) == 0) {
+            return peer;
+        }
+    }
+    return fallback;
+}
@@ -0,0 +1,122 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#define _GNU_SOURCE //mremap
+
+#include "xmpp-bridge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SPILL_GROW_STEP (1<<20)
+
+void spill_init(struct SpillFile* spill, const char* dir) {
+    spill->dir       = dir;
+    spill->fd        = -1; //opened on first use
+    spill->map       = NULL;
+    spill->mapped    = 0;
+    spill->read_pos  = 0;
+    spill->write_pos = 0;
+}
+
+static bool spill_open(struct SpillFile* spill) {
+    //the file is unlinked right away, so it disappears when we exit
+    const size_t len = strlen(spill->dir);
+    char* path = (char*) malloc(len + 32);
+    sprintf(path, "%s/xmpp-bridge-spill.XXXXXX", spill->dir);
+    spill->fd = mkstemp(path);
+    if (spill->fd == -1) {
+        perror("Cannot create spill file");
+        free(path);
+        return false;
+    }
+    unlink(path);
+    free(path);
+    return true;
+}
+
+static bool spill_reserve(struct SpillFile* spill, size_t size) {
+    if (spill->mapped >= size) {
+        return true;
+    }
+
+    const size_t new_size = size + SPILL_GROW_STEP;
+    if (ftruncate(spill->fd, new_size) == -1) {
+        perror("Cannot grow spill file");
+        return false;
+    }
+    void* map = spill->map == NULL
+        ? mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, spill->fd, 0)
+        : mremap(spill->map, spill->mapped, new_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        perror("Cannot map spill file");
+        return false;
+    }
+    spill->map    = (char*) map;
+    spill->mapped = new_size;
+    return true;
+}
+
+bool spill_append(struct SpillFile* spill, const char* data, size_t count) {
+    if (spill->fd == -1 && !spill_open(spill)) {
+        return false;
+    }
+    if (!spill_reserve(spill, spill->write_pos + count)) {
+        return false;
+    }
+    memcpy(spill->map + spill->write_pos, data, count);
+    spill->write_pos += count;
+    return true;
+}
+
+size_t spill_peek(const struct SpillFile* spill, const char** data) {
+    *data = spill->map + spill->read_pos;
+    return spill->write_pos - spill->read_pos;
+}
+
+void spill_consume(struct SpillFile* spill, size_t count) {
+    spill->read_pos += count;
+    if (spill->read_pos < spill->write_pos) {
+        return;
+    }
+
+    //everything was drained - give the disk space back
+    munmap(spill->map, spill->mapped);
+    if (ftruncate(spill->fd, 0) == -1) {
+        perror("Cannot truncate spill file");
+    }
+    spill->map       = NULL;
+    spill->mapped    = 0;
+    spill->read_pos  = 0;
+    spill->write_pos = 0;
+}
+
+void spill_free(struct SpillFile* spill) {
+    if (spill->map != NULL) {
+        munmap(spill->map, spill->mapped);
+    }
+    if (spill->fd != -1) {
+        close(spill->fd);
+    }
+    spill_init(spill, spill->dir);
+}
@@ -17,8 +17,11 @@
 *
 *******************************************************************************/
 
+#define _GNU_SOURCE //pipe2
+
 #include "xmpp-bridge.h"
 
+#include <fcntl.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,20 +29,36 @@
 
 #define STDIN  0
 #define STDOUT 1
+#define STDERR 2
 
 #define MUST_SUCCEED(action) if ((action) < 0) { perror(#action); return false; }
 
-static bool subprocess_setup_child(int argc, char** argv, int fds[4]);
+static bool subprocess_setup_child(int argc, char** argv, int fds[4], int err_fds[2]);
+static bool subprocess_exec(int argc, char** argv);
+
+//Create the pipe for the child's stderr (if requested). The parent's end is
+//close-on-exec, so that other children do not inherit it.
+static bool subprocess_stderr_pipe(bool capture_stderr, int err_fds[2]) {
+    err_fds[0] = err_fds[1] = -1;
+    if (capture_stderr) {
+        MUST_SUCCEED(pipe2(err_fds, O_CLOEXEC));
+    }
+    return true;
+}
 
-bool subprocess_init(int argc, char** argv, pid_t* pid) {
+bool subprocess_init(int argc, char** argv, bool capture_stderr, pid_t* pid, int* err_fd) {
+    *err_fd = -1;
     if (argc == 0) {
         *pid = 0;
         return true;
     }
 
-    int fds[4];
+    int fds[4], err_fds[2];
     MUST_SUCCEED(pipe(fds));
     MUST_SUCCEED(pipe(fds + 2));
+    if (!subprocess_stderr_pipe(capture_stderr, err_fds)) {
+        return false;
+    }
 
     MUST_SUCCEED(close(STDIN));
     MUST_SUCCEED(close(STDOUT));
@@ -48,7 +67,7 @@ bool subprocess_init(int argc, char** argv, pid_t* pid) {
 
     if (*pid == 0) {
         //CHILD
-        subprocess_setup_child(argc, argv, fds);
+        subprocess_setup_child(argc, argv, fds, err_fds);
         //if this returns, something went wrong
         exit(255);
 
@@ -59,18 +78,91 @@ bool subprocess_init(int argc, char** argv, pid_t* pid) {
         for (int i = 0; i < 4; ++i) {
             MUST_SUCCEED(close(fds[i]));
         }
+        if (capture_stderr) {
+            MUST_SUCCEED(close(err_fds[1]));
+            *err_fd = err_fds[0];
+        }
 
         return true;
     }
 }
 
-bool subprocess_setup_child(int argc, char** argv, int fds[4]) {
+bool subprocess_spawn(const char* command, bool capture_stderr, int* in_fd, int* out_fd, int* err_fd, pid_t* pid) {
+    int fds[4], err_fds[2];
+    MUST_SUCCEED(pipe2(fds, O_CLOEXEC));
+    MUST_SUCCEED(pipe2(fds + 2, O_CLOEXEC));
+    if (!subprocess_stderr_pipe(capture_stderr, err_fds)) {
+        return false;
+    }
+
+    MUST_SUCCEED(*pid = fork());
+
+    if (*pid == 0) {
+        //CHILD
+        char* argv[] = { "sh", "-c", (char*) command };
+        subprocess_setup_child(3, argv, fds, err_fds);
+        //if this returns, something went wrong
+        exit(255);
+
+    } else {
+        //PARENT
+        *in_fd  = fds[2];
+        *out_fd = fds[1];
+        *err_fd = err_fds[0];
+        MUST_SUCCEED(close(fds[0]));
+        MUST_SUCCEED(close(fds[3]));
+        if (capture_stderr) {
+            MUST_SUCCEED(close(err_fds[1]));
+        }
+        return true;
+    }
+}
+
+bool subprocess_spawn_worker(int argc, char** argv, int stdin_fd, int* in_fd, pid_t* pid) {
+    int fds[2];
+    MUST_SUCCEED(pipe2(fds, O_CLOEXEC));
+
+    *pid = fork();
+    if (*pid < 0) {
+        perror("fork()");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (*pid == 0) {
+        //CHILD (stderr is inherited)
+        if (dup2(stdin_fd, STDIN) < 0 || dup2(fds[1], STDOUT) < 0) {
+            perror("dup2()");
+            exit(255);
+        }
+        subprocess_exec(argc, argv);
+        //if this returns, something went wrong
+        exit(255);
+
+    } else {
+        //PARENT
+        *in_fd = fds[0];
+        MUST_SUCCEED(close(fds[1]));
+        return true;
+    }
+}
+
+bool subprocess_setup_child(int argc, char** argv, int fds[4], int err_fds[2]) {
     MUST_SUCCEED(dup2(fds[0], STDIN));
     MUST_SUCCEED(dup2(fds[3], STDOUT));
     for (int i = 0; i < 4; ++i) {
         MUST_SUCCEED(close(fds[i]));
     }
+    if (err_fds[1] >= 0) {
+        //(the read end is closed on exec)
+        MUST_SUCCEED(dup2(err_fds[1], STDERR));
+        MUST_SUCCEED(close(err_fds[1]));
+    }
+    return subprocess_exec(argc, argv);
+}
 
+bool subprocess_exec(int argc, char** argv) {
     //prepare an argv[] that is nul-terminated
     char** argv2 = (char**) malloc(sizeof(char*) * (argc + 1));
     if (argv2 == NULL) {
@@ -0,0 +1,299 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#define _GNU_SOURCE //memrchr
+
+#include "xmpp-bridge.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define GROW_STEP     (1<<16)
+#define SHRINK_BYTES  (1<<20) //release buffers larger than this after a burst
+
+//Write the current UTC time as "YYYY-MM-DDTHH:MM:SS.mmmZ" into @a buf.
+static size_t format_timestamp(char* buf, size_t size) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct tm tm;
+    gmtime_r(&ts.tv_sec, &tm);
+    const size_t len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    return len + snprintf(buf + len, size - len, ".%03ldZ", ts.tv_nsec / 1000000);
+}
+
+static int open_transcript(const char* path) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: cannot open transcript %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+//Move the transcript file to "PATH.1" (and the older ones to "PATH.2" etc.),
+//and start a new one.
+static void transcript_rotate(struct Transcript* t) {
+    fsync(t->fd);
+    close(t->fd);
+
+    const size_t len = strlen(t->path) + 16;
+    char from[len], to[len];
+    for (unsigned idx = t->keep; idx > 1; --idx) {
+        snprintf(from, len, "%s.%u", t->path, idx - 1);
+        snprintf(to,   len, "%s.%u", t->path, idx);
+        rename(from, to); //(may not exist yet)
+    }
+    snprintf(to, len, "%s.1", t->path);
+    if ((t->keep > 0 ? rename(t->path, to) : unlink(t->path)) < 0) {
+        fprintf(stderr, "ERROR: cannot rotate transcript %s: %s\n", t->path, strerror(errno));
+    }
+
+    t->fd = open_transcript(t->path);
+    t->file_size = 0;
+}
+
+//Write the given records, and rotate the file whenever it reaches the size
+//limit (between two lines).
+static void transcript_write(struct Transcript* t, const char* data, size_t size) {
+    while (size > 0 && t->fd >= 0) {
+        size_t chunk = size;
+        if (t->max_file_bytes > 0 && t->file_size + size > t->max_file_bytes) {
+            //fill up the file with as many lines as fit
+            const size_t room = t->max_file_bytes > t->file_size ? t->max_file_bytes - t->file_size : 0;
+            const char* nl_pos = room > 0 ? memrchr(data, '\n', room) : NULL;
+            if (nl_pos == NULL && t->file_size > 0) {
+                transcript_rotate(t);
+                continue;
+            }
+            if (nl_pos == NULL) {
+                //a single line longer than the limit gets a file of its own
+                nl_pos = memchr(data, '\n', size);
+            }
+            chunk = nl_pos == NULL ? size : (size_t) (nl_pos - data + 1);
+        }
+
+        const ssize_t written = write(t->fd, data, chunk);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: cannot write transcript %s: %s\n", t->path, strerror(errno));
+            return;
+        }
+        data += written;
+        size -= written;
+        t->file_size += written;
+    }
+}
+
+static void* transcript_writer(void* arg) {
+    struct Transcript* t = (struct Transcript*) arg;
+
+    //the records are collected in t->buffer while this thread writes the
+    //previous batch from its own buffer; then the two are swapped
+    char* buffer = NULL;
+    size_t capacity = 0;
+    bool dirty = false; //written, but not synced yet
+    long long synced_at = clock_msec();
+
+    pthread_mutex_lock(&(t->lock));
+    while (true) {
+        //wait for records, or until it's time to sync
+        while (t->size == 0 && !t->stop) {
+            if (!dirty) {
+                pthread_cond_wait(&(t->wakeup), &(t->lock));
+                continue;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += TRANSCRIPT_FSYNC_MSEC / 1000;
+            deadline.tv_nsec += (TRANSCRIPT_FSYNC_MSEC % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec  += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&(t->wakeup), &(t->lock), &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        //take the records
+        char* data = t->buffer;
+        const size_t size = t->size;
+        const bool stop = t->stop;
+        t->buffer   = buffer;
+        t->size     = 0;
+        buffer      = data;
+        const size_t data_capacity = t->capacity;
+        t->capacity = capacity;
+        capacity    = data_capacity;
+        pthread_mutex_unlock(&(t->lock));
+
+        transcript_write(t, data, size);
+        dirty = dirty || size > 0;
+
+        const long long now = clock_msec();
+        if (dirty && (stop || now - synced_at >= TRANSCRIPT_FSYNC_MSEC) && t->fd >= 0) {
+            fdatasync(t->fd);
+            dirty = false;
+            synced_at = now;
+        }
+        if (capacity > SHRINK_BYTES) {
+            free(buffer);
+            buffer   = NULL;
+            capacity = 0;
+        }
+
+        pthread_mutex_lock(&(t->lock));
+        if (stop && t->size == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(t->lock));
+    free(buffer);
+    return NULL;
+}
+
+bool transcript_init(struct Transcript* t, const char* path, size_t max_file_bytes, unsigned keep) {
+    t->buffer         = NULL; //allocated on first use
+    t->size           = 0;
+    t->capacity       = 0;
+    t->dropped_bytes  = 0;
+    t->stop           = false;
+    t->path           = path;
+    t->max_file_bytes = max_file_bytes;
+    t->keep           = keep;
+
+    t->fd = open_transcript(path);
+    if (t->fd < 0) {
+        return false;
+    }
+    struct stat st;
+    t->file_size = fstat(t->fd, &st) == 0 ? st.st_size : 0;
+
+    pthread_mutex_init(&(t->lock), NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(t->wakeup), &attr);
+    pthread_condattr_destroy(&attr);
+
+    //signals (e.g. SIGUSR1) shall interrupt the event loop, not the writer
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    const int error = pthread_create(&(t->thread), NULL, transcript_writer, t);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (error != 0) {
+        fprintf(stderr, "FATAL: cannot start transcript writer: %s\n", strerror(error));
+        return false;
+    }
+    return true;
+}
+
+//Make room for @a count more bytes in the buffer. Must be called with the lock held.
+static void transcript_reserve(struct Transcript* t, size_t count) {
+    if (t->capacity - t->size < count) {
+        //(grow geometrically, since a burst can collect a lot of records)
+        t->capacity = t->size + count + t->capacity / 2 + GROW_STEP;
+        t->buffer   = realloc(t->buffer, t->capacity);
+    }
+}
+
+void transcript_record(struct Transcript* t, enum TranscriptDirection dir, const char* jid, const char* data, size_t size) {
+    //every line gets the same header: "TIMESTAMP > JID: "
+    char timestamp[64];
+    const size_t timestamp_len = format_timestamp(timestamp, sizeof(timestamp));
+    const size_t jid_len = strlen(jid);
+    const size_t header_len = timestamp_len + 3 + jid_len + 2;
+
+    while (size > 0 && data[size - 1] == '\n') {
+        --size;
+    }
+    size_t line_count = 1;
+    for (const char* nl_pos = data; (nl_pos = memchr(nl_pos, '\n', data + size - nl_pos)) != NULL; ++nl_pos) {
+        ++line_count;
+    }
+    const size_t needed = size + line_count * (header_len + 1) - (line_count - 1);
+
+    pthread_mutex_lock(&(t->lock));
+    if (t->size + needed > TRANSCRIPT_MAX_PENDING) {
+        //the disk is too slow - rather drop records than stall the event loop
+        t->dropped_bytes += needed;
+        pthread_mutex_unlock(&(t->lock));
+        return;
+    }
+    const bool was_empty = t->size == 0;
+
+    if (t->dropped_bytes > 0) {
+        char notice[160];
+        const size_t notice_len = snprintf(notice, sizeof(notice), "%s ! dropped %zu bytes of records because the disk was too slow\n", timestamp, t->dropped_bytes);
+        transcript_reserve(t, notice_len);
+        memcpy(t->buffer + t->size, notice, notice_len);
+        t->size += notice_len;
+        t->dropped_bytes = 0;
+    }
+
+    transcript_reserve(t, needed);
+    const char* end = data + size;
+    while (true) {
+        const char* nl_pos = memchr(data, '\n', end - data);
+        const size_t line_len = (nl_pos == NULL ? end : nl_pos) - data;
+
+        char* out = t->buffer + t->size;
+        memcpy(out, timestamp, timestamp_len);
+        out += timestamp_len;
+        memcpy(out, dir == TRANSCRIPT_SENT ? " > " : " < ", 3);
+        memcpy(out + 3, jid, jid_len);
+        memcpy(out + 3 + jid_len, ": ", 2);
+        memcpy(out + 5 + jid_len, data, line_len);
+        out[5 + jid_len + line_len] = '\n';
+        t->size += header_len + line_len + 1;
+
+        if (nl_pos == NULL) {
+            break;
+        }
+        data = nl_pos + 1;
+    }
+    pthread_mutex_unlock(&(t->lock));
+
+    //(the writer only needs a wakeup when it ran out of records)
+    if (was_empty) {
+        pthread_cond_signal(&(t->wakeup));
+    }
+}
+
+void transcript_close(struct Transcript* t) {
+    pthread_mutex_lock(&(t->lock));
+    t->stop = true;
+    pthread_mutex_unlock(&(t->lock));
+    pthread_cond_signal(&(t->wakeup));
+    pthread_join(t->thread, NULL);
+
+    if (t->fd >= 0) {
+        close(t->fd);
+    }
+    free(t->buffer);
+    pthread_cond_destroy(&(t->wakeup));
+    pthread_mutex_destroy(&(t->lock));
+}
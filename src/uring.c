@@ -0,0 +1,292 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+//A minimal io_uring wrapper (without liburing) for the --io-uring backend.
+//On systems without io_uring, uring_new() always fails, and the poll() loop
+//is used instead.
+
+#include "xmpp-bridge.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct Uring {
+    int fd;
+    //submission queue (shared with the kernel)
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned  sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned  sq_local_tail; //includes SQEs that were not published yet
+    //completion queue (shared with the kernel)
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe* cqes;
+    //the mappings (for uring_free())
+    void*  ring;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+struct Uring* uring_new(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        fprintf(stderr, "INFO: io_uring is not available (%s), using poll() instead\n", strerror(errno));
+        return NULL;
+    }
+    //we need the timeout argument of io_uring_enter() (Linux 5.11), and the
+    //guarantee that completions are never dropped
+    const unsigned required = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_SINGLE_MMAP;
+    if ((params.features & required) != required) {
+        fprintf(stderr, "INFO: io_uring is too old on this kernel, using poll() instead\n");
+        close(fd);
+        return NULL;
+    }
+
+    //map the rings (the SQ and CQ rings share one mapping)
+    size_t ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring_size) {
+        ring_size = cq_size;
+    }
+    const size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    char* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        perror("mmap() on io_uring");
+        if (ring != MAP_FAILED) {
+            munmap(ring, ring_size);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        close(fd);
+        return NULL;
+    }
+
+    struct Uring* r = malloc(sizeof(struct Uring));
+    r->fd            = fd;
+    r->sq_head       = (unsigned*) (ring + params.sq_off.head);
+    r->sq_tail       = (unsigned*) (ring + params.sq_off.tail);
+    r->sq_mask       = *(unsigned*) (ring + params.sq_off.ring_mask);
+    r->sq_array      = (unsigned*) (ring + params.sq_off.array);
+    r->sqes          = sqes;
+    r->sq_local_tail = *(r->sq_tail);
+    r->cq_head       = (unsigned*) (ring + params.cq_off.head);
+    r->cq_tail       = (unsigned*) (ring + params.cq_off.tail);
+    r->cq_mask       = *(unsigned*) (ring + params.cq_off.ring_mask);
+    r->cqes          = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+    r->ring          = ring;
+    r->ring_size     = ring_size;
+    r->sqes_size     = sqes_size;
+    return r;
+}
+
+void uring_free(struct Uring* r) {
+    if (r == NULL) {
+        return;
+    }
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->ring, r->ring_size);
+    close(r->fd); //(this also cancels the operations that are still pending)
+    free(r);
+}
+
+//Publish the prepared SQEs to the kernel, and enter the ring to submit them
+//(and wait for completions if @a flags say so).
+static int uring_enter(struct Uring* r, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned to_submit = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+//Make sure that @a count SQEs can be queued, by submitting the queued ones if
+//the submission queue is too full. Linked SQEs must be reserved together, so
+//that the link is not split across two submissions. Returns false if the
+//kernel does not take the queued SQEs (e.g. EBUSY while completions are
+//backed up); nothing may be queued then.
+static bool uring_reserve(struct Uring* r, unsigned count) {
+    while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + count > r->sq_mask + 1) {
+        const int result = uring_enter(r, 0, 0, NULL, 0);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            perror("io_uring_enter()");
+            return false;
+        }
+    }
+    return true;
+}
+
+//Return a cleared SQE to fill in (which must have been reserved).
+static struct io_uring_sqe* uring_get_sqe(struct Uring* r) {
+    const unsigned idx = r->sq_local_tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &(r->sqes[idx]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    ++r->sq_local_tail;
+    return sqe;
+}
+
+//Queue a poll for @a events on @a fd, and link the next SQE to it, so that
+//the operation does not fail with EAGAIN on a non-blocking fd.
+static void uring_prepare_poll(struct Uring* r, int fd, short events, uint64_t user_data, bool link) {
+    struct io_uring_sqe* sqe = uring_get_sqe(r);
+    sqe->opcode      = IORING_OP_POLL_ADD;
+    sqe->fd          = fd;
+    sqe->poll_events = events;
+    sqe->user_data   = user_data;
+    if (link) {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+}
+
+bool uring_read(struct Uring* r, int fd, void* buf, size_t size, uint64_t user_data) {
+    if (!uring_reserve(r, 2)) {
+        return false;
+    }
+    uring_prepare_poll(r, fd, POLLIN, URING_IGNORE, true);
+    struct io_uring_sqe* sqe = uring_get_sqe(r);
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t) buf;
+    sqe->len       = size;
+    sqe->off       = (uint64_t) -1; //current file position (pipes cannot seek)
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_writev(struct Uring* r, int fd, const struct iovec* iov, int count, uint64_t user_data) {
+    if (!uring_reserve(r, 2)) {
+        return false;
+    }
+    uring_prepare_poll(r, fd, POLLOUT, URING_IGNORE, true);
+    struct io_uring_sqe* sqe = uring_get_sqe(r);
+    sqe->opcode    = IORING_OP_WRITEV;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t) iov;
+    sqe->len       = count;
+    sqe->off       = (uint64_t) -1;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_poll(struct Uring* r, int fd, short events, uint64_t user_data) {
+    if (!uring_reserve(r, 1)) {
+        return false;
+    }
+    uring_prepare_poll(r, fd, events, user_data, false);
+    return true;
+}
+
+void uring_poll_remove(struct Uring* r, uint64_t user_data) {
+    if (!uring_reserve(r, 1)) {
+        return; //(a stale completion is ignored by its user_data anyway)
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(r);
+    sqe->opcode    = IORING_OP_POLL_REMOVE;
+    sqe->addr      = user_data;
+    sqe->user_data = URING_IGNORE;
+}
+
+int uring_wait(struct Uring* r, long long timeout) {
+    struct __kernel_timespec ts;
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t) &ts;
+
+    //submit everything and wait in a single syscall
+    const int result = uring_enter(r, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (result < 0 && errno != ETIME) {
+        return -1;
+    }
+    return 0;
+}
+
+bool uring_next(struct Uring* r, uint64_t* user_data, int* res) {
+    const unsigned head = *(r->cq_head);
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    const struct io_uring_cqe* cqe = &(r->cqes[head & r->cq_mask]);
+    *user_data = cqe->user_data;
+    *res       = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else //no io_uring
+
+struct Uring* uring_new(unsigned entries) {
+    (void) entries;
+    fprintf(stderr, "INFO: io_uring is not supported on this system, using poll() instead\n");
+    return NULL;
+}
+
+//(these are never called without a ring)
+void uring_free(struct Uring* r) {
+    (void) r;
+}
+bool uring_read(struct Uring* r, int fd, void* buf, size_t size, uint64_t user_data) {
+    (void) r; (void) fd; (void) buf; (void) size; (void) user_data;
+    return false;
+}
+bool uring_writev(struct Uring* r, int fd, const struct iovec* iov, int count, uint64_t user_data) {
+    (void) r; (void) fd; (void) iov; (void) count; (void) user_data;
+    return false;
+}
+bool uring_poll(struct Uring* r, int fd, short events, uint64_t user_data) {
+    (void) r; (void) fd; (void) events; (void) user_data;
+    return false;
+}
+void uring_poll_remove(struct Uring* r, uint64_t user_data) {
+    (void) r; (void) user_data;
+}
+int uring_wait(struct Uring* r, long long timeout) {
+    (void) r; (void) timeout;
+    errno = ENOSYS;
+    return -1;
+}
+bool uring_next(struct Uring* r, uint64_t* user_data, int* res) {
+    (void) r; (void) user_data; (void) res;
+    return false;
+}
+
+#endif
@@ -0,0 +1,278 @@
+/*******************************************************************************
+*
+* Copyright 2016 Stefan Majewsky <majewsky@gmx.net>
+*
+* This program is free software: you can redistribute it and/or modify it
+* under the terms of the GNU General Public License as published
+* by the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+
+#define _GNU_SOURCE //memfd_create()
+
+#include "xmpp-bridge.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static char* strdup_or_null(const char* str) {
+    return str == NULL ? NULL : strdup(str);
+}
+
+static void job_free(struct WorkerJob* job) {
+    free(job->from);
+    free(job->id);
+    free(job->thread);
+    free(job->body);
+}
+
+//Account for the time that the current number of workers was busy, before it
+//changes.
+static void workers_update_busy(struct Workers* w, long long now) {
+    w->busy_msec += (long long) w->busy * (now - w->busy_changed_at);
+    w->busy_changed_at = now;
+}
+
+static void workers_update_gauges(const struct Workers* w) {
+    metrics_set(GAUGE_WORKERS_BUSY, w->busy);
+    metrics_set(GAUGE_WORKER_QUEUE_LENGTH, w->queue_count);
+}
+
+//Put the message text into a file in memory that becomes the child's stdin,
+//so that the child can read it at its own pace (or not at all) without us
+//having to feed a pipe. Returns -1 on error.
+static int message_fd(const struct WorkerJob* job) {
+    const int fd = memfd_create("xmpp-bridge-message", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create()");
+        return -1;
+    }
+    //(with a trailing newline, like on stdout in the other modes)
+    const bool add_newline = job->size == 0 || job->body[job->size - 1] != '\n';
+    struct iovec iov[2] = {
+        { job->body, job->size },
+        { "\n", add_newline ? 1 : 0 },
+    };
+    const ssize_t expected = job->size + (add_newline ? 1 : 0);
+    if (writev(fd, iov, 2) != expected || lseek(fd, 0, SEEK_SET) < 0) {
+        perror("write message for worker");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//Start a child for the @a job in the free @a worker slot (which takes
+//ownership of the job). If that fails, the worker is finished right away.
+static void worker_start(struct Workers* w, struct Worker* worker, struct WorkerJob job, long long now) {
+    workers_update_busy(w, now);
+    ++w->busy;
+    worker->job        = job;
+    worker->started_at = now;
+    worker->exited     = false;
+    worker->status     = 0;
+    worker->truncated  = false;
+    w->wait_msec += now - job.queued_at;
+    metrics_observe(HISTOGRAM_WORKER_WAIT_MSEC, now - job.queued_at);
+
+    int in_fd = -1;
+    const int stdin_fd = message_fd(&job);
+    if (stdin_fd < 0 || !subprocess_spawn_worker(w->argc, w->argv, stdin_fd, &in_fd, &(worker->pid))) {
+        fprintf(stderr, "ERROR: could not start worker for message from %s\n", job.from);
+        worker->pid    = -1; //(the slot stays in use until the failure is reported)
+        worker->exited = true;
+        worker->status = -1;
+    }
+    if (stdin_fd >= 0) {
+        close(stdin_fd);
+    }
+    io_init(&(worker->io), in_fd, -1);
+    worker->io.eof = in_fd < 0;
+    workers_update_gauges(w);
+}
+
+void workers_init(struct Workers* w, int argc, char** argv, size_t max_workers, size_t max_queued, long long now) {
+    w->argc        = argc;
+    w->argv        = argv;
+    w->slots       = calloc(max_workers, sizeof(struct Worker));
+    w->max_workers = max_workers;
+    w->busy        = 0;
+    w->queue       = malloc(sizeof(struct WorkerJob) * (max_queued > 0 ? max_queued : 1));
+    w->queue_head  = 0;
+    w->queue_count = 0;
+    w->max_queued  = max_queued;
+    w->started_at      = now;
+    w->busy_changed_at = now;
+    w->busy_msec   = 0;
+    w->wait_msec   = 0;
+    w->run_msec    = 0;
+    w->peak_queued = 0;
+    w->finished    = 0;
+    w->failed      = 0;
+    w->rejected    = 0;
+
+    //a worker that exits without reading its stdout must not kill us
+    signal(SIGPIPE, SIG_IGN);
+}
+
+bool workers_submit(struct Workers* w, const char* from, const char* id, const char* thread, const char* body, size_t size, long long now) {
+    if (w->busy == w->max_workers && w->queue_count == w->max_queued) {
+        ++w->rejected;
+        metrics_count(COUNTER_WORKER_JOBS_REJECTED, 1);
+        return false;
+    }
+
+    struct WorkerJob job;
+    job.from      = strdup(from);
+    job.id        = strdup_or_null(id);
+    job.thread    = strdup_or_null(thread);
+    job.body      = malloc(size > 0 ? size : 1);
+    job.size      = size;
+    job.queued_at = now;
+    memcpy(job.body, body, size);
+
+    if (w->busy < w->max_workers) {
+        for (size_t idx = 0; idx < w->max_workers; ++idx) {
+            if (w->slots[idx].pid == 0) {
+                worker_start(w, &(w->slots[idx]), job, now);
+                return true;
+            }
+        }
+    }
+    w->queue[(w->queue_head + w->queue_count++) % w->max_queued] = job;
+    if (w->queue_count > w->peak_queued) {
+        w->peak_queued = w->queue_count;
+    }
+    workers_update_gauges(w);
+    return true;
+}
+
+void workers_prepare_poll(struct Workers* w, struct PollSet* ps) {
+    for (size_t idx = 0; idx < w->max_workers; ++idx) {
+        struct Worker* worker = &(w->slots[idx]);
+        if (worker->pid > 0) {
+            io_prepare_poll(&(worker->io), ps);
+        }
+    }
+}
+
+void workers_handle_poll(struct Workers* w, const struct PollSet* ps) {
+    for (size_t idx = 0; idx < w->max_workers; ++idx) {
+        struct Worker* worker = &(w->slots[idx]);
+        if (worker->pid <= 0 || worker->exited) {
+            continue;
+        }
+        struct IO* io = &(worker->io);
+        if (!io->eof) {
+            if (!io_handle_poll(io, ps)) {
+                //(the error was reported; the output so far is still sent)
+                io->eof = true;
+            }
+            //cut off a runaway worker (it gets SIGPIPE on its next write)
+            struct ReadBuffer* buf = &(io->in_buf);
+            if (buf->end - buf->start > WORKER_MAX_OUTPUT) {
+                buf->end = buf->start + WORKER_MAX_OUTPUT;
+                worker->truncated = true;
+                io->eof = true;
+            }
+            if (io->eof) {
+                close(io->in_fd);
+                io->in_fd = -1;
+            }
+        }
+        //the reply is complete when the child has closed its stdout and exited
+        if (io->eof) {
+            const pid_t result = waitpid(worker->pid, &(worker->status), WNOHANG);
+            if (result < 0) {
+                perror("waitpid() on worker");
+                worker->status = -1;
+            }
+            worker->exited = result != 0;
+        }
+    }
+}
+
+bool workers_reaping(const struct Workers* w) {
+    for (size_t idx = 0; idx < w->max_workers; ++idx) {
+        const struct Worker* worker = &(w->slots[idx]);
+        if (worker->pid > 0 && worker->io.eof && !worker->exited) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct Worker* workers_finished(struct Workers* w) {
+    for (size_t idx = 0; idx < w->max_workers; ++idx) {
+        struct Worker* worker = &(w->slots[idx]);
+        if (worker->pid != 0 && worker->exited) {
+            return worker;
+        }
+    }
+    return NULL;
+}
+
+void workers_release(struct Workers* w, struct Worker* worker, long long now) {
+    ++w->finished;
+    w->run_msec += now - worker->started_at;
+    metrics_count(COUNTER_WORKER_JOBS, 1);
+    metrics_observe(HISTOGRAM_WORKER_RUN_MSEC, now - worker->started_at);
+    if (worker->status != 0) {
+        ++w->failed;
+        metrics_count(COUNTER_WORKER_JOBS_FAILED, 1);
+    }
+
+    job_free(&(worker->job));
+    io_free(&(worker->io));
+    if (worker->io.in_fd >= 0) {
+        close(worker->io.in_fd);
+    }
+    worker->pid = 0;
+    workers_update_busy(w, now);
+    --w->busy;
+
+    //the slot goes to the oldest queued job
+    if (w->queue_count > 0) {
+        const struct WorkerJob job = w->queue[w->queue_head];
+        w->queue_head = (w->queue_head + 1) % w->max_queued;
+        --w->queue_count;
+        worker_start(w, worker, job, now);
+    }
+    workers_update_gauges(w);
+}
+
+void workers_stop(struct Workers* w) {
+    for (size_t idx = 0; idx < w->max_workers; ++idx) {
+        const struct Worker* worker = &(w->slots[idx]);
+        if (worker->pid > 0 && !worker->exited && kill(worker->pid, SIGTERM) < 0 && errno != ESRCH) {
+            perror("kill() on worker");
+        }
+    }
+    if (w->busy > 0 || w->queue_count > 0) {
+        fprintf(stderr, "WARNING: %zu messages were still being handled by workers, and %zu were queued\n", w->busy, w->queue_count);
+    }
+}
+
+void workers_report(const struct Workers* w, long long now) {
+    const long long elapsed   = now - w->started_at;
+    const long long busy_msec = w->busy_msec + (long long) w->busy * (now - w->busy_changed_at);
+    const unsigned long long finished = w->finished > 0 ? w->finished : 1;
+    fprintf(stderr, "INFO: workers: %llu messages handled (%llu failed, %llu rejected), avg. wait %lld ms, avg. run time %lld ms, peak queue %zu\n",
+        w->finished, w->failed, w->rejected, w->wait_msec / (long long) finished, w->run_msec / (long long) finished, w->peak_queued);
+    fprintf(stderr, "INFO: workers: %.1f%% utilisation of %zu workers\n",
+        elapsed > 0 ? 100.0 * busy_msec / ((double) elapsed * w->max_workers) : 0.0, w->max_workers);
+}
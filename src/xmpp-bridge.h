@@ -20,91 +20,1059 @@
 #ifndef XMPP_BRIDGE_H
 #define XMPP_BRIDGE_H
 
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <strophe.h>
 
 /***** config.c *****/
 
+///A peer configured with --peer or --peer-exec.
+struct PeerSpec {
+    const char* jid;
+    int in_fd, out_fd;   //with --peer
+    const char* command; //with --peer-exec (else NULL)
+};
+
 struct Config {
     const char* jid;
     const char* password;
     const char* peer_jid;
+    const char* server_host;       //with --server (else NULL = lookup via DNS)
+    unsigned short server_port;    //0 = default
+    bool        trust_tls;         //with --trust-tls
+    const char* srv_cache_path;    //with --srv-cache
+    bool        trace_connect;     //with --trace-connect
     bool        show_delayed_messages;
     bool        drop_privileges;
+    long long   flush_interval;    //in msec
+    size_t      max_message_bytes;
+    double      rate_messages;     //per second, or 0 for unlimited
+    double      rate_bytes;        //per second, or 0 for unlimited
+    size_t      max_output_bytes;  //0 = unlimited
+    int         overflow_policy;   //enum OverflowPolicy
+    int         framing;           //enum Framing
+    bool        frame_metadata;    //with --frame-metadata
+    const char* spill_dir;
+    bool        reconnect;
+    size_t      outage_queue_bytes;
+    const char* daemon_path;       //with --daemon
+    const char* via_daemon_path;   //with --via-daemon
+    struct PeerSpec* peer_specs;
+    size_t      peer_spec_count;
+    bool        has_command;       //a command line follows the options
+    bool        capture_stderr;    //with --capture-stderr
+    const char* stderr_prefix;     //with --capture-stderr=PREFIX (else NULL)
+    struct JidFilter* allow;       //with --allow (else NULL)
+    const char* muc_jid;           //ROOM@SERVICE/NICK with --muc (else NULL)
+    const char* muc_nick;          //points into muc_jid
+    struct JidSet* muc_from;       //with --muc-from (else NULL)
+    bool        compress;          //with --compress
+    bool        binary;
+    bool        trace_latency;     //with --trace-latency
+    bool        io_uring;          //with --io-uring
+    const char* transcript_path;   //with --transcript
+    size_t      transcript_max_bytes; //0 = no rotation
+    unsigned    transcript_keep;
+    const char* journal_path;      //with --journal
+    const char* catch_up_path;     //with --catch-up
+    size_t      catch_up_page;     //messages per archive query
+    size_t      max_workers;       //with --workers (else 0)
+    size_t      worker_queue;      //max. number of messages waiting for a worker
+    const char* metrics_path;      //with --metrics-file
+    long long   metrics_interval;  //in msec
+    size_t      ibb_block_size;
+    size_t      ibb_window;
     xmpp_ctx_t* ctx;
     bool        connected;
     bool        connecting;
-    struct IO*  io;
+    struct RateLimit* rate_limit;
+    struct Daemon* daemon;         //NULL unless in --daemon mode
+    struct Router* router;
+    struct Ibb* ibb;               //NULL unless in --binary mode
+    struct Latency* latency;       //NULL unless with --trace-latency
+    struct Transcript* transcript; //NULL unless with --transcript
+    struct Journal* journal;       //NULL unless with --journal
+    struct Mam* mam;               //NULL unless with --catch-up
+    struct Workers* workers;       //NULL unless with --workers
 };
 
 ///Read config from environment
-bool config_init(struct Config* cfg);
+void config_init(struct Config* cfg);
 ///Check argc/argv for configuration options. This consumes them, leaving only
 ///the positional arguments after them in argc/argv.
 bool config_consume_options(struct Config* cfg, int* argc, char*** argv);
+///Check that the config is complete. Errors are reported to stderr.
+bool config_validate(const struct Config* cfg);
+
+/***** clock.c *****/
+
+///Return the current time in milliseconds on a monotonic clock.
+long long clock_msec(void);
+
+/***** connect.c *****/
+
+#define SRV_CACHE_MIN_TTL   60    //in sec (shorter TTLs are rounded up)
+#define SRV_CACHE_MAX_TTL   86400 //in sec
+#define SRV_CACHE_NONE_TTL  300   //in sec, for domains without SRV record
+
+///The XMPP server for a domain, as found in DNS or in the SRV cache.
+struct Endpoint {
+    char host[1025]; //(NS_MAXDNAME)
+    unsigned short port;
+    bool from_cache;
+};
+
+///Find the XMPP server for @a domain, from the cache file at @a cache_path if
+///it has a current entry, or else via an SRV lookup (whose result is then put
+///into the cache). Returns false if no server was found, in which case
+///libstrophe shall do its own lookup.
+bool endpoint_resolve(struct Endpoint* ep, const char* domain, const char* cache_path);
+///Remove the cache entry for @a domain (e.g. after a failed connection).
+void endpoint_forget(const char* domain, const char* cache_path);
+
+enum ConnectPhase {
+    PHASE_DNS,
+    PHASE_TCP,
+    PHASE_TLS,
+    PHASE_SASL,
+    PHASE_BIND,
+    PHASE_COUNT,
+};
+
+///Timing of the phases of a connection attempt (with --trace-connect).
+struct ConnectTrace {
+    long long started_at;            //clock_msec(), or -1 if not connecting
+    long long phase_end[PHASE_COUNT]; //clock_msec(), or -1 if not (yet) seen
+    bool cached;                     //whether the endpoint came from the SRV cache
+    xmpp_log_t log;                  //wraps the inner logger to observe SASL
+    const xmpp_log_t* inner;
+};
+
+///Initialize the trace. Pass &t->log to xmpp_ctx_new() to have the SASL phase
+///traced; all log messages are forwarded to @a inner (which may be NULL).
+void connect_trace_init(struct ConnectTrace* t, const xmpp_log_t* inner);
+void connect_trace_start(struct ConnectTrace* t, long long now);
+///Record the end of @a phase (unless it was already recorded).
+void connect_trace_mark(struct ConnectTrace* t, enum ConnectPhase phase, long long now);
+///Print the duration of each phase to stderr.
+void connect_trace_report(const struct ConnectTrace* t, long long now);
+
+/***** batch.c *****/
+
+///Buffer that collects lines from the input until they are sent together.
+struct Batch {
+    char* buffer;
+    size_t size, capacity;
+    long long deadline; //clock_msec() when the batch is due (if size > 0)
+    long long read_at;  //clock_msec() when the first lines were read
+};
+
+void batch_init(struct Batch* batch);
+
+///Append the given lines (read at @a read_at) to the @a batch (joined with a
+///"\n"). If the @a batch was empty, it will become due at the given @a deadline.
+void batch_add(struct Batch* batch, const char* data, size_t size, long long read_at, long long deadline);
+
+///Like batch_add(), but put the given @a prefix in front of each line.
+void batch_add_prefixed(struct Batch* batch, const char* prefix, const char* data, size_t size, long long read_at, long long deadline);
+
+///Remove all data from the @a batch after it has been sent.
+void batch_clear(struct Batch* batch);
+
+///Find the first chunk of at most @a max_size bytes in the given data, and
+///return its size. Chunks end at a line boundary where possible (the "\n" is
+///not included in the chunk); otherwise long lines are split between UTF-8
+///characters. The number of bytes that must be skipped to get to the next
+///chunk is returned in @a consumed. The returned size may be 0 for empty lines.
+size_t batch_split(const char* data, size_t size, size_t max_size, size_t* consumed);
+
+/***** ratelimit.c *****/
+
+struct TokenBucket {
+    double rate; //tokens per second, or 0 for unlimited
+    double tokens;
+    long long last_refill;
+};
+
+///Token buckets for outbound stanzas and bytes, plus statistics for sizing the
+///limits.
+struct RateLimit {
+    struct TokenBucket messages, bytes;
+    long long throttled_since; //clock_msec(), or -1 while not throttled
+    long long throttled_msec;
+    size_t max_queue_bytes, max_queue_stanzas;
+};
+
+///Setup the token buckets. A rate of 0 disables the respective limit.
+void rate_limit_init(struct RateLimit* rl, double messages_per_sec, double bytes_per_sec);
+
+///Return how many milliseconds to wait until the next message may be sent
+///(or 0 if it may be sent right away).
+long long rate_limit_wait(struct RateLimit* rl, long long now);
+
+///Account for a message of the given size that was sent.
+void rate_limit_take(struct RateLimit* rl, size_t bytes);
+
+///Record the current queue depths (data that was read from the input, but not
+///sent yet, and stanzas waiting in libstrophe's send queue).
+void rate_limit_observe(struct RateLimit* rl, size_t queue_bytes, size_t queue_stanzas);
+
+///Print the statistics on stderr.
+void rate_limit_report(const struct RateLimit* rl);
+
+/***** latency.c *****/
+
+#define LATENCY_PENDING 4096 //max. number of messages awaiting a receipt
+#define LATENCY_SAMPLES 8192 //number of recent samples for the percentiles
+
+struct LatencyEntry {
+    unsigned long long seq; //0 if unused
+    long long read_at, sent_at;
+};
+
+struct LatencySamples {
+    long long* values; //ring buffer of LATENCY_SAMPLES values
+    unsigned long long total;
+};
+
+///Tracks the time from reading a message's text to sending it, and from
+///sending it to receiving its delivery receipt (XEP-0184).
+struct Latency {
+    struct LatencyEntry* pending; //indexed by seq % LATENCY_PENDING
+    unsigned long long nonce;     //distinguishes our stanza ids from those of other processes
+    unsigned long long next_seq;
+    unsigned long long acked, expired;
+    struct LatencySamples read_to_send, send_to_ack, read_to_ack;
+};
+
+void latency_init(struct Latency* lat);
+///Record that a message was sent, and return the sequence number that
+///identifies it (for use in its stanza id).
+unsigned long long latency_sent(struct Latency* lat, long long read_at, long long sent_at);
+///Write the stanza id for the message with the given sequence number into @a buf.
+void latency_format_id(const struct Latency* lat, unsigned long long seq, char* buf, size_t size);
+///Reverse latency_format_id(). Returns 0 if @a id does not belong to us.
+unsigned long long latency_parse_id(const struct Latency* lat, const char* id);
+///Record that the message with the given sequence number was acknowledged.
+void latency_acked(struct Latency* lat, unsigned long long seq, long long acked_at);
+///Print the statistics (including percentiles) on stderr.
+void latency_report(const struct Latency* lat);
+
+/***** transcript.c *****/
+
+#define TRANSCRIPT_FSYNC_MSEC     1000     //how often the writer syncs to disk
+#define TRANSCRIPT_MAX_PENDING    (16<<20) //bytes buffered before records are dropped
+
+enum TranscriptDirection {
+    TRANSCRIPT_SENT,     //written as ">"
+    TRANSCRIPT_RECEIVED, //written as "<"
+};
+
+///Records sent and received messages in a file (with --transcript). The
+///records are collected in memory and written by a background thread, so that
+///the event loop never waits for the disk.
+struct Transcript {
+    pthread_t thread;
+    pthread_mutex_t lock;    //protects the fields below it
+    pthread_cond_t wakeup;
+    char* buffer;            //records that have not been handed to the writer yet
+    size_t size, capacity;
+    size_t dropped_bytes;    //since the last record that was accepted
+    bool stop;
+
+    //only used by the writer thread
+    const char* path;
+    int fd;
+    size_t file_size;
+    size_t max_file_bytes;   //0 = no rotation
+    unsigned keep;           //number of rotated files to keep
+};
+
+///Open the transcript file (appending to it) and start the writer thread.
+bool transcript_init(struct Transcript* t, const char* path, size_t max_file_bytes, unsigned keep);
+///Append a record for every line of the message @a data (with the given
+///direction and @a jid of the peer). This never blocks on the disk.
+void transcript_record(struct Transcript* t, enum TranscriptDirection dir, const char* jid, const char* data, size_t size);
+///Write all remaining records, sync and close the file.
+void transcript_close(struct Transcript* t);
+
+/***** journal.c *****/
+
+#define RECEIPTS_NS         "urn:xmpp:receipts"
+#define JOURNAL_SYNC_MSEC   50      //max. time between appending a record and syncing it to disk
+#define JOURNAL_DRAIN_MSEC  10000   //how long to wait for outstanding receipts before exiting
+#define JOURNAL_RECEIPT_MSEC 10000  //when to warn about a peer that has not sent a receipt
+#define JOURNAL_DISCO_MSEC  5000    //how long to hold back lines while asking a peer about receipts
+#define JOURNAL_MIN_BYTES   (1<<20) //initial size of the journal file
+
+struct Peer; //see router.c
+
+///What we know about a peer's support for delivery receipts (XEP-0184). This
+///is found out anew on every connect.
+enum ReceiptSupport {
+    RECEIPTS_UNKNOWN     = 0, //no answer (yet), so its lines are journaled
+    RECEIPTS_SUPPORTED   = 1,
+    RECEIPTS_UNSUPPORTED = 2, //its lines are not journaled
+};
+
+///The common start of the items in a JournalQueue.
+struct JournalItem {
+    unsigned long long id;  //ascending in each queue
+    bool done;
+};
+
+///FIFO of journal items. Items may be completed in any order, but are only
+///removed from the front.
+struct JournalQueue {
+    char* items;
+    size_t item_size;
+    size_t head, count, capacity; //items[head..count) are in use
+};
+
+///A batch of outbound lines (the id is its sequence number). It is done when
+///it was delivered.
+struct JournalEntry {
+    struct JournalItem item;
+    size_t offset;          //of its record in the journal file
+    const char* jid;        //of the peer (points into the Config)
+};
+
+///The messages that were sent by one send_lines() call. Together, they
+///contain the entries in (first, last] that belong to the peer @a jid.
+struct JournalGroup {
+    struct JournalItem item;
+    const char* jid;
+    struct Peer* peer;
+    unsigned long long first, last;
+    size_t unacked;         //messages without a receipt
+    long long sent_at;      //clock_msec()
+};
+
+///A message that was sent as part of a JournalGroup. It is done when it was
+///acknowledged.
+struct JournalMessage {
+    struct JournalItem item;
+    unsigned long long group;
+};
+
+///Memory-mapped append-only file of outbound lines (with --journal). Lines
+///are appended before they are sent, marked as delivered when the messages
+///containing them are acknowledged, and sent again after a restart otherwise.
+struct Journal {
+    const char* path;
+    int fd;
+    char* map;                    //the whole file
+    size_t map_size;
+    size_t end;                   //where the next record goes
+    size_t synced;                //everything before this offset is on disk
+    long long sync_due;           //clock_msec() of the next group commit, or -1 if nothing is pending
+    unsigned long long nonce;     //distinguishes our stanza ids from those of other processes
+    unsigned long long next_seq, next_group, next_message, next_disco;
+    size_t pending;               //number of entries that were not delivered yet
+    struct JournalQueue entries;  //of struct JournalEntry (ordered by seq)
+    struct JournalQueue groups;   //of struct JournalGroup
+    struct JournalQueue messages; //of struct JournalMessage
+};
+
+///Open the journal file (creating it if necessary), and load the entries that
+///were not delivered before.
+bool journal_init(struct Journal* j, const char* path);
+///Put the entries that were not delivered before into the batches of their
+///peers in @a r, so that they are sent first.
+void journal_replay(struct Journal* j, struct Router* r, long long now);
+///Append the given lines that will be sent to @a peer. They are synced to disk
+///together with the other records of the next JOURNAL_SYNC_MSEC (group
+///commit), but survive a crash of this process right away.
+void journal_append(struct Journal* j, struct Peer* peer, const char* data, size_t size);
+///Start a group of messages that contains everything that was appended for
+///@a peer since the last group. Returns its id, or 0 if the peer does not
+///support receipts (then these entries are considered delivered right away).
+unsigned long long journal_group_begin(struct Journal* j, struct Peer* peer);
+///Register a message of the given group, and write its stanza id into @a buf.
+void journal_message_id(struct Journal* j, unsigned long long group, char* buf, size_t size);
+///Finish the group after its messages were sent. (If there were none, its
+///entries are delivered already.)
+void journal_group_end(struct Journal* j, unsigned long long group);
+///Record that the message with the given stanza id was acknowledged. Once all
+///messages of a group are acknowledged, its entries are marked as delivered.
+void journal_acked(struct Journal* j, const char* id);
+///Forget what was known about the receipt support of the peers in @a r (after
+///connecting), and ask those with a full JID about it (XEP-0030). Their lines
+///are held back until they answer (see journal_may_send()). The userdata of
+///the handlers will be the @a cfg.
+void journal_discover(struct Journal* j, struct Router* r, xmpp_conn_t* conn, struct Config* cfg, long long now);
+///Handler for incoming presences: asks the contact about receipt support on
+///behalf of a peer with its bare JID. The userdata must be the Config.
+int journal_presence_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata);
+///Return whether lines may be sent to @a peer, i.e. it is not being asked
+///about receipt support right now (until its journal_disco_until).
+bool journal_may_send(const struct Peer* peer, long long now);
+///Return whether a message that was sent is still waiting for its receipt
+///(from a peer that may send one).
+bool journal_waiting(const struct Journal* j);
+///Warn about peers that have not sent a receipt within JOURNAL_RECEIPT_MSEC.
+///Their entries stay in the journal, and are sent again on the next start.
+void journal_check_receipts(struct Journal* j, long long now);
+///Sync the new records to disk if they are due (or if @a force is set).
+void journal_sync(struct Journal* j, bool force);
+///Sync and close the journal file.
+void journal_close(struct Journal* j);
+
+/***** metrics.c *****/
+
+enum Counter {
+    COUNTER_MESSAGES_SENT,
+    COUNTER_MESSAGE_BYTES_SENT,
+    COUNTER_MESSAGES_RECEIVED,
+    COUNTER_DROPPED_DELAYED,
+    COUNTER_DROPPED_UNKNOWN,
+    COUNTER_DROPPED_DUPLICATE,
+    COUNTER_WORKER_JOBS,
+    COUNTER_WORKER_JOBS_FAILED,
+    COUNTER_WORKER_JOBS_REJECTED,
+    COUNTER_INPUT_BYTES,
+    COUNTER_OUTPUT_BYTES,
+    COUNTER_OUTPUT_DROPPED_BYTES,
+    COUNTER_OUTPUT_SPILLED_BYTES,
+    COUNTER_CONNECTS,
+    COUNTER_DISCONNECTS,
+    COUNTER_COUNT
+};
+
+enum Gauge {
+    GAUGE_CONNECTED,
+    GAUGE_INPUT_QUEUED_BYTES,
+    GAUGE_OUTPUT_QUEUED_BYTES,
+    GAUGE_SEND_QUEUE_STANZAS,
+    GAUGE_WORKERS_BUSY,
+    GAUGE_WORKER_QUEUE_LENGTH,
+    GAUGE_COUNT
+};
+
+enum HistogramId {
+    HISTOGRAM_CONNECT_MSEC,
+    HISTOGRAM_MESSAGE_BYTES,
+    HISTOGRAM_READ_TO_SEND_MSEC,
+    HISTOGRAM_SEND_TO_ACK_MSEC,
+    HISTOGRAM_READ_TO_ACK_MSEC,
+    HISTOGRAM_WORKER_WAIT_MSEC,
+    HISTOGRAM_WORKER_RUN_MSEC,
+    HISTOGRAM_COUNT
+};
+
+#define HISTOGRAM_BUCKETS 12
+
+struct Histogram {
+    unsigned long long buckets[HISTOGRAM_BUCKETS];
+    unsigned long long count;
+    long long sum;
+};
+
+struct Metrics {
+    unsigned long long counters[COUNTER_COUNT];
+    long long gauges[GAUGE_COUNT];
+    struct Histogram histograms[HISTOGRAM_COUNT];
+};
+
+///The metrics of this process (there is only one set, so that any module can
+///update it without passing it around).
+extern struct Metrics metrics;
+///Set when SIGUSR1 was received; the main loop then dumps the metrics.
+extern volatile sig_atomic_t metrics_dump_requested;
+
+///Reset all metrics, and install the handler for SIGUSR1.
+bool metrics_init(void);
+void metrics_count(enum Counter counter, unsigned long long value);
+void metrics_set(enum Gauge gauge, long long value);
+void metrics_observe(enum HistogramId histogram, long long value);
+///Write all metrics in the Prometheus text format.
+void metrics_write(FILE* file);
+///Atomically replace the file at @a path with the output of metrics_write().
+bool metrics_write_file(const char* path);
 
 /***** security.c *****/
 
 ///Setup the security context for the application. Returns false on error.
 bool sec_init(const struct Config* cfg);
 
+/***** compress.c *****/
+
+///Namespace of the payload element that carries compressed message bodies.
+#define COMPRESS_NS "urn:xmpp-bridge:compressed:0"
+///Refuse to decompress payloads that claim to be larger than this.
+#define DECOMPRESS_MAX_BYTES (16 << 20)
+
+///Compress the given data with zlib and encode it in Base64. Returns NULL if
+///this would not make the data smaller. Otherwise, the result must be freed
+///with xmpp_free().
+char* compress_payload(xmpp_ctx_t* ctx, const char* data, size_t size);
+
+///Reverse compress_payload(), where @a size is the size of the original data.
+///Returns NULL if the payload is invalid. Otherwise, the result must be freed
+///with free(); it has room for one more byte after @a size.
+char* decompress_payload(xmpp_ctx_t* ctx, const char* encoded, size_t encoded_size, size_t size);
+
 /***** subprocess.c *****/
 
 ///If argc/argv are non-empty, launch a child process with that command line,
 ///and setup stdin/stdout as a bidirectional pipe to the child process.
 ///On success, return the PID of the child process in @a pid, or 0 if no child
-///process was launched because argv was empty.
-bool subprocess_init(int argc, char** argv, pid_t* pid);
+///process was launched because argv was empty. With @a capture_stderr, the
+///child's stderr can be read from @a err_fd (else it is -1).
+bool subprocess_init(int argc, char** argv, bool capture_stderr, pid_t* pid, int* err_fd);
+
+///Launch a child process that runs @a command with "sh -c". The child's stdout
+///can be read from @a in_fd, and its stdin can be written to @a out_fd. With
+///@a capture_stderr, its stderr can be read from @a err_fd (else it is -1).
+bool subprocess_spawn(const char* command, bool capture_stderr, int* in_fd, int* out_fd, int* err_fd, pid_t* pid);
+
+///Launch a child process with the command line in argc/argv that reads its
+///stdin from @a stdin_fd. The child's stdout can be read from @a in_fd, and its
+///stderr is inherited.
+bool subprocess_spawn_worker(int argc, char** argv, int stdin_fd, int* in_fd, pid_t* pid);
+
+/***** spill.c *****/
+
+///An append-only, memory-mapped temporary file that takes data which does not
+///fit into the output queue. The bytes in [read_pos, write_pos) are pending.
+struct SpillFile {
+    const char* dir;
+    int fd;
+    char* map;
+    size_t mapped, read_pos, write_pos;
+};
+
+///Setup an empty @a spill that will create its file in @a dir on first use.
+void spill_init(struct SpillFile* spill, const char* dir);
+
+///Append data to the @a spill. On error, return false. The error is reported to
+///stderr.
+bool spill_append(struct SpillFile* spill, const char* data, size_t count);
+
+///Return the number of pending bytes in the @a spill, and a pointer to them in
+///@a data.
+size_t spill_peek(const struct SpillFile* spill, const char** data);
+
+///Remove the given number of bytes from the start of the pending data.
+void spill_consume(struct SpillFile* spill, size_t count);
+
+///Discard all pending data and close the file.
+void spill_free(struct SpillFile* spill);
+
+/***** uring.c *****/
+
+///An io_uring instance (with --io-uring).
+struct Uring;
+
+///The user_data of operations whose completion is of no interest.
+#define URING_IGNORE 0
+
+///Create an io_uring with (at least) @a entries submission slots. If io_uring
+///is not available or too old (before Linux 5.11), report this on stderr and
+///return NULL.
+struct Uring* uring_new(unsigned entries);
+///Close the ring and free its memory (NULL is allowed).
+void uring_free(struct Uring* r);
+///Queue a read() on @a fd (after it becomes readable) into @a buf. This and the
+///following functions return false if the operation could not be queued
+///because the submission queue is full and cannot be submitted right now.
+bool uring_read(struct Uring* r, int fd, void* buf, size_t size, uint64_t user_data);
+///Queue a writev() on @a fd (after it becomes writable). The @a iov must stay
+///valid until the operation completes.
+bool uring_writev(struct Uring* r, int fd, const struct iovec* iov, int count, uint64_t user_data);
+///Queue a one-shot poll for @a events on @a fd.
+bool uring_poll(struct Uring* r, int fd, short events, uint64_t user_data);
+///Cancel the poll that was queued with the given @a user_data.
+void uring_poll_remove(struct Uring* r, uint64_t user_data);
+///Submit all queued operations, and wait until at least one completes or @a
+///timeout (in msec) passes. Returns -1 on error (e.g. EINTR), else 0.
+int uring_wait(struct Uring* r, long long timeout);
+///Take the next completion from the ring, if any.
+bool uring_next(struct Uring* r, uint64_t* user_data, int* res);
 
 /***** io.c *****/
 
-struct Buffer {
+struct OutputSegment {
+    char* data;
+    size_t size;
+};
+
+///Queue of data for writing. The segments in [head, tail) are pending, and the
+///first head_offset bytes of the head segment have already been written.
+struct OutputQueue {
+    struct OutputSegment* segments;
+    size_t head, tail, capacity;
+    size_t head_offset;
+    size_t size;   //number of pending bytes
+    size_t pinned; //segments from head on that are being written by io_uring
+    size_t high_water; //segments used by recent bursts (decays on each restart)
+};
+
+///Buffer for reading lines. The bytes in [start, end) have been read, but not
+///consumed yet, and the bytes in [start, scanned) have already been searched
+///for line terminators. If line_end > start, it points past the last "\n".
+struct ReadBuffer {
     char* buffer;
-    size_t size, capacity;
+    size_t start, end, capacity;
+    size_t scanned, line_end;
+};
+
+///A list of file descriptors to be watched by poll(), which is rebuilt on
+///every iteration of the event loop.
+struct PollSet {
+    struct pollfd* fds;
+    size_t count, capacity;
+    struct Uring* ring;  //with --io-uring (else NULL)
+    uint32_t generation; //distinguishes the polls of this iteration in the ring
+};
+
+void pollset_init(struct PollSet* ps);
+///Add the @a fd to the @a ps, and return its index in ps->fds.
+int pollset_add(struct PollSet* ps, int fd, short events);
+///Return the revents of the entry at the given index (0 if @a idx is -1).
+short pollset_revents(const struct PollSet* ps, int idx);
+///Wait like poll() for the fds in @a ps. With ps->ring, the fds are polled
+///through the ring, which also completes the reads and writes of the IOs that
+///use it; a single io_uring_enter() then submits and waits for everything.
+int pollset_wait(struct PollSet* ps, long long timeout);
+
+///How messages are delimited on the peers' input and output (with --framing).
+enum Framing {
+    FRAMING_LINES,     //each line is a message (the default)
+    FRAMING_NETSTRING, //"LENGTH:PAYLOAD,"
+    FRAMING_LENGTH,    //4-byte big-endian length, then the payload
+};
+
+#define FRAME_MAX_BYTES (16<<20) //larger input frames are rejected
+
+enum FrameStatus {
+    FRAME_NONE,    //no complete frame is available yet
+    FRAME_READY,
+    FRAME_INVALID, //the input is not a valid frame (and cannot be resynced)
+};
+
+///What io_write() does when the output queue is full.
+enum OverflowPolicy {
+    OVERFLOW_PAUSE, //keep the data, but the caller should stop receiving
+    OVERFLOW_DROP,  //drop the oldest data
+    OVERFLOW_SPILL, //write the data to a spill file
 };
 
 struct IO {
     int in_fd, out_fd;
-    struct Buffer in_buf, out_buf;
+    struct ReadBuffer in_buf;
+    struct OutputQueue out_queue;
     bool eof;
+    bool paused; //if set, in_fd is not read from (to apply backpressure)
+    size_t max_queue_bytes; //0 = unlimited
+    enum OverflowPolicy overflow_policy;
+    struct SpillFile spill;
+    size_t dropped_bytes;
+    int poll_in, poll_out; //indices in the PollSet, or -1
+    enum Framing framing;
+    size_t frame_want;     //bytes missing from the incomplete frame at the start of in_buf
+
+    //with io_use_uring(): at most one read and one writev are in flight at a
+    //time; their results are stored by pollset_wait() until io_handle_poll()
+    struct Uring* ring;
+    bool read_pending, write_pending;     //submitted, but not completed
+    bool read_completed, write_completed; //completed, but not handled
+    int read_result, write_result;
+    struct iovec* write_iov;              //of the pending writev
 };
 
-///Setup an empty @a buffer to read from the given @a fd.
+///Setup an empty @a buffer to read from the given @a fd. If @a out_fd is
+///negative, the IO is only used for reading.
 ///@return false on error
 bool io_init(struct IO* io, int in_fd, int out_fd);
 
-///Wait for at most @a usec milliseconds, and perform a single read() on the @a
-///in_fd and a write() on the @a out_fd if they become available within the
-///wait period.
+///Let @a io read and write through the @a ring instead of poll() and
+///read()/write(). This must be called before the IO is first used, and the IO
+///must not be freed while the ring exists.
+void io_use_uring(struct IO* io, struct Uring* ring);
+
+///Fill @a ps with the file descriptors of @a io that need to be watched by
+///poll() (in_fd is skipped while @a paused). With io_use_uring(), queue the
+///reads and writes in the ring instead.
+void io_prepare_poll(struct IO* io, struct PollSet* ps);
+
+///After poll() has returned, perform a single read() on the @a in_fd and
+///write as much as possible to the @a out_fd if they were reported as ready in
+///@a ps (as filled by io_prepare_poll()).
 ///On error, return false. The error is reported to stderr.
 ///Otherwise, return true. On EOF of @a in_fd, also set @a eof.
-bool io_select(struct IO* io, int usec);
+bool io_handle_poll(struct IO* io, const struct PollSet* ps);
+
+///Like io_getlines(), but returns the data that was read (up to @a max_size
+///bytes), regardless of line boundaries.
+bool io_getdata(struct IO* io, const char** data, size_t* size, size_t max_size);
+
+///Release all memory held by @a io (but do not close its file descriptors).
+void io_free(struct IO* io);
 
-///Copy the given data into the write buffer of the given @a io. The data will
+///Limit the output queue to @a max_bytes bytes (0 = unlimited), and choose what
+///happens to further data when the output queue is full.
+void io_set_queue_limit(struct IO* io, size_t max_bytes, enum OverflowPolicy policy, const char* spill_dir);
+
+///Delimit the messages on @a io with the given @a framing instead of newlines.
+///Framed input is not scanned for newlines.
+void io_set_framing(struct IO* io, enum Framing framing);
+
+///Return whether the output queue has reached its limit.
+bool io_output_full(const struct IO* io);
+
+///Return whether all output has been written (including spilled output).
+bool io_output_empty(const struct IO* io);
+
+///Copy the given data into the write queue of the given @a io. The data will
 ///be written on the IO's out_fd when the out_fd is available for writing the
 ///next time.
 void io_write(struct IO* io, const char* data, size_t count);
 
-///If @a buffer contains a whole line (including the "\n"), remove the line
-///from the buffer and return it (with the "\n" trimmed). If multiple whole
-///lines are available, remove them all from the buffer and return them
-///(separated by "\n", but with the trailing "\n" removed).
+///If the input buffer contains a whole line (including the "\n"), remove the
+///line from the buffer and return it (with the "\n" trimmed) in @a data and
+///@a size. If multiple whole lines are available, remove them all from the
+///buffer and return them (separated by "\n", but with the trailing "\n"
+///removed). After EOF, the last unterminated line is returned as well.
 ///
-///Returns NULL if no full line is available. The caller must free() the
-///returned pointer.
-char* io_getlines(struct IO* io);
+///Returns false if no non-empty line is available. The returned data is not
+///NUL-terminated and points into the input buffer, so it only stays valid until
+///the next call to io_handle_poll().
+bool io_getlines(struct IO* io, const char** data, size_t* size);
+
+///Like io_getlines(), but for an IO with io_set_framing(): remove the next
+///complete frame from the input buffer, and return its payload in @a data and
+///@a size. Empty frames are skipped. On FRAME_INVALID, the error has been
+///reported to stderr.
+enum FrameStatus io_getframe(struct IO* io, const char** data, size_t* size);
+
+///Queue a frame with the given payload for writing on an IO with
+///io_set_framing(). If @a fields is not NULL, it is a NULL-terminated list of
+///metadata strings that are put in front of the payload, each terminated by a
+///NUL byte.
+void io_write_frame(struct IO* io, const char* const* fields, const char* data, size_t size);
+
+/***** ibb.c *****/
+
+enum IbbState {
+    IBB_IDLE,    //not opened yet
+    IBB_OPENING, //waiting for the peer to accept the stream
+    IBB_OPEN,
+    IBB_CLOSING, //waiting for the peer to acknowledge the close
+    IBB_CLOSED,
+    IBB_FAILED,
+};
+
+///State of the In-Band Bytestreams (XEP-0047) of --binary mode: one outgoing
+///stream carrying our input, and one incoming stream carrying our output.
+struct Ibb {
+    size_t block_size;
+    size_t window;      //max. number of unacknowledged data packets
+    //outgoing stream
+    enum IbbState state;
+    char* sid;
+    uint16_t send_seq;
+    unsigned long long next_id;
+    size_t in_flight;
+    //incoming stream
+    char* recv_sid;     //NULL until the peer opens its stream
+    uint16_t recv_seq;
+    bool recv_closed;
+    //statistics
+    long long started_at, finished_at;
+    unsigned long long bytes_sent, bytes_received;
+    size_t blocks_sent, blocks_received;
+};
+
+void ibb_init(struct Ibb* ibb, size_t block_size, size_t window);
+///Ask the peer at @a to to accept our outgoing stream.
+void ibb_open(struct Ibb* ibb, xmpp_conn_t* conn, struct Config* cfg, const char* to);
+///Return whether another data packet may be sent.
+bool ibb_ready(const struct Ibb* ibb);
+///Send @a data (at most block_size bytes) as the next data packet.
+void ibb_send(struct Ibb* ibb, xmpp_conn_t* conn, struct Config* cfg, const char* to, const char* data, size_t size);
+void ibb_close(struct Ibb* ibb, xmpp_conn_t* conn, struct Config* cfg, const char* to);
+///Handler for incoming IBB iqs. The userdata must be the Config.
+int ibb_handler(xmpp_conn_t* const conn, xmpp_stanza_t* const stanza, void* const userdata);
+///Print the statistics on stderr.
+void ibb_report(const struct Ibb* ibb);
+
+/***** mam.c *****/
+
+#define MAM_NS         "urn:xmpp:mam:2"
+#define MAM_SEEN_IDS   8192 //ids per generation of the duplicate filter (power of 2)
+#define MAM_SAVE_MSEC  1000 //how long a new last-seen id may go unsaved
+
+///Fixed-memory set of recently seen stanza ids (stored as 64-bit hashes). New
+///ids go into the current generation; when that is full, it replaces the
+///previous one, so that at least the last MAM_SEEN_IDS ids are remembered.
+struct SeenSet {
+    uint64_t* current;  //hash tables with 2*MAM_SEEN_IDS slots (0 = empty)
+    uint64_t* previous;
+    size_t count;       //ids in current
+};
+
+///State of catching up on missed messages from the message archive (XEP-0313)
+///with --catch-up.
+struct Mam {
+    const char* state_path;
+    size_t page_size;
+    char* last_id;          //archive id of the newest handled message (NULL if unknown)
+    long long save_due;     //clock_msec() when last_id shall be saved, or -1 if it was
+    char query_id[32];      //of the running query ("" if none)
+    bool initial;           //the query only looks up the newest id (without a last_id)
+    unsigned long long next_query;
+    size_t caught_up, duplicates; //during the running catch-up
+    struct SeenSet seen;
+};
+
+///Load the last-seen id from the @a state_path (if it exists).
+bool mam_init(struct Mam* mam, const char* state_path, size_t page_size);
+///Start querying the archive for the messages after the last-seen id. The
+///userdata of the handlers will be the @a cfg.
+void mam_start(struct Mam* mam, xmpp_conn_t* conn, struct Config* cfg);
+///Return whether the catch-up is still running.
+bool mam_catching_up(const struct Mam* mam);
+///If @a stanza is a result of the running query (from our own account
+///@a own_jid), return the archived message in it, and its archive id in @a id.
+///Otherwise, return NULL.
+xmpp_stanza_t* mam_result(struct Mam* mam, xmpp_stanza_t* stanza, const char* own_jid, const char** id);
+///Return the stanza id that our server assigned to the live message @a stanza
+///(XEP-0359), or NULL. This is the same as its archive id.
+const char* mam_stanza_id(xmpp_stanza_t* stanza, const char* own_jid);
+///Return whether the message with the given archive/stanza @a id was seen
+///before (and count it as a duplicate), and remember it otherwise.
+bool mam_seen(struct Mam* mam, const char* id);
+///Record that the message with the given @a id was handled, so that the next
+///catch-up starts after it.
+void mam_advance(struct Mam* mam, const char* id);
+///Save the last-seen id if that is due (or if @a force is set).
+void mam_save(struct Mam* mam, bool force);
+
+/***** daemon.c *****/
+
+struct DaemonClient {
+    struct IO io; //in_fd and out_fd are the same socket
+    bool failed;
+};
+
+///State for --daemon mode, where the XMPP connection is shared by the clients
+///that connect to a Unix socket.
+struct Daemon {
+    const char* path;
+    const struct Config* cfg;
+    int listen_fd;
+    int poll_listen; //index in the PollSet
+    struct DaemonClient* clients;
+    size_t client_count, client_capacity;
+    size_t next_client;
+    uid_t owner_uid; //only clients of this user (or root) are accepted
+};
+
+///Start listening on the Unix socket at @a path (accessible only to its owner).
+///Returns false on error.
+bool daemon_init(struct Daemon* d, const char* path, const struct Config* cfg);
+
+///Add the listening socket and the clients to the @a ps. The clients' input is
+///not read while @a paused.
+void daemon_prepare_poll(struct Daemon* d, struct PollSet* ps, bool paused);
+
+///Accept new clients, and perform IO on existing clients.
+void daemon_handle_poll(struct Daemon* d, const struct PollSet* ps);
+
+///Like io_getlines(), but for the next client (in round-robin order) that has
+///sent full lines.
+bool daemon_getlines(struct Daemon* d, const char** data, size_t* size);
+
+///Disconnect clients that have reached EOF or failed.
+void daemon_cleanup(struct Daemon* d);
+
+///Send the given data to all clients.
+void daemon_write(struct Daemon* d, const char* data, size_t count);
+
+///Return whether the output queue of any client has reached its limit.
+bool daemon_output_full(const struct Daemon* d);
+
+///Run in --via-daemon mode: relay stdin and stdout to and from the daemon
+///listening on @a path until the daemon disconnects. Returns false on error.
+bool daemon_client_run(const char* path);
+
+/***** workers.c *****/
+
+#define WORKER_MAX_OUTPUT (1<<20) //bytes of output per message before the worker is cut off
+#define WORKER_REAP_MSEC  10      //how often to check for the exit of a worker that closed its stdout
+
+///A message that waits for a worker, or is being handled by one.
+struct WorkerJob {
+    char* from;          //full JID of the sender (where the reply goes)
+    char* id;            //stanza id of the message, or NULL
+    char* thread;        //<thread> of the message, or NULL
+    char* body;
+    size_t size;
+    long long queued_at; //clock_msec()
+};
+
+///A child process that handles one message (with --workers).
+struct Worker {
+    pid_t pid;           //0 if the slot is free
+    struct IO io;        //reads the child's stdout
+    struct WorkerJob job;
+    long long started_at;
+    bool exited;
+    int status;          //as reported by waitpid(), or -1 if the child could not be started
+    bool truncated;      //output beyond WORKER_MAX_OUTPUT was cut off
+};
+
+///Pool of worker processes with --workers: every message from the peer runs
+///the command line in its own child process (with the message on stdin), and
+///the child's output is sent back to the sender as a reply. At most
+///max_workers children run at once; further messages wait in a bounded queue.
+struct Workers {
+    int argc;
+    char** argv;
+    struct Worker* slots;
+    size_t max_workers, busy;
+    struct WorkerJob* queue;       //ring buffer of max_queued jobs
+    size_t queue_head, queue_count, max_queued;
+    //statistics
+    long long started_at, busy_changed_at;
+    long long busy_msec;           //integral of the number of busy workers over time
+    long long wait_msec, run_msec; //summed over all finished jobs
+    size_t peak_queued;
+    unsigned long long finished, failed, rejected;
+};
+
+///Setup an idle pool for the given command line.
+void workers_init(struct Workers* w, int argc, char** argv, size_t max_workers, size_t max_queued, long long now);
+///Hand a message from @a from to the next free worker, or queue it. Returns
+///false if the queue is full, so that the message is rejected.
+bool workers_submit(struct Workers* w, const char* from, const char* id, const char* thread, const char* body, size_t size, long long now);
+///Add the stdout of the running workers to the @a ps.
+void workers_prepare_poll(struct Workers* w, struct PollSet* ps);
+///Read from the workers, and check whether they have exited.
+void workers_handle_poll(struct Workers* w, const struct PollSet* ps);
+///Return whether a worker has closed its stdout, but was not seen exiting yet
+///(then it must be checked again after WORKER_REAP_MSEC).
+bool workers_reaping(const struct Workers* w);
+///Return a worker whose child has exited and whose output was read completely,
+///or NULL. Its output can then be taken with io_getdata().
+struct Worker* workers_finished(struct Workers* w);
+///Free the slot of a finished @a worker, and start the next queued job in it.
+void workers_release(struct Workers* w, struct Worker* worker, long long now);
+///Send SIGTERM to the running workers, and drop the queued jobs.
+void workers_stop(struct Workers* w);
+///Print the statistics on stderr.
+void workers_report(const struct Workers* w, long long now);
+
+/***** router.c *****/
+
+///A peer that we exchange messages with, and the IO that is bound to it.
+struct Peer {
+    const char* jid;
+    size_t bare_len;
+    const char* resource; //points into jid, or NULL if jid has no resource
+    uint32_t hash;        //of the bare JID
+    struct Peer* next;    //next peer with the same bare JID
+    struct IO io;
+    struct IO err;        //the child's stderr with --capture-stderr (else at EOF)
+    struct Batch batch;
+    pid_t pid;            //of the child process from --peer-exec, or 0
+    bool done;            //EOF was reached and all input was sent
+    bool groupchat;       //jid is a MUC room (with --muc)
+    unsigned long long journal_seq;  //of the last entry appended for this peer (with --journal)
+    unsigned long long journal_sent; //of the last entry that was sent to this peer
+    int journal_receipts;            //enum ReceiptSupport (since the last connect)
+    long long journal_disco_until;   //clock_msec() until which lines are held back for the answer about receipts, or -1
+    bool journal_warned;             //about missing receipts (since the last connect)
+};
+
+///Dispatch table that maps the JID of incoming stanzas to peers.
+struct Router {
+    struct Peer* peers;
+    size_t count, capacity;
+    struct Peer** table; //hash table on the bare JID
+    size_t table_mask;
+};
+
+void router_init(struct Router* r);
+
+///Add a peer. This may only be called before router_build(). If @a err_fd is
+///not negative, the lines read from it are sent to the peer as well.
+struct Peer* router_add(struct Router* r, const char* jid, int in_fd, int out_fd, int err_fd);
+
+///Build the dispatch table after all peers have been added.
+void router_build(struct Router* r);
+
+///Find the peer to which messages from the given JID shall be delivered, or
+///return NULL. A peer with a resource only matches that resource, and a peer
+///without a resource matches any (or no) resource. This does not allocate.
+struct Peer* router_lookup(const struct Router* r, const char* jid);
 
 /***** jid.c *****/
 
+///A JID split into its parts. The localpart and domain are lowercased.
+struct Jid {
+    char* local;    //NULL if the JID has no localpart
+    char* domain;
+    char* resource; //NULL if the JID has no resource
+};
+
+///Parse and normalize the given JID into @a jid (which must be freed with
+///jid_free() afterwards, even if the JID is invalid).
+bool jid_parse(const char* str, struct Jid* jid);
+void jid_free(struct Jid* jid);
+
+///Return whether @a jid is a valid JID with a localpart.
 bool validate_jid(const char* jid);
 
-///Return whether the actual JID matches the expected one.
-///If the @a actual_jid has a resource, then the @a expected_jid must also have
-///that resource. If the @a actual_jid does not have a resource, then the @a
-///expected_jid may have any (or no resource).
-bool match_jid(const char* actual_jid, const char* expected_jid);
+///Return the length of the bare JID at the start of @a jid (i.e. without the
+///resource).
+size_t jid_bare_len(const char* jid);
+
+///Hash the first @a len bytes of @a str, ignoring ASCII case.
+uint32_t jid_hash(const char* str, size_t len);
+
+struct JidSetEntry {
+    char* str; //NULL for empty slots
+    size_t len;
+    uint32_t hash;
+};
+
+///An open-addressing hash set of normalized JIDs or domains.
+struct JidSet {
+    struct JidSetEntry* entries;
+    size_t mask;
+    size_t count;
+};
+
+///A set of allow rules for sender JIDs. Each rule type is kept in its own
+///hash set, so matching a JID costs at most three lookups regardless of the
+///number of rules.
+struct JidFilter {
+    struct JidSet full;    //"user@domain/resource"
+    struct JidSet bare;    //"user@domain" or "user@domain/*"
+    struct JidSet domains; //"*@domain" or "@domain"
+};
+
+///Add a copy of @a str to the @a set.
+void jid_set_add(struct JidSet* set, const char* str);
+///Check if the @a set contains the first @a len bytes of @a str, whose hash
+///is @a hash. Only the first @a icase_len bytes are compared
+///case-insensitively.
+bool jid_set_contains(const struct JidSet* set, const char* str, size_t len, size_t icase_len, uint32_t hash);
+
+void jid_filter_init(struct JidFilter* filter);
+///Add a rule to the @a filter. Returns false if the rule is malformed.
+bool jid_filter_add(struct JidFilter* filter, const char* rule);
+///Return whether @a jid (as received in a stanza) matches any rule.
+bool jid_filter_match(const struct JidFilter* filter, const char* jid);
 
 #endif // XMPP_BRIDGE_H